@@ -0,0 +1,1689 @@
+/* 
+ * batch.c
+ *
+ * Copyright 2024 Clay Gomera
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-only
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <ctype.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <math.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "unicon.h"
+#include "batch.h"
+#include "uring.h"
+
+// Struct for the input side of a batch run. Mapped files are cut into
+// chunks in place, streams are read into each chunk's storage with the
+// partial last line carried over to the next one. Binary input is cut at
+// whole records of record_size bytes instead of lines.
+typedef struct _Reader {
+    size_t record_size;
+    int fd;
+    // Ask the kernel to read the next chunk of a mapped file ahead
+    bool prefetch;
+    const char *map;
+    size_t map_len;
+    size_t map_pos;
+    char *carry;
+    size_t carry_len;
+    size_t carry_capacity;
+    bool started;
+    bool eof;
+} Reader;
+
+// Tags of the io_uring requests of a batch run
+enum {
+    TAG_READ = 1,
+    TAG_WRITE
+};
+
+// Struct for the file I/O of a batch run. With io_uring a converted chunk
+// is written out while the next one is read; only one write is in flight
+// at a time so the output stays in input order.
+typedef struct _BatchIO {
+    Uring ring;
+    bool uring;
+    // The chunk being written and how much of it is out already
+    Chunk *writing;
+    size_t written;
+    bool write_failed;
+    // The result of the read being waited for
+    int read_result;
+    bool read_done;
+} BatchIO;
+
+// Struct for the worker threads of a parallel batch run. Chunks form a
+// ring: the main thread reads into free slots and writes finished ones
+// out in order, while workers claim the next unclaimed chunk, so a slow
+// chunk never holds up the others.
+typedef struct _Pool {
+    const Batch *batch;
+    Chunk *chunks;
+    size_t nchunks;
+    size_t next_read;
+    size_t next_work;
+    bool stop;
+    // Statistics and, for mixed unit input, expression caches per thread,
+    // the main thread's first
+    Stats *stats;
+    UniconExpressionCache **expressions;
+    size_t workers;
+    pthread_mutex_t lock;
+    pthread_cond_t work;
+    pthread_cond_t finished;
+} Pool;
+
+// Function to remember a rejected record of a chunk
+static void addRecordError(Chunk *chunk, const char *text, size_t len) {
+    chunk->stats->errors++;
+    if (chunk->nerrors == chunk->errors_capacity) {
+        size_t capacity = chunk->errors_capacity ? chunk->errors_capacity * 2 : 16;
+        RecordError *errors = countedRealloc(chunk->errors, capacity * sizeof(*errors));
+        if (errors == NULL) {
+            return;
+        }
+        chunk->errors = errors;
+        chunk->errors_capacity = capacity;
+    }
+    chunk->errors[chunk->nerrors++] = (RecordError){chunk->lines, text, len};
+}
+
+// Function to get the size of the records of a binary format, 0 for the
+// text formats read a line at a time
+size_t recordSize(OutputFormat format) {
+    switch (format) {
+        case FORMAT_F64LE:
+            return sizeof(double);
+        case FORMAT_F32LE:
+            return sizeof(float);
+        case FORMAT_U64LE:
+            return sizeof(uint64_t);
+        default:
+            return 0;
+    }
+}
+
+// Function to check and compile the conversions from the source unit to
+// every target, once for the whole run, so the values are then converted
+// without any checks. Returns false when a target measures something
+// else, storing it in failed and why in error when they are not NULL.
+bool compileTargets(Batch *batch, size_t *failed, UniconCheckError *error) {
+    for (size_t t = 0; t < batch->ntargets; t++) {
+        Target *target = &batch->targets[t];
+        UniconCheckError check;
+        int status = unicon_expression_check(&batch->from, &target->unit, &check);
+        if (status == UNICON_OK) {
+            status = unicon_expression_compile(batch->registry, &batch->from, &target->unit, &target->conv);
+        }
+        if (status == UNICON_OK) {
+            status = unicon_expression_compile_exact(batch->registry, &batch->from, &target->unit, &target->exact_conv);
+        }
+        if (status == UNICON_OK && batch->format == FORMAT_U64LE) {
+            // Only plain units have exact sizes, not expressions
+            status = (batch->from.unit < 0 || target->unit.unit < 0)
+                         ? UNICON_EINEXACT
+                         : unicon_registry_compile_integer(batch->registry, batch->from.unit, target->unit.unit,
+                                                           &target->integer_conv);
+        }
+        if (status != UNICON_OK) {
+            check.status = status;
+            if (failed != NULL) {
+                *failed = t;
+            }
+            if (error != NULL) {
+                *error = check;
+            }
+            return false;
+        }
+    }
+    return true;
+}
+
+// Names of the reductions of --aggregate
+static const char *const aggregate_names[NAGGREGATES] = {"sum", "min", "max", "mean", "count"};
+
+// Function to read a comma separated list of reductions for --aggregate
+bool parseAggregates(const char *list, Batch *batch) {
+    batch->naggregates = 0;
+    for (const char *p = list;;) {
+        size_t len = strcspn(p, ",");
+        size_t kind = 0;
+        while (kind < NAGGREGATES && (strlen(aggregate_names[kind]) != len || strncmp(p, aggregate_names[kind], len) != 0)) {
+            kind++;
+        }
+        if (kind == NAGGREGATES || batch->naggregates == NAGGREGATES) {
+            fprintf(stderr, "Invalid aggregate list '%s'. Use any of sum, min, max, mean and count.\n", list);
+            return false;
+        }
+        batch->aggregates[batch->naggregates++] = (AggregateKind)kind;
+        if (p[len] == '\0') {
+            return true;
+        }
+        p += len + 1;
+    }
+}
+
+// Function to start an empty reduction
+static void initAggregate(Aggregate *aggregate) {
+    *aggregate = (Aggregate){0, 0, 0, INFINITY, -INFINITY};
+}
+
+// Function to add a value to the compensated sum of a reduction
+static void addSum(Aggregate *aggregate, double value) {
+    double sum = aggregate->sum + value;
+    if (fabs(aggregate->sum) >= fabs(value)) {
+        aggregate->compensation += (aggregate->sum - sum) + value;
+    } else {
+        aggregate->compensation += (value - sum) + aggregate->sum;
+    }
+    aggregate->sum = sum;
+}
+
+// Function to sum an array pairwise, so rounding errors grow with log n
+// rather than n. The leaves keep four independent sums the compiler can
+// hold in one vector register.
+static double pairwiseSum(const double *values, size_t n) {
+    if (n > 32) {
+        size_t half = n / 2;
+        return pairwiseSum(values, half) + pairwiseSum(values + half, n - half);
+    }
+    double lanes[4] = {0, 0, 0, 0};
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        for (size_t j = 0; j < 4; j++) {
+            lanes[j] += values[i + j];
+        }
+    }
+    for (; i < n; i++) {
+        lanes[0] += values[i];
+    }
+    return (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+}
+
+// Function to add a block of converted values to a reduction
+static void aggregateValues(Aggregate *aggregate, const double *values, size_t n) {
+    double min = aggregate->min, max = aggregate->max;
+    for (size_t i = 0; i < n; i++) {
+        min = values[i] < min ? values[i] : min;
+        max = values[i] > max ? values[i] : max;
+    }
+    aggregate->min = min;
+    aggregate->max = max;
+    aggregate->count += n;
+    addSum(aggregate, pairwiseSum(values, n));
+}
+
+// Function to merge the reduction of a chunk into the total
+static void mergeAggregate(Aggregate *total, const Aggregate *part) {
+    total->count += part->count;
+    addSum(total, part->sum);
+    addSum(total, part->compensation);
+    total->min = part->min < total->min ? part->min : total->min;
+    total->max = part->max > total->max ? part->max : total->max;
+}
+
+// Function to print the reductions of a run, one line per reduction with
+// its value in every target unit
+static void printAggregates(const Batch *batch, const Aggregate *totals) {
+    int decimal_places = (batch->round_places >= 0) ? batch->round_places : 2;
+    OutputFormat format = (batch->format == FORMAT_SHORTEST) ? FORMAT_SHORTEST : FORMAT_FIXED;
+    // -r sets no bound on the length of a number, so it goes on the heap
+    OutBuffer text = {0};
+    if (reserveOutput(&text, UNICON_FORMAT_MAX(decimal_places)) == NULL) {
+        perror("unicon");
+        return;
+    }
+    for (size_t i = 0; i < batch->naggregates; i++) {
+        AggregateKind kind = batch->aggregates[i];
+        if (kind == AGGREGATE_COUNT) {
+            printf("count = %lu\n", totals[0].count);
+            continue;
+        }
+        printf("%s = ", aggregate_names[kind]);
+        for (size_t t = 0; t < batch->ntargets; t++) {
+            const Aggregate *total = &totals[t];
+            double value = NAN;
+            if (total->count > 0) {
+                value = (kind == AGGREGATE_SUM) ? total->sum + total->compensation
+                      : (kind == AGGREGATE_MIN) ? total->min
+                      : (kind == AGGREGATE_MAX) ? total->max
+                      : (total->sum + total->compensation) / total->count;
+            }
+            formatNumber(text.data, text.capacity, value, format, decimal_places);
+            // The target suffixes end in ", " or a newline already
+            printf("%s%s", text.data, batch->targets[t].suffix);
+        }
+    }
+    free(text.data);
+}
+
+// Function to convert a block of values to one target, in double or, for
+// --exact, long double precision
+static void applyTarget(const Batch *batch, const Target *target, const double *in, double *out, size_t n) {
+    if (batch->exact) {
+        unicon_apply_array_exact(&target->exact_conv, in, out, n, batch->round_places);
+    } else {
+        unicon_apply_array(&target->conv, in, out, n, batch->round_places);
+    }
+}
+
+// Function to convert the complete lines of a chunk into its output
+// buffer, the last line may lack its line terminator
+void convertLines(const Batch *batch, Chunk *chunk) {
+    int decimal_places = (batch->round_places >= 0) ? batch->round_places : 2;
+    size_t record_max = UNICON_FORMAT_MAX(decimal_places) + batch->from_suffix_len;
+    for (size_t t = 0; t < batch->ntargets; t++) {
+        record_max += UNICON_FORMAT_MAX(decimal_places) + batch->targets[t].suffix_len;
+    }
+    int type = batch->from.type;
+    double values[BATCH_BLOCK_SIZE];
+    double results[BATCH_MAX_TARGETS][BATCH_BLOCK_SIZE];
+    size_t count = 0;
+    bool block_open = false, timed = false;
+    uint64_t parse_start = 0;
+    const char *data = chunk->data;
+    const char *end = data + chunk->len;
+
+    while (data < end) {
+        const char *eol = memchr(data, '\n', end - data);
+        const char *next = eol ? eol + 1 : end;
+        eol = eol ? eol : end;
+        chunk->lines++;
+
+        // Sampled blocks are timed from their first line
+        if (!block_open) {
+            block_open = true;
+            timed = sampleStats(chunk->stats);
+            parse_start = timed ? statsNow() : 0;
+        }
+
+        // Trim surrounding whitespace and skip blank lines
+        while (data < eol && isspace((unsigned char)*data)) {
+            data++;
+        }
+        while (eol > data && isspace((unsigned char)eol[-1])) {
+            eol--;
+        }
+        if (data < eol) {
+            if (unicon_parse_number(data, eol, &values[count]) == eol) {
+                count++;
+            } else {
+                addRecordError(chunk, data, eol - data);
+            }
+        }
+        data = next;
+
+        // Convert and print a full block, or whatever is left at the end
+        if (count == BATCH_BLOCK_SIZE || (data == end && count > 0)) {
+            uint64_t convert_start = timed ? statsNow() : 0;
+            for (size_t t = 0; t < batch->ntargets; t++) {
+                applyTarget(batch, &batch->targets[t], values, results[t], count);
+            }
+            uint64_t format_start = timed ? statsNow() : 0;
+            for (size_t t = 0; batch->naggregates > 0 && t < batch->ntargets; t++) {
+                aggregateValues(&chunk->aggregates[t], results[t], count);
+            }
+            for (size_t i = 0; batch->naggregates == 0 && i < count; i++) {
+                char *start = reserveOutput(&chunk->out, record_max);
+                if (start == NULL) {
+                    break;
+                }
+                char *p = start;
+                p += formatNumber(p, UNICON_FORMAT_MAX(decimal_places), values[i], batch->format, decimal_places);
+                memcpy(p, batch->from_suffix, batch->from_suffix_len);
+                p += batch->from_suffix_len;
+                for (size_t t = 0; t < batch->ntargets; t++) {
+                    const Target *target = &batch->targets[t];
+                    p += formatNumber(p, UNICON_FORMAT_MAX(decimal_places), results[t][i], batch->format, decimal_places);
+                    memcpy(p, target->suffix, target->suffix_len);
+                    p += target->suffix_len;
+                }
+                chunk->out.used += p - start;
+            }
+            if (timed) {
+                recordLatency(chunk->stats, STAGE_PARSE, convert_start - parse_start, count);
+                recordLatency(chunk->stats, STAGE_CONVERT, format_start - convert_start, count * batch->ntargets);
+                recordLatency(chunk->stats, STAGE_FORMAT, statsNow() - format_start, count);
+            }
+            chunk->stats->records += count;
+            countConversions(chunk->stats, type, count * batch->ntargets);
+            count = 0;
+            block_open = false;
+        }
+    }
+}
+
+// Struct for walking the fields of one line of delimited input, stopping
+// at the columns to convert
+typedef struct _FieldCursor {
+    const char *pos;
+    const char *eol;
+    int column;
+    size_t next;
+} FieldCursor;
+
+// Function to find the end of the field starting at p. Quoted fields may
+// contain the delimiter, but not line breaks.
+static const char *fieldEnd(const char *p, const char *eol, char delimiter) {
+    if (p < eol && *p == '"') {
+        for (p++; p < eol; p++) {
+            if (*p == '"') {
+                if (p + 1 < eol && p[1] == '"') {
+                    p++;
+                } else {
+                    p++;
+                    break;
+                }
+            }
+        }
+    }
+    const char *end = memchr(p, delimiter, eol - p);
+    return end ? end : eol;
+}
+
+// Function to find the next field of a line that is to be converted.
+// Returns false once the line has no more of them.
+static bool nextTargetField(const Batch *batch, FieldCursor *cursor, const char **start, const char **stop) {
+    while (cursor->pos != NULL && cursor->next < batch->ncolumns) {
+        const char *field = cursor->pos;
+        const char *end = fieldEnd(field, cursor->eol, batch->delimiter);
+        bool target = (cursor->column == batch->columns[cursor->next]);
+        cursor->pos = (end < cursor->eol) ? end + 1 : NULL;
+        cursor->column++;
+        if (target) {
+            cursor->next++;
+            *start = field;
+            *stop = end;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Function to find the end of a line's content, before any "\r\n"
+static const char *contentEnd(const char *data, const char *eol) {
+    return (eol > data && eol[-1] == '\r') ? eol - 1 : eol;
+}
+
+// Function to rewrite the target columns of the delimited lines of a
+// chunk into its output buffer. Every other byte is copied through as is.
+// Lines are handled a block at a time: the target fields are parsed and
+// converted together, then the lines are copied out with the results put
+// in. Empty fields are left alone, invalid ones are reported and kept.
+void convertFields(const Batch *batch, Chunk *chunk) {
+    int decimal_places = (batch->round_places >= 0) ? batch->round_places : 2;
+    size_t field_max = UNICON_FORMAT_MAX(decimal_places);
+    int type = batch->from.type;
+    double values[BATCH_BLOCK_SIZE];
+    bool valid[BATCH_BLOCK_SIZE];
+    const char *data = chunk->data;
+    const char *end = data + chunk->len;
+
+    // The header line is copied through untouched
+    if (batch->header && chunk->first && data < end) {
+        const char *eol = memchr(data, '\n', end - data);
+        const char *next = eol ? eol + 1 : end;
+        char *out = reserveOutput(&chunk->out, next - data);
+        if (out == NULL) {
+            return;
+        }
+        memcpy(out, data, next - data);
+        chunk->out.used += next - data;
+        chunk->lines++;
+        data = next;
+    }
+
+    while (data < end) {
+        // Parse the target fields of as many lines as fit in a block
+        const char *block = data;
+        size_t count = 0, converted = 0;
+        bool timed = sampleStats(chunk->stats);
+        uint64_t parse_start = timed ? statsNow() : 0;
+        while (data < end && count + batch->ncolumns <= BATCH_BLOCK_SIZE) {
+            const char *eol = memchr(data, '\n', end - data);
+            const char *next = eol ? eol + 1 : end;
+            FieldCursor cursor = {data, contentEnd(data, eol ? eol : end), 1, 0};
+            const char *start, *stop;
+            chunk->lines++;
+            while (nextTargetField(batch, &cursor, &start, &stop)) {
+                while (start < stop && isspace((unsigned char)*start)) {
+                    start++;
+                }
+                while (stop > start && isspace((unsigned char)stop[-1])) {
+                    stop--;
+                }
+                if (stop - start >= 2 && *start == '"' && stop[-1] == '"') {
+                    start++;
+                    stop--;
+                }
+                valid[count] = (start < stop && unicon_parse_number(start, stop, &values[count]) == stop);
+                converted += valid[count];
+                if (!valid[count]) {
+                    values[count] = 0;
+                    if (start < stop) {
+                        addRecordError(chunk, start, stop - start);
+                    }
+                }
+                count++;
+            }
+            data = next;
+        }
+        uint64_t convert_start = timed ? statsNow() : 0;
+        applyTarget(batch, &batch->targets[0], values, values, count);
+        uint64_t format_start = timed ? statsNow() : 0;
+
+        // Copy the lines out again, putting in the converted fields
+        count = 0;
+        for (const char *line = block; line < data;) {
+            const char *eol = memchr(line, '\n', data - line);
+            const char *next = eol ? eol + 1 : data;
+            char *start_out = reserveOutput(&chunk->out, (next - line) + batch->ncolumns * field_max);
+            if (start_out == NULL) {
+                return;
+            }
+            char *p = start_out;
+            FieldCursor cursor = {line, contentEnd(line, eol ? eol : data), 1, 0};
+            const char *copied = line;
+            const char *start, *stop;
+            while (nextTargetField(batch, &cursor, &start, &stop)) {
+                memcpy(p, copied, start - copied);
+                p += start - copied;
+                if (valid[count]) {
+                    p += formatNumber(p, field_max, values[count], batch->format, decimal_places);
+                } else {
+                    memcpy(p, start, stop - start);
+                    p += stop - start;
+                }
+                copied = stop;
+                count++;
+            }
+            memcpy(p, copied, next - copied);
+            p += next - copied;
+            chunk->out.used += p - start_out;
+            line = next;
+        }
+        if (timed) {
+            recordLatency(chunk->stats, STAGE_PARSE, convert_start - parse_start, converted);
+            recordLatency(chunk->stats, STAGE_CONVERT, format_start - convert_start, converted);
+            recordLatency(chunk->stats, STAGE_FORMAT, statsNow() - format_start, converted);
+        }
+        chunk->stats->records += converted;
+        countConversions(chunk->stats, type, converted);
+    }
+}
+
+// Function to empty a pair cache
+void initPairCache(PairCache *cache) {
+    for (size_t i = 0; i < PAIR_CACHE_SIZE; i++) {
+        cache->entries[i].key = SIZE_MAX;
+    }
+}
+
+// Function to get the cached conversion between two units, compiling it
+// on a miss. Returns NULL for units of different types.
+const PairCacheEntry *lookupPairCache(PairCache *cache, const UniconRegistry *registry, Unit from, Unit to) {
+    size_t key = (size_t)from * unicon_registry_units(registry) + (size_t)to;
+    PairCacheEntry *entry = &cache->entries[key % PAIR_CACHE_SIZE];
+    if (entry->key != key) {
+        if (unicon_registry_compile(registry, from, to, &entry->conv) != UNICON_OK ||
+            unicon_registry_compile_exact(registry, from, to, &entry->exact) != UNICON_OK) {
+            return NULL;
+        }
+        entry->key = key;
+        entry->suffix_len = snprintf(entry->suffix, sizeof(entry->suffix), " %s = ", unicon_registry_unit_name(registry, from));
+    }
+    return entry;
+}
+
+// Function to compile the conversion from a unit expression to a target
+// into entry, with the expression as the text after the source value
+static const PairCacheEntry *compileExpressionEntry(PairCacheEntry *entry, const UniconRegistry *registry,
+                                                    const UniconExpression *from, const UniconExpression *to) {
+    if (unicon_expression_compile(registry, from, to, &entry->conv) != UNICON_OK ||
+        unicon_expression_compile_exact(registry, from, to, &entry->exact) != UNICON_OK) {
+        return NULL;
+    }
+    entry->suffix_len = snprintf(entry->suffix, sizeof(entry->suffix), " %s = ", from->name);
+    return entry;
+}
+
+// Function to get the cached conversion from a unit expression to the
+// target, keyed by a hash of the expression. It is checked and compiled
+// only on a miss, so a stream repeating an expression pays once per chunk.
+static const PairCacheEntry *lookupExpressionEntry(PairCache *cache, const UniconRegistry *registry,
+                                                   const UniconExpression *from, const UniconExpression *to) {
+    size_t len = strlen(from->name);
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < len; i++) {
+        h = (h ^ (unsigned char)from->name[i]) * 0x100000001b3ULL;
+    }
+    // SIZE_MAX marks an empty entry
+    size_t key = (size_t)(h >> 1);
+    PairCacheEntry *entry = &cache->entries[key % PAIR_CACHE_SIZE];
+    // The suffix " name = " tells expressions of the same hash apart
+    if (entry->key == key && entry->suffix_len == len + 4 && memcmp(entry->suffix + 1, from->name, len) == 0) {
+        return entry;
+    }
+    if (compileExpressionEntry(entry, registry, from, to) == NULL) {
+        entry->key = SIZE_MAX;
+        return NULL;
+    }
+    entry->key = key;
+    return entry;
+}
+
+// Function to find the conversion from the unit a record names to the
+// target: a unit through the pair cache, or else a unit expression
+// through the thread's expression cache and the cache of conversions
+// from expressions. Returns NULL for units that are unknown or of another
+// type.
+static const PairCacheEntry *recordConversion(const Batch *batch, Chunk *chunk, PairCache *cache,
+                                              PairCache *compounds, const char *name, size_t len) {
+    const Target *target = &batch->targets[0];
+    char unit_name[UNICON_EXPRESSION_MAX];
+    Unit from;
+    const UniconExpression *expr;
+    const PairCacheEntry *entry = NULL;
+    if (len == 0 || len >= sizeof(unit_name)) {
+        return NULL;
+    }
+    memcpy(unit_name, name, len);
+    unit_name[len] = '\0';
+    if (target->unit.unit >= 0 && unicon_registry_lookup(batch->registry, unit_name, &from) == UNICON_OK) {
+        entry = lookupPairCache(cache, batch->registry, from, (Unit)target->unit.unit);
+        chunk->unit_counts[from] += (entry != NULL);
+    } else if (chunk->expressions != NULL &&
+               unicon_expression_cache_lookup(chunk->expressions, name, len, &expr) == UNICON_OK) {
+        entry = lookupExpressionEntry(compounds, batch->registry, expr, &target->unit);
+        if (entry != NULL && expr->unit >= 0) {
+            chunk->unit_counts[expr->unit]++;
+        }
+    }
+    return entry;
+}
+
+// Function to convert lines holding a value and its own unit, such as
+// "12.5 kilometers", to the target unit. Every cached conversion is
+// compiled once per chunk, so a mixed stream costs little more than a
+// single pair. Unit expressions such as "12.5 kilometers/hours" are
+// parsed once per thread and kept in its expression cache, and their
+// conversions checked and compiled once per chunk. Values with
+// unknown units or units of another type are reported and skipped.
+void convertMixed(const Batch *batch, Chunk *chunk) {
+    int decimal_places = (batch->round_places >= 0) ? batch->round_places : 2;
+    const Target *target = &batch->targets[0];
+    int type = target->unit.type;
+    size_t record_max = 2 * UNICON_FORMAT_MAX(decimal_places) + sizeof(((PairCacheEntry *)0)->suffix) + target->suffix_len;
+    PairCache cache, compounds;
+    initPairCache(&cache);
+    initPairCache(&compounds);
+    memset(chunk->unit_counts, 0, unicon_registry_units(batch->registry) * sizeof(*chunk->unit_counts));
+    const char *data = chunk->data;
+    const char *end = data + chunk->len;
+
+    while (data < end) {
+        const char *eol = memchr(data, '\n', end - data);
+        const char *next = eol ? eol + 1 : end;
+        eol = eol ? eol : end;
+        chunk->lines++;
+
+        // Trim surrounding whitespace and skip blank lines
+        while (data < eol && isspace((unsigned char)*data)) {
+            data++;
+        }
+        while (eol > data && isspace((unsigned char)eol[-1])) {
+            eol--;
+        }
+        if (data == eol) {
+            data = next;
+            continue;
+        }
+
+        // The unit follows the number, spaces between them are optional
+        double value;
+        const char *name = unicon_parse_number(data, eol, &value);
+        const PairCacheEntry *entry = NULL;
+        if (name != NULL) {
+            while (name < eol && isspace((unsigned char)*name)) {
+                name++;
+            }
+            entry = recordConversion(batch, chunk, &cache, &compounds, name, eol - name);
+        }
+        if (entry == NULL) {
+            addRecordError(chunk, data, eol - data);
+            data = next;
+            continue;
+        }
+
+        // Same operations as the array kernels, so results match plain
+        // batch mode bit for bit
+        double result;
+        if (batch->exact) {
+            result = unicon_apply_exact(&entry->exact, value, batch->round_places);
+        } else {
+            result = unicon_apply_rounded(&entry->conv, value, batch->round_places);
+        }
+        chunk->stats->records++;
+        countConversions(chunk->stats, type, 1);
+        if (batch->naggregates > 0) {
+            aggregateValues(&chunk->aggregates[0], &result, 1);
+            data = next;
+            continue;
+        }
+        char *start = reserveOutput(&chunk->out, record_max);
+        if (start == NULL) {
+            return;
+        }
+        char *p = start;
+        p += formatNumber(p, UNICON_FORMAT_MAX(decimal_places), value, batch->format, decimal_places);
+        memcpy(p, entry->suffix, entry->suffix_len);
+        p += entry->suffix_len;
+        p += formatNumber(p, UNICON_FORMAT_MAX(decimal_places), result, batch->format, decimal_places);
+        memcpy(p, target->suffix, target->suffix_len);
+        p += target->suffix_len;
+        chunk->out.used += p - start;
+        data = next;
+    }
+}
+
+// Function to find the first quote or backslash in [p, end) or, for
+// nested values, the first quote or bracket, 16 bytes at a time with SSE2.
+// Returns end when there is none.
+static const char *findJsonSpecial(const char *p, const char *end, bool nested) {
+#ifdef __SSE2__
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i backslash = _mm_set1_epi8('\\');
+    const __m128i open_brace = _mm_set1_epi8('{');
+    const __m128i close_brace = _mm_set1_epi8('}');
+    const __m128i open_bracket = _mm_set1_epi8('[');
+    const __m128i close_bracket = _mm_set1_epi8(']');
+    for (; end - p >= 16; p += 16) {
+        __m128i bytes = _mm_loadu_si128((const __m128i *)p);
+        __m128i hits = _mm_cmpeq_epi8(bytes, quote);
+        if (nested) {
+            hits = _mm_or_si128(hits, _mm_or_si128(_mm_cmpeq_epi8(bytes, open_brace), _mm_cmpeq_epi8(bytes, close_brace)));
+            hits = _mm_or_si128(hits, _mm_or_si128(_mm_cmpeq_epi8(bytes, open_bracket), _mm_cmpeq_epi8(bytes, close_bracket)));
+        } else {
+            hits = _mm_or_si128(hits, _mm_cmpeq_epi8(bytes, backslash));
+        }
+        int mask = _mm_movemask_epi8(hits);
+        if (mask != 0) {
+            return p + __builtin_ctz(mask);
+        }
+    }
+#endif
+    for (; p < end; p++) {
+        char c = *p;
+        if (c == '"' || (nested ? (c == '{' || c == '}' || c == '[' || c == ']') : c == '\\')) {
+            return p;
+        }
+    }
+    return end;
+}
+
+// Function to find the closing quote of the JSON string whose contents
+// start at p, or NULL when the line ends first
+static const char *jsonStringEnd(const char *p, const char *end) {
+    for (;;) {
+        p = findJsonSpecial(p, end, false);
+        if (p == end) {
+            return NULL;
+        }
+        if (*p == '"') {
+            return p;
+        }
+        // Step over the escaped character
+        p += 2;
+        if (p > end) {
+            return NULL;
+        }
+    }
+}
+
+// Function to tell whether a byte is JSON whitespace
+static inline bool isJsonSpace(char c) {
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+// Function to skip JSON whitespace
+static const char *skipJsonSpace(const char *p, const char *end) {
+    while (p < end && isJsonSpace(*p)) {
+        p++;
+    }
+    return p;
+}
+
+// Function to find the end of the JSON value starting at p: a string, an
+// object or array with everything nested in it, or a number, boolean or
+// null. Returns NULL when the line ends first.
+static const char *jsonValueEnd(const char *p, const char *end) {
+    if (p < end && *p == '"') {
+        const char *close = jsonStringEnd(p + 1, end);
+        return close ? close + 1 : NULL;
+    }
+    if (p < end && (*p == '{' || *p == '[')) {
+        int depth = 0;
+        for (;;) {
+            p = findJsonSpecial(p, end, true);
+            if (p == end) {
+                return NULL;
+            }
+            if (*p == '"') {
+                const char *close = jsonStringEnd(p + 1, end);
+                if (close == NULL) {
+                    return NULL;
+                }
+                p = close + 1;
+                continue;
+            }
+            depth += (*p == '{' || *p == '[') ? 1 : -1;
+            p++;
+            if (depth == 0) {
+                return p;
+            }
+        }
+    }
+    const char *start = p;
+    while (p < end && *p != ',' && *p != '}' && *p != ']' && !isJsonSpace(*p)) {
+        p++;
+    }
+    return p > start ? p : NULL;
+}
+
+
+// Struct for the parts of a JSON Lines record that are rewritten: the
+// value of the field to convert and the string of the unit field, between
+// its quotes. Missing fields are NULL.
+typedef struct _JsonFields {
+    const char *value;
+    const char *value_end;
+    const char *unit;
+    const char *unit_end;
+    bool unit_string;
+} JsonFields;
+
+// Function to tell whether the key of [key, key_end) is name. Keys are
+// compared as written, escapes are not decoded.
+static bool jsonKeyIs(const char *key, const char *key_end, const char *name, size_t name_len) {
+    return name != NULL && (size_t)(key_end - key) == name_len && memcmp(key, name, name_len) == 0;
+}
+
+// Function to locate the fields of a batch run in the top level object of
+// a line, walking the keys in order and stepping over every other value
+// without looking into it. Stops as soon as all fields are found, the rest
+// of the line is copied through as is anyway. Returns false for a line
+// that is not an object.
+static bool scanJsonRecord(const Batch *batch, const char *p, const char *end, JsonFields *fields) {
+    size_t field_len = strlen(batch->field);
+    size_t unit_field_len = batch->unit_field ? strlen(batch->unit_field) : 0;
+    p = skipJsonSpace(p, end);
+    if (p == end || *p != '{') {
+        return false;
+    }
+    p = skipJsonSpace(p + 1, end);
+    if (p < end && *p == '}') {
+        return true;
+    }
+    for (;;) {
+        if (p == end || *p != '"') {
+            return false;
+        }
+        const char *key = p + 1;
+        const char *key_end = jsonStringEnd(key, end);
+        if (key_end == NULL) {
+            return false;
+        }
+        p = skipJsonSpace(key_end + 1, end);
+        if (p == end || *p != ':') {
+            return false;
+        }
+        const char *value = skipJsonSpace(p + 1, end);
+        const char *value_end = jsonValueEnd(value, end);
+        if (value_end == NULL) {
+            return false;
+        }
+        if (fields->value == NULL && jsonKeyIs(key, key_end, batch->field, field_len)) {
+            fields->value = value;
+            fields->value_end = value_end;
+        } else if (fields->unit == NULL && jsonKeyIs(key, key_end, batch->unit_field, unit_field_len)) {
+            fields->unit_string = (*value == '"');
+            fields->unit = value + fields->unit_string;
+            fields->unit_end = value_end - fields->unit_string;
+        }
+        if (fields->value != NULL && (batch->unit_field == NULL || fields->unit != NULL)) {
+            return true;
+        }
+        p = skipJsonSpace(value_end, end);
+        if (p < end && *p == ',') {
+            p = skipJsonSpace(p + 1, end);
+        } else {
+            return p < end && *p == '}';
+        }
+    }
+}
+
+// Function to rewrite the field to convert of every JSON Lines record of
+// a chunk into its output buffer, and with a unit field also that field,
+// to the target unit. Every other byte is copied through as is. Records
+// without the field, or where it is null, are left alone; invalid ones,
+// with values that are not numbers or units that are not known, are
+// reported and kept unchanged. The value may be a number or a string
+// holding one, which stays a string.
+void convertJsonLines(const Batch *batch, Chunk *chunk) {
+    int decimal_places = (batch->round_places >= 0) ? batch->round_places : 2;
+    size_t field_max = UNICON_FORMAT_MAX(decimal_places);
+    const Target *target = &batch->targets[0];
+    size_t target_len = strlen(target->unit.name);
+    int type = batch->mixed ? target->unit.type : batch->from.type;
+    PairCache cache, compounds;
+    initPairCache(&cache);
+    initPairCache(&compounds);
+    if (batch->mixed) {
+        memset(chunk->unit_counts, 0, unicon_registry_units(batch->registry) * sizeof(*chunk->unit_counts));
+    }
+    const char *data = chunk->data;
+    const char *end = data + chunk->len;
+
+    while (data < end) {
+        const char *eol = memchr(data, '\n', end - data);
+        const char *next = eol ? eol + 1 : end;
+        const char *content_end = contentEnd(data, eol ? eol : end);
+        chunk->lines++;
+
+        // Find the value and its conversion, the record's own with a unit
+        // field. Blank lines are copied through.
+        JsonFields fields = {0};
+        bool valid = skipJsonSpace(data, content_end) == content_end ||
+                     scanJsonRecord(batch, data, content_end, &fields);
+        bool convert = valid && fields.value != NULL && !(fields.value_end - fields.value == 4 && memcmp(fields.value, "null", 4) == 0);
+        const char *number = fields.value, *number_end = fields.value_end;
+        const Conversion *conv = &target->conv;
+        const ExactConversion *exact = &target->exact_conv;
+        double value, result = 0;
+        if (convert) {
+            if (*number == '"') {
+                number++;
+                number_end--;
+            }
+            valid = (number < number_end && unicon_parse_number(number, number_end, &value) == number_end);
+        }
+        if (convert && valid && batch->mixed) {
+            const PairCacheEntry *entry = NULL;
+            if (fields.unit != NULL && fields.unit_string) {
+                entry = recordConversion(batch, chunk, &cache, &compounds, fields.unit, fields.unit_end - fields.unit);
+            }
+            valid = (entry != NULL);
+            if (valid) {
+                conv = &entry->conv;
+                exact = &entry->exact;
+            }
+        }
+        if (convert && valid) {
+            result = batch->exact ? unicon_apply_exact(exact, value, batch->round_places)
+                                  : unicon_apply_rounded(conv, value, batch->round_places);
+            // JSON has no way to write the infinities and NaN
+            valid = isfinite(result);
+        }
+        if (!valid) {
+            addRecordError(chunk, data, content_end - data);
+        }
+        convert = convert && valid;
+        if (convert) {
+            chunk->stats->records++;
+            countConversions(chunk->stats, type, 1);
+        }
+        if (batch->naggregates > 0) {
+            if (convert) {
+                aggregateValues(&chunk->aggregates[0], &result, 1);
+            }
+            data = next;
+            continue;
+        }
+
+        // Copy the line out, putting in the result and, with a unit field,
+        // the target unit, in the order they come in the record
+        char *start = reserveOutput(&chunk->out, (next - data) + field_max + target_len);
+        if (start == NULL) {
+            return;
+        }
+        char *p = start;
+        for (int part = 0; convert && part < (batch->mixed ? 2 : 1); part++) {
+            bool unit = batch->mixed && (part == 0) == (fields.unit < number);
+            const char *at = unit ? fields.unit : number;
+            memcpy(p, data, at - data);
+            p += at - data;
+            if (unit) {
+                memcpy(p, target->unit.name, target_len);
+                p += target_len;
+                data = fields.unit_end;
+            } else {
+                p += formatNumber(p, field_max, result, batch->format, decimal_places);
+                data = number_end;
+            }
+        }
+        memcpy(p, data, next - data);
+        p += next - data;
+        chunk->out.used += p - start;
+        data = next;
+    }
+}
+
+// Function to convert the packed binary values of a chunk into its output
+// buffer. Bytes left over after the last whole value can only come at the
+// end of the input and are reported as a rejected record.
+void convertRecords(const Batch *batch, Chunk *chunk) {
+    size_t size = recordSize(batch->format);
+    size_t n = chunk->len / size;
+    chunk->stats->records += n;
+    countConversions(chunk->stats, batch->from.type, n);
+    // An unused buffer has no room to give for no values, but input
+    // shorter than one value still has to be reported below
+    char *out = reserveOutput(&chunk->out, n * size);
+    if (out == NULL && n > 0) {
+        return;
+    }
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    const void *in = chunk->data;
+#else
+    // Swap into the output buffer and convert there in place
+    const void *in = out;
+    for (size_t i = 0; i < n * size; i += size) {
+        for (size_t j = 0; j < size; j++) {
+            out[i + j] = chunk->data[i + size - 1 - j];
+        }
+    }
+#endif
+    if (batch->format == FORMAT_U64LE) {
+        chunk->saturated += unicon_apply_integer_array(&batch->targets[0].integer_conv, in, (uint64_t *)out, NULL, n);
+    } else if (size == sizeof(float) && batch->exact) {
+        const float *values = in;
+        for (size_t i = 0; i < n; i++) {
+            ((float *)out)[i] = (float)unicon_apply_exact(&batch->targets[0].exact_conv, values[i], batch->round_places);
+        }
+    } else if (size == sizeof(float)) {
+        unicon_apply_array_f32(&batch->targets[0].conv, in, (float *)out, n, batch->round_places);
+    } else {
+        applyTarget(batch, &batch->targets[0], in, (double *)out, n);
+    }
+
+    // Reductions keep the converted values in host order and drop them
+    if (batch->naggregates > 0) {
+        if (batch->format == FORMAT_F64LE) {
+            aggregateValues(&chunk->aggregates[0], (const double *)out, n);
+        }
+        for (size_t i = 0; batch->format != FORMAT_F64LE && i < n; i += BATCH_BLOCK_SIZE) {
+            double values[BATCH_BLOCK_SIZE];
+            size_t count = (n - i < BATCH_BLOCK_SIZE) ? n - i : BATCH_BLOCK_SIZE;
+            for (size_t j = 0; j < count; j++) {
+                values[j] = (batch->format == FORMAT_F32LE) ? ((const float *)out)[i + j]
+                                                            : (double)((const uint64_t *)out)[i + j];
+            }
+            aggregateValues(&chunk->aggregates[0], values, count);
+        }
+        n = 0;
+    }
+#if __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+    for (size_t i = 0; i < n * size; i += size) {
+        for (size_t j = 0; j < size / 2; j++) {
+            char c = out[i + j];
+            out[i + j] = out[i + size - 1 - j];
+            out[i + size - 1 - j] = c;
+        }
+    }
+#endif
+    chunk->out.used += n * size;
+    chunk->lines += chunk->len / size;
+    if (chunk->len % size != 0) {
+        addRecordError(chunk, NULL, chunk->len % size);
+    }
+}
+
+// Function to convert a chunk in the format of the batch run, counting
+// into the statistics of the calling thread
+static void convertChunk(const Batch *batch, Chunk *chunk, Stats *stats, UniconExpressionCache *expressions) {
+    size_t used = chunk->out.used;
+    chunk->stats = stats;
+    chunk->expressions = expressions;
+    chunk->saturated = 0;
+    for (size_t t = 0; t < batch->ntargets; t++) {
+        initAggregate(&chunk->aggregates[t]);
+    }
+    if (recordSize(batch->format) > 0) {
+        convertRecords(batch, chunk);
+    } else if (batch->delimiter != 0) {
+        convertFields(batch, chunk);
+    } else if (batch->jsonl) {
+        convertJsonLines(batch, chunk);
+    } else if (batch->mixed) {
+        convertMixed(batch, chunk);
+    } else {
+        convertLines(batch, chunk);
+    }
+    stats->bytes_in += chunk->len;
+    stats->bytes_out += chunk->out.used - used;
+}
+
+// Function to take the next completion off the ring of a batch run. A
+// short write has the rest of its chunk submitted again.
+static bool takeCompletion(BatchIO *io) {
+    uint64_t tag;
+    int result;
+    if (!uringWait(&io->ring, &tag, &result)) {
+        return false;
+    }
+    if (tag == TAG_READ) {
+        io->read_result = result;
+        io->read_done = true;
+        return true;
+    }
+    if (result == 0 || (result < 0 && result != -EINTR && result != -EAGAIN)) {
+        errno = result ? -result : EIO;
+        io->write_failed = true;
+        io->writing = NULL;
+        return true;
+    }
+    if (result > 0) {
+        io->written += result;
+    }
+    OutBuffer *out = &io->writing->out;
+    if (io->written == out->used) {
+        io->writing = NULL;
+    } else if (!uringWrite(&io->ring, STDOUT_FILENO, out->data + io->written, out->used - io->written, TAG_WRITE)) {
+        io->write_failed = true;
+        io->writing = NULL;
+    }
+    return true;
+}
+
+// Function to read up to len bytes of input, through the ring when there
+// is one so that a write in flight completes meanwhile
+static ssize_t readInput(BatchIO *io, int fd, char *buf, size_t len) {
+    for (;;) {
+        ssize_t n;
+        io->read_done = false;
+        if (io->uring && uringRead(&io->ring, fd, buf, len, TAG_READ)) {
+            while (!io->read_done) {
+                if (!takeCompletion(io)) {
+                    return -1;
+                }
+            }
+            n = io->read_result;
+            if (n < 0) {
+                errno = -io->read_result;
+            }
+        } else {
+            n = read(fd, buf, len);
+        }
+        if (n >= 0 || (errno != EINTR && errno != EAGAIN)) {
+            return n;
+        }
+    }
+}
+
+// Function to wait for the write in flight. Returns false if any write
+// of the run failed.
+static bool finishWrite(BatchIO *io) {
+    while (io->writing != NULL) {
+        if (!takeCompletion(io)) {
+            io->write_failed = true;
+            io->writing = NULL;
+        }
+    }
+    return !io->write_failed;
+}
+
+// Function to start writing a converted chunk out after the one before
+// it. Without io_uring it is written before returning.
+static bool startWrite(BatchIO *io, Chunk *chunk) {
+    if (!finishWrite(io)) {
+        return false;
+    }
+    const char *data = chunk->out.data;
+    size_t len = chunk->out.used;
+    if (len == 0) {
+        return true;
+    }
+    if (io->uring) {
+        io->writing = chunk;
+        io->written = 0;
+        if (uringWrite(&io->ring, STDOUT_FILENO, data, len, TAG_WRITE)) {
+            return true;
+        }
+        io->writing = NULL;
+    }
+    while (len > 0) {
+        ssize_t n = write(STDOUT_FILENO, data, len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            io->write_failed = true;
+            return false;
+        }
+        data += n;
+        len -= n;
+    }
+    return true;
+}
+
+// Function to point a chunk at the next complete lines of a mapped file
+static bool mapChunk(Reader *reader, Chunk *chunk) {
+    size_t start = reader->map_pos;
+    size_t end = start + BATCH_BUFFER_SIZE;
+    if (end >= reader->map_len) {
+        end = reader->map_len;
+        reader->eof = true;
+    } else if (reader->record_size > 0) {
+        // The chunk size is a whole number of records
+        reader->eof = false;
+    } else {
+        // End at the line terminator after the chunk size, so lines longer
+        // than a chunk still come whole
+        const char *eol = memchr(reader->map + end, '\n', reader->map_len - end);
+        end = eol ? (size_t)(eol + 1 - reader->map) : reader->map_len;
+        reader->eof = (end == reader->map_len);
+    }
+    reader->map_pos = end;
+    if (reader->prefetch && !reader->eof) {
+        // Have the pages of the next chunk read in while this one is
+        // converted, instead of faulting them in one by one later
+        uintptr_t page = (uintptr_t)sysconf(_SC_PAGESIZE);
+        uintptr_t from = (uintptr_t)(reader->map + end) & ~(page - 1);
+        size_t ahead = reader->map_len - end < BATCH_BUFFER_SIZE ? reader->map_len - end : BATCH_BUFFER_SIZE;
+        madvise((void *)from, (uintptr_t)(reader->map + end) - from + ahead, MADV_WILLNEED);
+    }
+
+    chunk->data = reader->map + start;
+    chunk->len = end - start;
+    chunk->out.used = 0;
+    chunk->nerrors = 0;
+    chunk->lines = 0;
+    chunk->first = !reader->started;
+    chunk->done = false;
+    reader->started = true;
+    return start < end;
+}
+
+// Function to fill a chunk with the next complete lines of input.
+// Returns false once the input is exhausted, or on errors.
+static bool readChunk(Reader *reader, BatchIO *io, Chunk *chunk) {
+    if (reader->map != NULL) {
+        return mapChunk(reader, chunk);
+    }
+
+    size_t used = reader->carry_len;
+    if (chunk->storage_capacity < used + BATCH_BUFFER_SIZE) {
+        // Whole buffer sizes leave room for the carried over lines of later
+        // reads to vary without growing the storage again
+        size_t capacity = (used / BATCH_BUFFER_SIZE + 2) * BATCH_BUFFER_SIZE;
+        char *storage = countedRealloc(chunk->storage, capacity);
+        if (storage == NULL) {
+            return false;
+        }
+        chunk->storage = storage;
+        chunk->storage_capacity = capacity;
+    }
+    memcpy(chunk->storage, reader->carry, used);
+
+    size_t complete = 0;
+    while (!reader->eof) {
+        ssize_t n = readInput(io, reader->fd, chunk->storage + used, chunk->storage_capacity - used);
+        if (n < 0) {
+            return false;
+        }
+        used += n;
+        if (n == 0) {
+            reader->eof = true;
+            break;
+        }
+        if (used < chunk->storage_capacity) {
+            // Pipes give a little at a time, fill the whole chunk first
+            continue;
+        }
+
+        // Stop at the last complete line or record, reading on only for
+        // a line longer than the whole chunk
+        complete = used;
+        if (reader->record_size > 0) {
+            complete -= used % reader->record_size;
+        }
+        while (reader->record_size == 0 && complete > 0 && chunk->storage[complete - 1] != '\n') {
+            complete--;
+        }
+        if (complete > 0) {
+            break;
+        }
+        if (used == chunk->storage_capacity) {
+            char *storage = countedRealloc(chunk->storage, chunk->storage_capacity * 2);
+            if (storage == NULL) {
+                return false;
+            }
+            chunk->storage = storage;
+            chunk->storage_capacity *= 2;
+        }
+    }
+    if (reader->eof) {
+        // Convert the last line even without a terminator
+        complete = used;
+    }
+
+    size_t rest = used - complete;
+    if (reader->carry_capacity < rest) {
+        size_t capacity = reader->carry_capacity ? reader->carry_capacity : 4096;
+        while (capacity < rest) {
+            capacity *= 2;
+        }
+        char *carry = countedRealloc(reader->carry, capacity);
+        if (carry == NULL) {
+            return false;
+        }
+        reader->carry = carry;
+        reader->carry_capacity = capacity;
+    }
+    memcpy(reader->carry, chunk->storage + complete, rest);
+    reader->carry_len = rest;
+
+    chunk->data = chunk->storage;
+    chunk->len = complete;
+    chunk->out.used = 0;
+    chunk->nerrors = 0;
+    chunk->lines = 0;
+    chunk->first = !reader->started;
+    chunk->done = false;
+    reader->started = true;
+    return complete > 0 || !reader->eof;
+}
+
+// Function to write a converted chunk out, reporting its rejected records
+// with their line numbers in the whole input
+static bool writeChunk(const Batch *batch, BatchIO *io, Chunk *chunk, unsigned long *line_number, unsigned long *errors,
+                       unsigned long *unit_counts, size_t nunits, Aggregate *totals) {
+    // Chunks are merged in input order, so the sums do not depend on -j
+    for (size_t t = 0; batch->naggregates > 0 && t < batch->ntargets; t++) {
+        mergeAggregate(&totals[t], &chunk->aggregates[t]);
+    }
+    for (size_t unit = 0; chunk->unit_counts != NULL && unit < nunits; unit++) {
+        unit_counts[unit] += chunk->unit_counts[unit];
+    }
+    for (size_t i = 0; i < chunk->nerrors; i++) {
+        RecordError *e = &chunk->errors[i];
+        if (e->text == NULL) {
+            fprintf(stderr, "unicon: input ends with %zu bytes of a partial value\n", e->len);
+            continue;
+        }
+        fprintf(stderr, "unicon: line %lu: invalid value '%.*s'\n", *line_number + e->line, (int)e->len, e->text);
+    }
+    if (chunk->saturated > 0) {
+        fprintf(stderr, "unicon: %lu results past the largest 64-bit count written as %" PRIu64 "\n", chunk->saturated,
+                UINT64_MAX);
+        *errors += chunk->saturated;
+    }
+    *line_number += chunk->lines;
+    *errors += chunk->nerrors;
+    return startWrite(io, chunk);
+}
+
+// Function run by each worker thread of a parallel batch run
+static void *batchWorker(void *arg) {
+    Pool *pool = arg;
+    pthread_mutex_lock(&pool->lock);
+    size_t slot = pool->workers++;
+    Stats *stats = &pool->stats[slot];
+    UniconExpressionCache *expressions = pool->expressions ? pool->expressions[slot] : NULL;
+    for (;;) {
+        while (pool->next_work == pool->next_read && !pool->stop) {
+            pthread_cond_wait(&pool->work, &pool->lock);
+        }
+        if (pool->next_work == pool->next_read) {
+            break;
+        }
+        Chunk *chunk = &pool->chunks[pool->next_work++ % pool->nchunks];
+        pthread_mutex_unlock(&pool->lock);
+
+        convertChunk(pool->batch, chunk, stats, expressions);
+
+        pthread_mutex_lock(&pool->lock);
+        chunk->done = true;
+        pthread_cond_broadcast(&pool->finished);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+// Function to release the expression caches of every thread of a run
+static void freeExpressionCaches(UniconExpressionCache **expressions, int jobs) {
+    for (int i = 0; expressions != NULL && i <= jobs; i++) {
+        unicon_expression_cache_free(expressions[i]);
+    }
+    free(expressions);
+}
+
+// Function to open the input of a batch run, stdin when path is NULL.
+// Regular files are mapped and parsed straight from the page cache,
+// anything else such as pipes is read as a stream.
+static bool openInput(Reader *reader, const char *path) {
+    if (path == NULL) {
+        reader->fd = STDIN_FILENO;
+        return true;
+    }
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+        if (st.st_size == 0) {
+            close(fd);
+            reader->fd = -1;
+            reader->eof = true;
+            return true;
+        }
+        void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map != MAP_FAILED) {
+            madvise(map, st.st_size, MADV_SEQUENTIAL);
+            close(fd);
+            reader->fd = -1;
+            reader->map = map;
+            reader->map_len = st.st_size;
+            return true;
+        }
+    }
+    reader->fd = fd;
+    return true;
+}
+
+// Function to release the input of a batch run
+static void closeInput(Reader *reader) {
+    if (reader->map != NULL) {
+        munmap((void *)reader->map, reader->map_len);
+    }
+    if (reader->fd > STDIN_FILENO) {
+        close(reader->fd);
+    }
+    free(reader->carry);
+}
+
+// Function to convert every value read from input, one per line or
+// packed in the binary formats. Invalid values are reported and skipped, so one bad record does not
+// stop the stream. The chunks are converted by a pool of threads and
+// written out in their original order, while the main thread reads the
+// next ones and writes the finished ones; even with one job a worker
+// converts so I/O overlaps the conversion, unless the I/O is sync.
+int runBatch(Batch *batch, const char *path) {
+    batch->from_suffix_len = snprintf(batch->from_suffix, sizeof(batch->from_suffix), " %s = ", batch->from.name);
+    for (size_t t = 0; t < batch->ntargets; t++) {
+        Target *target = &batch->targets[t];
+        target->suffix_len = snprintf(target->suffix, sizeof(target->suffix), t + 1 < batch->ntargets ? " %s, " : " %s\n",
+                                      target->unit.name);
+    }
+
+    // On a single CPU there is nothing for the I/O to overlap with, the
+    // extra thread would only cost its hand offs
+    IOMode mode = batch->io;
+    if (mode == IO_AUTO && sysconf(_SC_NPROCESSORS_ONLN) < 2) {
+        mode = IO_SYNC;
+    }
+    BatchIO io = {.uring = false};
+    if (mode == IO_AUTO || mode == IO_URING) {
+        io.uring = uringInit(&io.ring, 8);
+        if (!io.uring && mode == IO_URING) {
+            fprintf(stderr, "unicon: io_uring is not available\n");
+            return 1;
+        }
+    }
+    // What was printed before goes out ahead of the chunks, which are
+    // written to the file descriptor directly
+    fflush(stdout);
+
+    Reader reader = {.fd = -1, .prefetch = (mode != IO_SYNC)};
+    reader.record_size = recordSize(batch->format);
+    if (!openInput(&reader, path)) {
+        fprintf(stderr, "unicon: %s: %s\n", path, strerror(errno));
+        if (io.uring) {
+            uringFree(&io.ring);
+        }
+        return 1;
+    }
+
+    // Two chunks a worker keep them busy while the main thread reads and
+    // writes, io_uring needs one more for the chunk being written out
+    int jobs = batch->jobs > 1 ? batch->jobs : 1;
+    int workers = (jobs > 1 || mode != IO_SYNC) ? jobs : 0;
+    Pool pool = {.batch = batch, .nchunks = workers > 0 ? 2 * (size_t)jobs + io.uring : 1, .workers = 1};
+    size_t nunits = unicon_registry_units(batch->registry);
+    pool.chunks = calloc(pool.nchunks, sizeof(*pool.chunks));
+    pool.stats = aligned_alloc(_Alignof(Stats), (jobs + 1) * sizeof(Stats));
+    pthread_t *threads = calloc(jobs, sizeof(*threads));
+    unsigned long *unit_counts = calloc(nunits, sizeof(*unit_counts));
+    bool allocated = (pool.chunks != NULL && pool.stats != NULL && threads != NULL && unit_counts != NULL);
+    for (size_t i = 0; allocated && batch->mixed && i < pool.nchunks; i++) {
+        pool.chunks[i].unit_counts = calloc(nunits, sizeof(*unit_counts));
+        allocated = (pool.chunks[i].unit_counts != NULL);
+    }
+    if (allocated && batch->mixed) {
+        pool.expressions = calloc(jobs + 1, sizeof(*pool.expressions));
+        allocated = (pool.expressions != NULL);
+        for (int i = 0; allocated && i <= jobs; i++) {
+            pool.expressions[i] = unicon_expression_cache_new(batch->registry, EXPRESSION_CACHE_SIZE);
+            allocated = (pool.expressions[i] != NULL);
+        }
+    }
+    if (!allocated) {
+        perror("unicon");
+        for (size_t i = 0; pool.chunks != NULL && i < pool.nchunks; i++) {
+            free(pool.chunks[i].unit_counts);
+        }
+        freeExpressionCaches(pool.expressions, jobs);
+        free(pool.chunks);
+        free(pool.stats);
+        free(threads);
+        free(unit_counts);
+        closeInput(&reader);
+        if (io.uring) {
+            uringFree(&io.ring);
+        }
+        return 1;
+    }
+    memset(pool.stats, 0, (jobs + 1) * sizeof(Stats));
+    for (int i = 0; i <= jobs; i++) {
+        pool.stats[i].timing = batch->stats;
+    }
+    pthread_mutex_init(&pool.lock, NULL);
+    pthread_cond_init(&pool.work, NULL);
+    pthread_cond_init(&pool.finished, NULL);
+
+    int started = 0;
+    for (; started < workers; started++) {
+        if (pthread_create(&threads[started], NULL, batchWorker, &pool) != 0) {
+            break;
+        }
+    }
+
+    unsigned long line_number = 0;
+    unsigned long errors = 0;
+    unsigned long start_allocations = countedAllocations(), warm_allocations = 0;
+    Aggregate totals[BATCH_MAX_TARGETS];
+    for (size_t t = 0; t < batch->ntargets; t++) {
+        initAggregate(&totals[t]);
+    }
+    size_t next_write = 0;
+    bool write_ok = true;
+    bool read_ok = true;
+    int read_error = 0;
+    for (;;) {
+        // Keep every free slot of the ring filled with input
+        while (read_ok && !reader.eof && pool.next_read - next_write < pool.nchunks) {
+            Chunk *chunk = &pool.chunks[pool.next_read % pool.nchunks];
+            if (io.writing == chunk) {
+                write_ok = finishWrite(&io) && write_ok;
+            }
+            if (!readChunk(&reader, &io, chunk)) {
+                read_error = errno;
+                read_ok = reader.eof;
+                break;
+            }
+            if (started == 0) {
+                convertChunk(batch, chunk, &pool.stats[0], pool.expressions ? pool.expressions[0] : NULL);
+                chunk->done = true;
+            }
+            pthread_mutex_lock(&pool.lock);
+            pool.next_read++;
+            pthread_cond_signal(&pool.work);
+            pthread_mutex_unlock(&pool.lock);
+        }
+        if (next_write == pool.next_read) {
+            break;
+        }
+
+        // Write the oldest chunk out as soon as it is converted
+        Chunk *chunk = &pool.chunks[next_write % pool.nchunks];
+        pthread_mutex_lock(&pool.lock);
+        while (!chunk->done) {
+            pthread_cond_wait(&pool.finished, &pool.lock);
+        }
+        pthread_mutex_unlock(&pool.lock);
+        write_ok = writeChunk(batch, &io, chunk, &line_number, &errors, unit_counts, nunits, totals) && write_ok;
+        next_write++;
+        if (next_write == pool.nchunks) {
+            warm_allocations = countedAllocations();
+        }
+    }
+
+    write_ok = finishWrite(&io) && write_ok;
+    if (io.uring) {
+        uringFree(&io.ring);
+    }
+
+    pthread_mutex_lock(&pool.lock);
+    pool.stop = true;
+    pthread_cond_broadcast(&pool.work);
+    pthread_mutex_unlock(&pool.lock);
+    for (int i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    pthread_cond_destroy(&pool.finished);
+    pthread_cond_destroy(&pool.work);
+    pthread_mutex_destroy(&pool.lock);
+    for (size_t i = 0; i < pool.nchunks; i++) {
+        free(pool.chunks[i].storage);
+        free(pool.chunks[i].out.data);
+        free(pool.chunks[i].errors);
+        free(pool.chunks[i].unit_counts);
+    }
+    free(pool.chunks);
+    free(threads);
+    freeExpressionCaches(pool.expressions, jobs);
+
+    // Mixed unit input ends with how many values each unit had
+    for (size_t unit = 0; batch->mixed && unit < nunits; unit++) {
+        if (unit_counts[unit] > 0) {
+            fprintf(stderr, "unicon: %lu values in %s\n", unit_counts[unit], unicon_registry_unit_name(batch->registry, unit));
+        }
+    }
+    free(unit_counts);
+
+    if (batch->naggregates > 0) {
+        printAggregates(batch, totals);
+    }
+
+    // The counters of every thread are summed only now
+    if (batch->stats) {
+        Stats total = {0};
+        OutBuffer line = {0};
+        for (size_t i = 0; i < pool.workers; i++) {
+            addStats(&total, &pool.stats[i]);
+        }
+        total.allocations = countedAllocations() - start_allocations;
+        total.steady_allocations = (next_write > pool.nchunks) ? countedAllocations() - warm_allocations : 0;
+        if (appendStats(&line, &total, batch->registry)) {
+            fprintf(stderr, "unicon: stats %.*s", (int)line.used, line.data);
+        }
+        free(line.data);
+    }
+    free(pool.stats);
+
+    int status = errors > 0 ? 1 : 0;
+    if (!read_ok) {
+        fprintf(stderr, "unicon: %s: %s\n", path ? path : "stdin", strerror(read_error));
+        status = 1;
+    }
+    closeInput(&reader);
+    if (!write_ok || fflush(stdout) != 0) {
+        perror("unicon: stdout");
+        status = 1;
+    }
+    return status;
+}
+
+// Function to get room for n more bytes at the end of an output buffer
+char *reserveOutput(OutBuffer *out, size_t n) {
+    if (out->capacity - out->used < n) {
+        size_t capacity = out->capacity ? out->capacity : 4096;
+        while (capacity - out->used < n) {
+            capacity *= 2;
+        }
+        char *data = countedRealloc(out->data, capacity);
+        if (data == NULL) {
+            return NULL;
+        }
+        out->data = data;
+        out->capacity = capacity;
+    }
+    return out->data + out->used;
+}
+
+// Function to describe statistics at the end of an output buffer, which
+// grows to the whole line however many unit types it names
+bool appendStats(OutBuffer *out, const Stats *stats, const UniconRegistry *registry) {
+    size_t room = 1024;
+    for (;;) {
+        char *line = reserveOutput(out, room);
+        if (line == NULL) {
+            return false;
+        }
+        size_t len = formatStats(line, room, stats, registry);
+        if (len < room) {
+            out->used += len;
+            return true;
+        }
+        room = len + 1;
+    }
+}
+
+// Function to format a number in the requested output format
+size_t formatNumber(char *buf, size_t size, double value, OutputFormat format, int places) {
+    if (format == FORMAT_SHORTEST) {
+        return unicon_format_shortest(buf, size, value);
+    }
+    return unicon_format_fixed(buf, size, value, places);
+}
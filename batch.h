@@ -0,0 +1,218 @@
+/* 
+ * batch.h
+ *
+ * Copyright 2024 Clay Gomera
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-only
+ */
+
+// Streaming batch conversion of values read one per line
+
+#ifndef BATCH_H
+#define BATCH_H
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <pthread.h>
+
+#include "unicon.h"
+#include "stats.h"
+
+// Size of the input chunks batch mode reads and converts at once
+#define BATCH_BUFFER_SIZE (1 << 20)
+
+// Number of values batch mode converts at once
+#define BATCH_BLOCK_SIZE 512
+
+// Most columns of delimited input converted in one run
+#define BATCH_MAX_COLUMNS 16
+
+// Most target units of one conversion, "to U1,U2,U3"
+#define BATCH_MAX_TARGETS 8
+
+// Number of entries in the conversion cache of mixed unit input
+#define PAIR_CACHE_SIZE 64
+
+// Number of unit expressions, such as "kilometers/hours", each thread of
+// a mixed unit run keeps parsed
+#define EXPRESSION_CACHE_SIZE 256
+
+// Formats for numbers. The binary ones are packed little endian arrays
+// used for both input and output, u64le being whole counts converted
+// exactly and rounded down.
+typedef enum {
+    FORMAT_FIXED,
+    FORMAT_SHORTEST,
+    FORMAT_F64LE,
+    FORMAT_F32LE,
+    FORMAT_U64LE
+} OutputFormat;
+
+// Ways a batch run reads its input and writes its output. Auto uses
+// io_uring where the kernel has it and the read-ahead thread otherwise,
+// sync reads, converts and writes in turn on one thread.
+typedef enum {
+    IO_AUTO,
+    IO_URING,
+    IO_THREAD,
+    IO_SYNC
+} IOMode;
+
+// Reductions of converted values printed instead of the values with
+// --aggregate, in the order they are printed by default
+typedef enum {
+    AGGREGATE_SUM,
+    AGGREGATE_MIN,
+    AGGREGATE_MAX,
+    AGGREGATE_MEAN,
+    AGGREGATE_COUNT,
+    NAGGREGATES
+} AggregateKind;
+
+// Struct for the running reduction of converted values. The sum is
+// compensated: compensation collects the low order bits each addition to
+// sum loses, as in Neumaier's variant of Kahan summation.
+typedef struct _Aggregate {
+    unsigned long count;
+    double sum;
+    double compensation;
+    double min;
+    double max;
+} Aggregate;
+
+// Struct for a growable output buffer
+typedef struct _OutBuffer {
+    char *data;
+    size_t used;
+    size_t capacity;
+} OutBuffer;
+
+// Struct for a record rejected while converting a chunk
+typedef struct _RecordError {
+    unsigned long line;
+    const char *text;
+    size_t len;
+} RecordError;
+
+// Struct for a chunk of complete input lines and the output converted
+// from them. Each chunk is converted by one thread at a time.
+typedef struct _Chunk {
+    const char *data;
+    size_t len;
+    char *storage;
+    size_t storage_capacity;
+    OutBuffer out;
+    RecordError *errors;
+    size_t nerrors;
+    size_t errors_capacity;
+    unsigned long lines;
+    // Values seen per source unit of mixed unit input, one per unit of
+    // the registry
+    unsigned long *unit_counts;
+    // Statistics and parsed unit expressions of the thread converting the
+    // chunk
+    Stats *stats;
+    UniconExpressionCache *expressions;
+    // Reductions of the chunk's values per target with --aggregate
+    Aggregate aggregates[BATCH_MAX_TARGETS];
+    // u64le results too large for 64 bits, written as UINT64_MAX
+    unsigned long saturated;
+    bool first;
+    bool done;
+} Chunk;
+
+// Struct for a compiled conversion in a pair cache, with the text put
+// after the source value
+typedef struct _PairCacheEntry {
+    size_t key;
+    Conversion conv;
+    ExactConversion exact;
+    char suffix[128];
+    size_t suffix_len;
+} PairCacheEntry;
+
+// Struct for a direct mapped cache of compiled conversions, keyed by
+// from * units + to, for input where the units vary per record
+typedef struct _PairCache {
+    PairCacheEntry entries[PAIR_CACHE_SIZE];
+} PairCache;
+
+// Struct for a target unit of a batch conversion, with the text put after
+// its results
+typedef struct _Target {
+    UniconExpression unit;
+    Conversion conv;
+    ExactConversion exact_conv;
+    // Compiled for u64le runs only
+    IntegerConversion integer_conv;
+    char suffix[128];
+    size_t suffix_len;
+} Target;
+
+// Struct for the settings of a batch conversion, read-only while it runs
+typedef struct _Batch {
+    const UniconRegistry *registry;
+    // Units or unit expressions such as "kilometers/hours"
+    UniconExpression from;
+    // Each value is parsed once and converted to every target, delimited,
+    // mixed and binary input take just one
+    Target targets[BATCH_MAX_TARGETS];
+    size_t ntargets;
+    // Convert in long double precision with exact_conv instead
+    bool exact;
+    // Time sampled blocks and report the statistics at the end
+    bool stats;
+    // Reduce the converted values and print only these reductions
+    AggregateKind aggregates[NAGGREGATES];
+    size_t naggregates;
+    int round_places;
+    OutputFormat format;
+    int jobs;
+    IOMode io;
+    // Each record names its own source unit
+    bool mixed;
+    // Delimited input: the separator and the sorted 1-based columns to
+    // convert, a zero delimiter means one value per line
+    char delimiter;
+    bool header;
+    int columns[BATCH_MAX_COLUMNS];
+    size_t ncolumns;
+    // JSON Lines input: the field of each object to convert and, when the
+    // records name their own units, the field holding the unit
+    bool jsonl;
+    const char *field;
+    const char *unit_field;
+    // The text around the numbers, rendered once per run
+    char from_suffix[128];
+    size_t from_suffix_len;
+} Batch;
+
+size_t recordSize(OutputFormat format);
+bool compileTargets(Batch *batch, size_t *failed, UniconCheckError *error);
+bool parseAggregates(const char *list, Batch *batch);
+void initPairCache(PairCache *cache);
+const PairCacheEntry *lookupPairCache(PairCache *cache, const UniconRegistry *registry, Unit from, Unit to);
+size_t formatNumber(char *buf, size_t size, double value, OutputFormat format, int places);
+char *reserveOutput(OutBuffer *out, size_t n);
+bool appendStats(OutBuffer *out, const Stats *stats, const UniconRegistry *registry);
+void convertLines(const Batch *batch, Chunk *chunk);
+void convertRecords(const Batch *batch, Chunk *chunk);
+void convertFields(const Batch *batch, Chunk *chunk);
+void convertMixed(const Batch *batch, Chunk *chunk);
+void convertJsonLines(const Batch *batch, Chunk *chunk);
+int runBatch(Batch *batch, const char *path);
+
+#endif
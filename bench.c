@@ -0,0 +1,498 @@
+/* 
+ * bench.c
+ *
+ * Copyright 2024 Clay Gomera
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-only
+ */
+
+// Benchmarks for unicon, built and run with 'make bench'.
+//
+// Every result is printed as one JSON object per line, so runs can be
+// stored and compared across releases:
+//   {"bench": "parse", "variant": "unicon_parse_number", "n": 1000000,
+//    "ns_per_op": 9.81, "gb_per_s": 1.073}
+// gb_per_s counts the bytes a benchmark reads, 0 where that means nothing.
+// The end to end batch runs go up to the value count given as the first
+// argument, 1e7 by default.
+//
+// With --reference only the batch runs over the generated reference
+// dataset from REFERENCE_MIN values up are done, each the fastest of
+// REFERENCE_RUNS. --baseline=FILE
+// does the same and compares every result with the one of the same run in
+// FILE, which 'make perfbaseline' records, and exits with status 1 when
+// any is more than --tolerance=PCT percent slower, 25 by default.
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "unicon.h"
+#include "unicon_pairs.h"
+#include "unicon_private.h"
+#include "batch.h"
+
+// Number of lookups timed per table size
+#define LOOKUPS 2000000
+
+// Number of values in the micro benchmarks
+#define VALUES 1000000
+
+// Times each reference run is repeated, the fastest one counting, and the
+// smallest reference run in values: below it the run is too short to time
+// steadily
+#define REFERENCE_RUNS 5
+#define REFERENCE_MIN 100000
+
+// Most results a baseline file holds
+#define BASELINE_MAX 64
+
+// Struct for a stored result to compare a run with
+typedef struct _BaselineResult {
+    char bench[32];
+    char variant[32];
+    size_t n;
+    double ns_per_op;
+} BaselineResult;
+
+static BaselineResult baseline[BASELINE_MAX];
+static size_t nbaseline;
+static double tolerance = 25;
+static size_t compared;
+static size_t regressions;
+
+// Keeps results alive so the compiler cannot drop the work
+static volatile double sink;
+
+// Function to read a monotonic clock in nanoseconds
+static double nowNs(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+// Function to print one result, and compare it with the baseline
+static void report(const char *bench, const char *variant, size_t n, double ns, double bytes) {
+    printf("{\"bench\": \"%s\", \"variant\": \"%s\", \"n\": %zu, \"ns_per_op\": %.3f, \"gb_per_s\": %.3f}\n",
+           bench, variant, n, ns / n, bytes / ns);
+    fflush(stdout);
+    for (size_t i = 0; i < nbaseline; i++) {
+        const BaselineResult *base = &baseline[i];
+        if (base->n == n && strcmp(base->bench, bench) == 0 && strcmp(base->variant, variant) == 0) {
+            double slower = (ns / n / base->ns_per_op - 1) * 100;
+            compared++;
+            if (slower > tolerance) {
+                fprintf(stderr, "unicon-bench: %s %s of %zu is %.1f%% slower than the baseline, %.3f ns against %.3f\n",
+                        bench, variant, n, slower, ns / n, base->ns_per_op);
+                regressions++;
+            }
+        }
+    }
+}
+
+// Function to read the results of a baseline file, as printed by report()
+static bool loadBaseline(const char *path) {
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        fprintf(stderr, "unicon-bench: %s: %s\n", path, strerror(errno));
+        return false;
+    }
+    char line[256];
+    while (nbaseline < BASELINE_MAX && fgets(line, sizeof(line), file) != NULL) {
+        BaselineResult *base = &baseline[nbaseline];
+        if (sscanf(line, "{\"bench\": \"%31[^\"]\", \"variant\": \"%31[^\"]\", \"n\": %zu, \"ns_per_op\": %lf", base->bench,
+                   base->variant, &base->n, &base->ns_per_op) == 4 && base->ns_per_op > 0) {
+            nbaseline++;
+        }
+    }
+    fclose(file);
+    return true;
+}
+
+// Function to make a random value with a realistic number of digits
+static double randomValue(unsigned *seed) {
+    double mantissa = (double)(rand_r(seed) % 10000000) / 1000.0;
+    return (rand_r(seed) % 4 == 0) ? -mantissa : mantissa;
+}
+
+// Function to look a name up by scanning every key
+static int linearLookup(const char *const *keys, size_t count, const char *name) {
+    for (size_t i = 0; i < count; i++) {
+        if (strcasecmp(name, keys[i]) == 0) {
+            return (int)i;
+        }
+    }
+    return -1;
+}
+
+// Function to time unit name lookups against a synthetic table of size count
+static void benchLookup(size_t count) {
+    char (*storage)[24] = malloc(count * sizeof(*storage));
+    const char **keys = malloc(count * sizeof(*keys));
+    const char **queries = malloc(LOOKUPS * sizeof(*queries));
+    size_t nslots = 1, buckets = 1;
+    while (nslots < count * 2) {
+        nslots <<= 1;
+    }
+    while (buckets * 4 < count) {
+        buckets <<= 1;
+    }
+    uint32_t *displacement = malloc(buckets * sizeof(*displacement));
+    int32_t *slots = malloc(nslots * sizeof(*slots));
+
+    // Names shaped like real ones, with a shared suffix
+    for (size_t i = 0; i < count; i++) {
+        snprintf(storage[i], sizeof(storage[i]), "unit%zuxmeters", i * 2654435761u % 1000003);
+        keys[i] = storage[i];
+    }
+    for (size_t i = 0; i < LOOKUPS; i++) {
+        queries[i] = keys[(i * 40503u) % count];
+    }
+
+    UnitIndex index;
+    char variant[32];
+    if (buildUnitIndex(&index, keys, count, displacement, buckets, slots, nslots)) {
+        long found = 0;
+        size_t linear_lookups = LOOKUPS / (count / 8 + 1);
+        double start = nowNs();
+        for (size_t i = 0; i < linear_lookups; i++) {
+            found += linearLookup(keys, count, queries[i]);
+        }
+        snprintf(variant, sizeof(variant), "linear_%zu_units", count);
+        report("lookup", variant, linear_lookups, nowNs() - start, 0);
+
+        start = nowNs();
+        for (size_t i = 0; i < LOOKUPS; i++) {
+            found += lookupUnitIndex(&index, queries[i]);
+        }
+        snprintf(variant, sizeof(variant), "hashed_%zu_units", count);
+        report("lookup", variant, LOOKUPS, nowNs() - start, 0);
+        sink = found;
+    }
+    free(slots);
+    free(displacement);
+    free(queries);
+    free(keys);
+    free(storage);
+}
+
+// Function to time the built-in table through unicon_lookup()
+static void benchBuiltinLookup(void) {
+    static const char *const names[] = {"celsius", "KILOMETERS", "Ounces", "exabytes", "parsecs"};
+    long found = 0;
+    double start = nowNs();
+    for (size_t i = 0; i < LOOKUPS; i++) {
+        Unit unit = 0;
+        found += unicon_lookup(names[i % 5], &unit) + unit;
+    }
+    report("lookup", "unicon_lookup", LOOKUPS, nowNs() - start, 0);
+    sink = found;
+}
+
+// Function to time the conversions of one unit pair
+static void benchConvert(const char *category, Unit from, Unit to, const double *in, double *out) {
+    char variant[64];
+    double sum = 0;
+    double start = nowNs();
+    for (size_t i = 0; i < VALUES; i++) {
+        double result;
+        unicon_convert(in[i], from, to, &result);
+        sum += result;
+    }
+    snprintf(variant, sizeof(variant), "%s_unicon_convert", category);
+    report("convert", variant, VALUES, nowNs() - start, VALUES * sizeof(double));
+
+    Conversion conv;
+    unicon_compile(from, to, &conv);
+    start = nowNs();
+    for (size_t i = 0; i < VALUES; i++) {
+        sum += unicon_apply(&conv, in[i]);
+    }
+    snprintf(variant, sizeof(variant), "%s_unicon_apply", category);
+    report("convert", variant, VALUES, nowNs() - start, VALUES * sizeof(double));
+
+    start = nowNs();
+    for (size_t i = 0; i < VALUES; i++) {
+        sum += unicon_apply_rounded(&conv, in[i], 2);
+    }
+    snprintf(variant, sizeof(variant), "%s_unicon_apply_rounded2", category);
+    report("convert", variant, VALUES, nowNs() - start, VALUES * sizeof(double));
+
+    start = nowNs();
+    unicon_apply_array(&conv, in, out, VALUES, -1);
+    snprintf(variant, sizeof(variant), "%s_unicon_apply_array", category);
+    report("convert", variant, VALUES, nowNs() - start, VALUES * sizeof(double));
+
+    start = nowNs();
+    unicon_apply_array(&conv, in, out, VALUES, 2);
+    snprintf(variant, sizeof(variant), "%s_unicon_apply_array_round2", category);
+    report("convert", variant, VALUES, nowNs() - start, VALUES * sizeof(double));
+
+    // Single precision, converted in place
+    float *floats = malloc(VALUES * sizeof(*floats));
+    for (size_t i = 0; i < VALUES; i++) {
+        floats[i] = (float)in[i];
+    }
+    start = nowNs();
+    unicon_apply_array_f32(&conv, floats, floats, VALUES, -1);
+    snprintf(variant, sizeof(variant), "%s_unicon_apply_array_f32", category);
+    report("convert", variant, VALUES, nowNs() - start, VALUES * sizeof(float));
+    sum += floats[VALUES / 2];
+    free(floats);
+    sink = sum + out[VALUES / 2];
+}
+
+// Function to time a conversion folded at build time, for comparison with
+// the compiled one of the same pair
+static void benchFoldedPair(const double *in) {
+    double sum = 0;
+    double start = nowNs();
+    for (size_t i = 0; i < VALUES; i++) {
+        sum += unicon_kilometers_to_miles(in[i]);
+    }
+    report("convert", "factor_unicon_pairs_inline", VALUES, nowNs() - start, VALUES * sizeof(double));
+    sink = sum;
+}
+
+// Function to time the exact conversions of counts of one storage unit
+// into another, next to the double conversion of the same values
+static void benchIntegers(const char *category, const UniconRegistry *registry, Unit from, Unit to) {
+    char variant[96];
+    uint64_t *counts = malloc(VALUES * sizeof(*counts));
+    uint64_t *quotients = malloc(VALUES * sizeof(*quotients));
+    uint64_t *remainders = malloc(VALUES * sizeof(*remainders));
+    double *values = malloc(VALUES * sizeof(*values));
+    uint64_t state = 1;
+    for (size_t i = 0; i < VALUES; i++) {
+        state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+        counts[i] = state >> 16;
+        values[i] = (double)counts[i];
+    }
+    // Fault the outputs in, as the double outputs are by earlier runs
+    memset(quotients, 0, VALUES * sizeof(*quotients));
+    memset(remainders, 0, VALUES * sizeof(*remainders));
+
+    IntegerConversion conv;
+    unicon_registry_compile_integer(registry, from, to, &conv);
+    double start = nowNs();
+    unicon_apply_integer_array(&conv, counts, quotients, remainders, VALUES);
+    snprintf(variant, sizeof(variant), "%s_unicon_apply_integer_array", category);
+    report("convert", variant, VALUES, nowNs() - start, VALUES * sizeof(uint64_t));
+
+    start = nowNs();
+    unicon_apply_integer_array(&conv, counts, quotients, NULL, VALUES);
+    snprintf(variant, sizeof(variant), "%s_unicon_apply_integer_array_quotient", category);
+    report("convert", variant, VALUES, nowNs() - start, VALUES * sizeof(uint64_t));
+
+    Conversion double_conv;
+    unicon_registry_compile(registry, from, to, &double_conv);
+    start = nowNs();
+    unicon_apply_array(&double_conv, values, values, VALUES, -1);
+    snprintf(variant, sizeof(variant), "%s_unicon_apply_array", category);
+    report("convert", variant, VALUES, nowNs() - start, VALUES * sizeof(double));
+
+    sink = (double)(quotients[VALUES / 2] + remainders[VALUES / 2]) + values[VALUES / 2];
+    free(values);
+    free(remainders);
+    free(quotients);
+    free(counts);
+}
+
+// Function to time parsing against strtod()
+static void benchParse(const double *values) {
+    char *text = malloc(VALUES * 24);
+    char **starts = malloc(VALUES * sizeof(*starts));
+    char **ends = malloc(VALUES * sizeof(*ends));
+    char *p = text;
+    for (size_t i = 0; i < VALUES; i++) {
+        starts[i] = p;
+        p += sprintf(p, "%.3f", values[i]) + 1;
+        ends[i] = p - 1;
+    }
+    size_t bytes = p - text;
+
+    double sum = 0;
+    double start = nowNs();
+    for (size_t i = 0; i < VALUES; i++) {
+        double value = 0;
+        unicon_parse_number(starts[i], ends[i], &value);
+        sum += value;
+    }
+    report("parse", "unicon_parse_number", VALUES, nowNs() - start, bytes);
+
+    start = nowNs();
+    for (size_t i = 0; i < VALUES; i++) {
+        sum += strtod(starts[i], NULL);
+    }
+    report("parse", "strtod", VALUES, nowNs() - start, bytes);
+    sink = sum;
+    free(ends);
+    free(starts);
+    free(text);
+}
+
+// Function to time the formatters against snprintf()
+static void benchFormat(const double *values) {
+    char buf[UNICON_FORMAT_MAX(2)];
+    size_t bytes = 0;
+    double start = nowNs();
+    for (size_t i = 0; i < VALUES; i++) {
+        bytes += unicon_format_fixed(buf, sizeof(buf), values[i] / 3, 2);
+    }
+    report("format", "unicon_format_fixed_2", VALUES, nowNs() - start, 0);
+
+    start = nowNs();
+    for (size_t i = 0; i < VALUES; i++) {
+        bytes += snprintf(buf, sizeof(buf), "%.2f", values[i] / 3);
+    }
+    report("format", "snprintf_fixed_2", VALUES, nowNs() - start, 0);
+
+    start = nowNs();
+    for (size_t i = 0; i < VALUES; i++) {
+        bytes += unicon_format_shortest(buf, sizeof(buf), values[i] / 3);
+    }
+    report("format", "unicon_format_shortest", VALUES, nowNs() - start, 0);
+
+    start = nowNs();
+    for (size_t i = 0; i < VALUES; i++) {
+        bytes += snprintf(buf, sizeof(buf), "%.17g", values[i] / 3);
+    }
+    report("format", "snprintf_17g", VALUES, nowNs() - start, 0);
+    sink = bytes;
+}
+
+// Function to time whole batch runs over a generated file of n values,
+// with the output thrown away, keeping the fastest of runs
+static void benchBatch(size_t n, int jobs, int runs) {
+    char path[] = "/tmp/unicon-bench-XXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0) {
+        perror("unicon-bench");
+        return;
+    }
+    FILE *file = fdopen(fd, "w");
+    unsigned seed = 42;
+    size_t bytes = 0;
+    for (size_t i = 0; i < n; i++) {
+        bytes += fprintf(file, "%.3f\n", randomValue(&seed));
+    }
+    fclose(file);
+
+    Batch batch = {.registry = unicon_registry_builtin(), .ntargets = 1, .round_places = -1, .jobs = jobs};
+    unicon_registry_parse_expression(batch.registry, "kilometers", 10, &batch.from);
+    unicon_registry_parse_expression(batch.registry, "miles", 5, &batch.targets[0].unit);
+    compileTargets(&batch, NULL, NULL);
+    fflush(stdout);
+    int saved = dup(STDOUT_FILENO);
+    int null = open("/dev/null", O_WRONLY);
+    dup2(null, STDOUT_FILENO);
+    close(null);
+
+    double elapsed = 0;
+    for (int run = 0; run < runs; run++) {
+        double start = nowNs();
+        runBatch(&batch, path);
+        double took = nowNs() - start;
+        elapsed = (run == 0 || took < elapsed) ? took : elapsed;
+    }
+
+    fflush(stdout);
+    dup2(saved, STDOUT_FILENO);
+    close(saved);
+    unlink(path);
+
+    char variant[32];
+    snprintf(variant, sizeof(variant), "file_j%d", jobs);
+    report("batch", variant, n, elapsed, bytes);
+}
+
+int main(int argc, char **argv) {
+    size_t max_values = 10000000;
+    bool reference = false;
+    const char *baseline_path = NULL;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--reference") == 0) {
+            reference = true;
+        } else if (strncmp(argv[i], "--baseline=", 11) == 0) {
+            baseline_path = argv[i] + 11;
+            reference = true;
+        } else if (strncmp(argv[i], "--tolerance=", 12) == 0) {
+            tolerance = strtod(argv[i] + 12, NULL);
+        } else {
+            max_values = (size_t)strtod(argv[i], NULL);
+        }
+    }
+    if (baseline_path != NULL && !loadBaseline(baseline_path)) {
+        return 1;
+    }
+
+    long online = sysconf(_SC_NPROCESSORS_ONLN);
+    if (reference) {
+        for (size_t n = REFERENCE_MIN; n <= max_values; n *= 10) {
+            benchBatch(n, 1, REFERENCE_RUNS);
+            if (online > 1) {
+                benchBatch(n, (int)online, REFERENCE_RUNS);
+            }
+        }
+        if (baseline_path == NULL) {
+            return 0;
+        }
+        if (compared == 0) {
+            fprintf(stderr, "unicon-bench: no run matches one in %s\n", baseline_path);
+            return 1;
+        }
+        fprintf(stderr, "unicon-bench: %zu of %zu runs within %.0f%% of the baseline\n", compared - regressions,
+                compared, tolerance);
+        return regressions > 0;
+    }
+
+    for (size_t count = 8; count <= 32768; count *= 4) {
+        benchLookup(count);
+    }
+    benchBuiltinLookup();
+
+    double *values = malloc(VALUES * sizeof(*values));
+    double *results = malloc(VALUES * sizeof(*results));
+    unsigned seed = 1;
+    for (size_t i = 0; i < VALUES; i++) {
+        values[i] = randomValue(&seed);
+    }
+    benchConvert("temperature", FAHRENHEIT, CELSIUS, values, results);
+    benchConvert("factor", KILOMETERS, MILE, values, results);
+    benchFoldedPair(values);
+    benchIntegers("storage_shift", unicon_registry_builtin(), BYTES, KIBIBYTES);
+    benchIntegers("storage_divide", unicon_registry_builtin_si(), BYTES, MEGABYTES);
+    benchIntegers("storage_fraction", unicon_registry_builtin_si(), MEBIBYTES, KILOBYTES);
+    benchParse(values);
+    benchFormat(values);
+    free(results);
+    free(values);
+
+    for (size_t n = 1000; n <= max_values; n *= 10) {
+        benchBatch(n, 1, 1);
+        if (online > 1) {
+            benchBatch(n, (int)online, 1);
+        }
+    }
+    return 0;
+}
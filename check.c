@@ -0,0 +1,863 @@
+/*
+ * check.c
+ *
+ * Copyright 2024 Clay Gomera
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-only
+ */
+
+// Differential checks for unicon, built and run with 'make check'.
+//
+// Random values and unit pairs go through every path that converts,
+// parses or prints a number, and each result is compared with a plain
+// reference:
+//   - compiled conversions against the formulas of unicon_convert(),
+//     within CONVERT_ULPS units in the last place of the terms summed
+//   - the SIMD array kernels, in every length and alignment, against the
+//     scalar unicon_apply_rounded() and float arithmetic, bit for bit
+//   - conversions of whole counts, in both storage unit families, against
+//     128-bit arithmetic on the fractions in units.def, and their SIMD
+//     kernels against the scalar unicon_apply_integer()
+//   - unicon_parse_number() against strtod(), and unicon_format_fixed()
+//     against snprintf(), bit for bit and byte for byte
+//   - batch, mixed unit and binary runs on one or more threads and every
+//     I/O mode, byte for byte against output built line by line
+// The seed is the first argument, so a failure can be run again.
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <math.h>
+#include <float.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "unicon.h"
+#include "batch.h"
+
+// Values converted per unit pair
+#define PAIR_VALUES 512
+
+// Counts converted per unit pair, and the longest array of them
+#define INTEGER_VALUES 256
+
+// Strings parsed and numbers formatted
+#define PARSE_STRINGS 400000
+
+// Lines of the generated batch input, more than one chunk
+#define BATCH_LINES 100000
+
+// Largest difference between a compiled conversion and the formula, in
+// units in the last place of the larger of the result and its terms
+#define CONVERT_ULPS 4
+
+// Mismatches printed per check before the rest are only counted
+#define MAX_REPORTS 5
+
+static unsigned long checks;
+static unsigned long failures;
+static unsigned reports;
+
+// Function to draw the next 64 random bits, splitmix64
+static uint64_t nextRandom(uint64_t *state) {
+    uint64_t z = (*state += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+// Function to draw a random integer below n
+static unsigned randomBelow(uint64_t *state, unsigned n) {
+    return (unsigned)(nextRandom(state) % n);
+}
+
+// Function to make a random value: mostly realistic decimals, then any
+// finite double of moderate size, small integers and the edge cases
+static double randomValue(uint64_t *state) {
+    static const double edges[] = {0.0, -0.0, 1.0, -1.0, 0.5, -0.5, 2.5, -2.5, DBL_MIN, -DBL_MIN, 0x1p-1074, 1e300,
+                                   -1e300, 0x1p52, 0x1p53 + 2, -40, 32, 273.15, -273.15, 0.005, 0.015, 1.005};
+    switch (randomBelow(state, 8)) {
+        case 0: {
+            double mantissa = (double)(nextRandom(state) >> 11) * 0x1p-53;
+            double value = ldexp(mantissa, (int)randomBelow(state, 601) - 300);
+            return (nextRandom(state) & 1) ? -value : value;
+        }
+        case 1:
+            return (double)((int64_t)randomBelow(state, 200001) - 100000);
+        case 2:
+            return edges[randomBelow(state, sizeof(edges) / sizeof(edges[0]))];
+        default: {
+            double value = (double)randomBelow(state, 10000000) / 1000.0;
+            return (nextRandom(state) & 3) ? value : -value;
+        }
+    }
+}
+
+// Function to count one check, returning whether it passed
+static bool expect(bool ok) {
+    checks++;
+    failures += !ok;
+    return ok;
+}
+
+// Function to describe a failed check, up to MAX_REPORTS of them a group
+static void report(const char *what, const char *format, ...) {
+    if (reports++ >= MAX_REPORTS) {
+        return;
+    }
+    va_list args;
+    va_start(args, format);
+    fprintf(stderr, "unicon-check: %s: ", what);
+    vfprintf(stderr, format, args);
+    fputc('\n', stderr);
+    va_end(args);
+}
+
+// Function to print how one group of checks went and start the next
+static void finishGroup(const char *group, unsigned long first_check, unsigned long first_failure) {
+    printf("%-8s %9lu checks, %lu failed\n", group, checks - first_check, failures - first_failure);
+    fflush(stdout);
+    reports = 0;
+}
+
+// Function to tell whether two doubles are the same bits, any NaN
+// matching any other
+static bool sameDouble(double a, double b) {
+    return (isnan(a) && isnan(b)) || memcmp(&a, &b, sizeof(a)) == 0;
+}
+
+static bool sameFloat(float a, float b) {
+    return (isnan(a) && isnan(b)) || memcmp(&a, &b, sizeof(a)) == 0;
+}
+
+// Function to tell whether a result is within CONVERT_ULPS of the
+// reference, measured against magnitude, the size of the terms that were
+// summed, so a result near zero after cancellation is not held to more
+// digits than its terms had
+static bool closeDouble(double got, double want, double magnitude) {
+    if (sameDouble(got, want) || (isinf(got) && isinf(want) && signbit(got) == signbit(want))) {
+        return true;
+    }
+    double scale = fmax(fmax(fabs(got), fabs(want)), magnitude);
+    double ulp = fmax(scale * DBL_EPSILON, 0x1p-1074);
+    return fabs(got - want) <= CONVERT_ULPS * ulp;
+}
+
+// Function to describe a failed conversion of a unit pair
+static void reportPair(const char *what, Unit from, Unit to, double value, double got, double want) {
+    report(what, "%s to %s of %.17g gives %.17g, expected %.17g", unicon_unit_name(from), unicon_unit_name(to), value,
+           got, want);
+}
+
+// Function to fill values with random values and runs of NaN and
+// infinities, for the kernels to carry through
+static void fillValues(uint64_t *state, double *values, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        values[i] = randomValue(state);
+    }
+    values[randomBelow(state, n)] = NAN;
+    values[randomBelow(state, n)] = INFINITY;
+    values[randomBelow(state, n)] = -INFINITY;
+}
+
+// Function to round in float the way the single precision kernels do
+static float roundFloat(float value, float p10) {
+    return p10 == 0 ? value : roundf(value * p10) / p10;
+}
+
+// Function to check the conversions of one unit pair on every path
+// against the formula and the scalar kernel
+static void checkPair(uint64_t *state, Unit from, Unit to, double *in, double *out, double *want, float *floats) {
+    static const int round_places[] = {-1, 0, 2, 5, 12};
+    fillValues(state, in, PAIR_VALUES);
+
+    Conversion conv, registry_conv;
+    ExactConversion exact;
+    unicon_compile(from, to, &conv);
+    unicon_compile_exact(from, to, &exact);
+    unicon_registry_compile(unicon_registry_builtin(), from, to, &registry_conv);
+    if (!expect(sameDouble(conv.scale, registry_conv.scale) && sameDouble(conv.offset, registry_conv.offset))) {
+        reportPair("folded pair", from, to, 1, registry_conv.scale, conv.scale);
+    }
+
+    // The compiled conversion and the long double one against the formula
+    for (size_t i = 0; i < PAIR_VALUES; i++) {
+        double reference;
+        unicon_convert(in[i], from, to, &reference);
+        double magnitude = fabs(in[i] * conv.scale) + fabs(conv.offset);
+        double got = unicon_apply(&conv, in[i]);
+        if (!expect(closeDouble(got, reference, magnitude))) {
+            reportPair("unicon_apply", from, to, in[i], got, reference);
+        }
+        got = unicon_apply_exact(&exact, in[i], -1);
+        if (!expect(closeDouble(got, reference, magnitude))) {
+            reportPair("unicon_apply_exact", from, to, in[i], got, reference);
+        }
+    }
+
+    // Each array kernel over runs of every length short of a few vectors,
+    // from every offset, so the heads and tails are covered
+    for (size_t r = 0; r < sizeof(round_places) / sizeof(round_places[0]); r++) {
+        int places = round_places[r];
+        for (size_t i = 0; i < PAIR_VALUES; i++) {
+            want[i] = unicon_apply_rounded(&conv, in[i], places);
+        }
+        for (size_t offset = 0; offset < 4; offset++) {
+            size_t n = (offset == 0) ? PAIR_VALUES : randomBelow(state, 40);
+            memset(out, 0, (PAIR_VALUES + 1) * sizeof(*out));
+            unicon_apply_array(&conv, in + offset, out + offset, n, places);
+            for (size_t i = offset; i < offset + n; i++) {
+                if (!expect(sameDouble(out[i], want[i]))) {
+                    reportPair("unicon_apply_array", from, to, in[i], out[i], want[i]);
+                    break;
+                }
+            }
+            if (!expect(out[offset + n] == 0)) {
+                report("unicon_apply_array", "%s to %s wrote past the end of %zu values", unicon_unit_name(from),
+                       unicon_unit_name(to), n);
+            }
+        }
+
+        // Long double, for which only the scalar loop exists
+        unicon_apply_array_exact(&exact, in, out, PAIR_VALUES, places);
+        for (size_t i = 0; i < PAIR_VALUES; i++) {
+            double expected = unicon_apply_exact(&exact, in[i], places);
+            if (!expect(sameDouble(out[i], expected))) {
+                reportPair("unicon_apply_array_exact", from, to, in[i], out[i], expected);
+                break;
+            }
+        }
+
+        // Single precision, in place, against float arithmetic
+        float scale = (float)conv.scale, offset = (float)conv.offset;
+        float p10 = places >= 0 ? (float)pow(10, places) : 0;
+        p10 = isinf(p10) ? 0 : p10;
+        for (size_t i = 0; i < PAIR_VALUES; i++) {
+            floats[i] = (float)in[i];
+        }
+        unicon_apply_array_f32(&conv, floats, floats, PAIR_VALUES, places);
+        for (size_t i = 0; i < PAIR_VALUES; i++) {
+            float expected = roundFloat((float)in[i] * scale + offset, p10);
+            if (!expect(sameFloat(floats[i], expected))) {
+                reportPair("unicon_apply_array_f32", from, to, in[i], floats[i], expected);
+                break;
+            }
+        }
+    }
+
+    unicon_convert_array(in, out, PAIR_VALUES, from, to);
+    for (size_t i = 0; i < PAIR_VALUES; i++) {
+        double expected = unicon_apply(&conv, in[i]);
+        if (!expect(sameDouble(out[i], expected))) {
+            reportPair("unicon_convert_array", from, to, in[i], out[i], expected);
+            break;
+        }
+    }
+}
+
+// Function to check every pair of built-in units of the same type
+static void checkConversions(uint64_t *state) {
+    unsigned long first_check = checks, first_failure = failures;
+    double *in = malloc((PAIR_VALUES + 1) * sizeof(*in));
+    double *out = malloc((PAIR_VALUES + 1) * sizeof(*out));
+    double *want = malloc(PAIR_VALUES * sizeof(*want));
+    float *floats = malloc(PAIR_VALUES * sizeof(*floats));
+    if (in == NULL || out == NULL || want == NULL || floats == NULL) {
+        perror("unicon-check");
+        exit(1);
+    }
+    for (Unit from = 0; from < NUNITS; from++) {
+        for (Unit to = 0; to < NUNITS; to++) {
+            if (unicon_unit_type(from) == unicon_unit_type(to)) {
+                checkPair(state, from, to, in, out, want, floats);
+            }
+        }
+    }
+    free(floats);
+    free(want);
+    free(out);
+    free(in);
+    finishGroup("convert", first_check, first_failure);
+}
+
+// The size of each unit as the fraction of its base unit units.def gives,
+// independently of the registry, and the sizes of the SI family
+typedef struct _Fraction {
+    uint64_t num;
+    uint64_t den;
+    bool offset;
+} Fraction;
+
+static const Fraction unit_fractions[NUNITS] = {
+#define UNIT(id, type, name, num, den, offset_num, offset_den) [id] = {num, den, (offset_num) != 0},
+#include "units.def"
+};
+
+static const Fraction decimal_fractions[] = {
+#define DECIMAL(id, num, den) {num, den, false},
+#include "units.def"
+};
+
+static const Unit decimal_units[] = {
+#define DECIMAL(id, num, den) id,
+#include "units.def"
+};
+
+// Function to get the greatest common divisor of two 128-bit numbers
+static unsigned __int128 gcdWide(unsigned __int128 a, unsigned __int128 b) {
+    while (b != 0) {
+        unsigned __int128 t = a % b;
+        a = b;
+        b = t;
+    }
+    return a;
+}
+
+// Function to draw a count: any 64 bits, small counts, or one next to a
+// power of two or of ten, where the shifts and reciprocals are at an edge
+static uint64_t randomCount(uint64_t *state) {
+    switch (randomBelow(state, 6)) {
+        case 0:
+            return randomBelow(state, 100000);
+        case 1:
+            return (1ULL << randomBelow(state, 64)) + randomBelow(state, 3) - 1;
+        case 2: {
+            uint64_t power = 1;
+            for (unsigned i = randomBelow(state, 20); i > 0; i--) {
+                power *= 10;
+            }
+            return power * (1 + randomBelow(state, 17)) + randomBelow(state, 3) - 1;
+        }
+        case 3:
+            return UINT64_MAX - randomBelow(state, 4);
+        default:
+            return nextRandom(state);
+    }
+}
+
+// Function to check the whole count conversion of one pair of units
+// against the product of the fractions, for counts and for arrays of them
+// at every alignment
+static void checkIntegerPair(uint64_t *state, const UniconRegistry *registry, const Fraction *fractions,
+                             Unit from, Unit to, uint64_t *in, uint64_t *out, uint64_t *rest) {
+    const char *what = unicon_registry_unit_name(registry, from);
+    const char *to_name = unicon_registry_unit_name(registry, to);
+    const Fraction *a = &fractions[from], *b = &fractions[to];
+    unsigned __int128 num = (unsigned __int128)a->num * b->den, den = (unsigned __int128)a->den * b->num;
+    unsigned __int128 g = gcdWide(num, den);
+    num /= g;
+    den /= g;
+    bool exact = !a->offset && !b->offset && num <= UINT64_MAX && den <= UINT64_MAX;
+
+    IntegerConversion conv;
+    int status = unicon_registry_compile_integer(registry, from, to, &conv);
+    if (!expect(status == (exact ? UNICON_OK : UNICON_EINEXACT))) {
+        report(what, "to %s: compile gives %d", to_name, status);
+    }
+    if (status != UNICON_OK) {
+        return;
+    }
+    if (!expect(conv.num == num && conv.den == den)) {
+        report(what, "to %s: fraction %llu/%llu", to_name, (unsigned long long)conv.num,
+               (unsigned long long)conv.den);
+        return;
+    }
+
+    for (size_t i = 0; i < INTEGER_VALUES; i++) {
+        uint64_t x = randomCount(state);
+        unsigned __int128 product = (unsigned __int128)x * num;
+        unsigned __int128 quotient = product / den;
+        bool over = quotient > UINT64_MAX;
+        uint64_t want = over ? UINT64_MAX : (uint64_t)quotient;
+        uint64_t want_rest = over ? 0 : (uint64_t)(product % den);
+        uint64_t got, got_rest;
+        status = unicon_apply_integer(&conv, x, &got, &got_rest);
+        if (!expect(status == (over ? UNICON_ERANGE : UNICON_OK) && got == want && got_rest == want_rest)) {
+            report(what, "to %s: %llu gives %llu and %llu, not %llu and %llu", to_name, (unsigned long long)x,
+                   (unsigned long long)got, (unsigned long long)got_rest, (unsigned long long)want,
+                   (unsigned long long)want_rest);
+        }
+        in[i] = x;
+    }
+
+    // Arrays of every length from every offset, with and without the
+    // remainders and in place, each past its end left alone
+    uint64_t want[INTEGER_VALUES], want_rest[INTEGER_VALUES];
+    bool saturated[INTEGER_VALUES];
+    for (size_t i = 0; i < INTEGER_VALUES; i++) {
+        saturated[i] = unicon_apply_integer(&conv, in[i], &want[i], &want_rest[i]) != UNICON_OK;
+    }
+    for (unsigned trial = 0; trial < 12; trial++) {
+        size_t offset = randomBelow(state, 9);
+        size_t n = (trial < 4) ? trial : randomBelow(state, INTEGER_VALUES - offset + 1);
+        bool in_place = (trial % 3 == 2), with_rest = (trial % 2 == 0);
+        if (in_place) {
+            memcpy(out + offset, in + offset, n * sizeof(*in));
+        }
+        out[offset + n] = rest[offset + n] = 0x5555;
+        size_t over = unicon_apply_integer_array(&conv, in_place ? out + offset : in + offset, out + offset,
+                                                 with_rest ? rest + offset : NULL, n);
+        size_t want_over = 0;
+        bool same = true;
+        for (size_t i = offset; i < offset + n; i++) {
+            want_over += saturated[i];
+            same = same && out[i] == want[i] && (!with_rest || rest[i] == want_rest[i]);
+        }
+        if (!expect(same && over == want_over && out[offset + n] == 0x5555 && rest[offset + n] == 0x5555)) {
+            report(what, "to %s: array of %zu at %zu differs%s%s", to_name, n, offset, in_place ? " in place" : "",
+                   with_rest ? " with remainders" : "");
+        }
+    }
+}
+
+// Function to check the whole count conversions of every pair of units of
+// the same type, in the default registry and with the SI storage units
+static void checkIntegers(uint64_t *state) {
+    unsigned long first_check = checks, first_failure = failures;
+    uint64_t in[INTEGER_VALUES], out[INTEGER_VALUES + 1], rest[INTEGER_VALUES + 1];
+    Fraction si_fractions[NUNITS];
+    memcpy(si_fractions, unit_fractions, sizeof(si_fractions));
+    for (size_t i = 0; i < sizeof(decimal_units) / sizeof(decimal_units[0]); i++) {
+        si_fractions[decimal_units[i]] = decimal_fractions[i];
+    }
+    const UniconRegistry *registries[] = {unicon_registry_builtin(), unicon_registry_builtin_si()};
+    const Fraction *fractions[] = {unit_fractions, si_fractions};
+    for (size_t r = 0; r < 2; r++) {
+        for (Unit from = 0; from < NUNITS; from++) {
+            for (Unit to = 0; to < NUNITS; to++) {
+                if (unicon_unit_type(from) == unicon_unit_type(to)) {
+                    checkIntegerPair(state, registries[r], fractions[r], from, to, in, out, rest);
+                }
+            }
+        }
+    }
+    finishGroup("integer", first_check, first_failure);
+}
+
+// Function to write a random number the ways input spells them: plain and
+// exponent forms, long runs of digits, signs, leading zeros and bare points
+static size_t randomNumberText(uint64_t *state, char *buf, size_t size) {
+    double value = randomValue(state);
+    switch (randomBelow(state, 8)) {
+        case 0:
+            return snprintf(buf, size, "%.17g", value);
+        case 1:
+            return snprintf(buf, size, "%.*e", (int)randomBelow(state, 25), value);
+        case 2:
+            return snprintf(buf, size, "%+.*f", (int)randomBelow(state, 8), fmod(value, 1e9));
+        case 3: {
+            // More digits than the fast path keeps
+            size_t n = snprintf(buf, size, "%s%u.", (nextRandom(state) & 1) ? "-" : "", randomBelow(state, 1000));
+            for (unsigned i = randomBelow(state, 30); i > 0 && n + 1 < size; i--) {
+                buf[n++] = (char)('0' + randomBelow(state, 10));
+            }
+            buf[n] = '\0';
+            return n;
+        }
+        case 4:
+            return snprintf(buf, size, "000%u.%u000e%d", randomBelow(state, 1000), randomBelow(state, 1000),
+                            (int)randomBelow(state, 700) - 350);
+        case 5:
+            return snprintf(buf, size, "%s.%u", (nextRandom(state) & 1) ? "-" : "", randomBelow(state, 100000));
+        case 6:
+            return snprintf(buf, size, "%u.%se", randomBelow(state, 100), (nextRandom(state) & 1) ? "5" : "");
+        default:
+            return snprintf(buf, size, "%.3f", fmod(value, 1e7));
+    }
+}
+
+// Function to check the parser against strtod() and the formatters
+// against snprintf() and reading their output back
+static void checkText(uint64_t *state) {
+    unsigned long first_check = checks, first_failure = failures;
+    char text[128], expected[UNICON_FORMAT_MAX(19)], got[UNICON_FORMAT_MAX(19)];
+    for (size_t i = 0; i < PARSE_STRINGS; i++) {
+        size_t len = randomNumberText(state, text, sizeof(text));
+        char *strtod_end;
+        double want = strtod(text, &strtod_end);
+        double value = 0;
+        const char *end = unicon_parse_number(text, text + len, &value);
+        if (!expect(end == strtod_end && sameDouble(value, want))) {
+            report("unicon_parse_number", "'%s' gives %.17g, expected %.17g", text, value, want);
+        }
+    }
+
+    for (size_t i = 0; i < PARSE_STRINGS; i++) {
+        double value = randomValue(state);
+        int places = (int)randomBelow(state, 21);
+        snprintf(expected, sizeof(expected), "%.*f", places, value);
+        unicon_format_fixed(got, sizeof(got), value, places);
+        if (!expect(strcmp(got, expected) == 0)) {
+            report("unicon_format_fixed", "%.17g to %d places gives '%s', expected '%s'", value, places, got, expected);
+        }
+
+        // The shortest form has to read back as the same double, in no
+        // more digits than %.17g takes
+        size_t len = unicon_format_shortest(got, sizeof(got), value);
+        size_t longest = snprintf(expected, sizeof(expected), "%.17g", value);
+        if (!expect(sameDouble(strtod(got, NULL), value) && len == strlen(got) && len <= longest + 4)) {
+            report("unicon_format_shortest", "%.17g gives '%s'", value, got);
+        }
+    }
+    finishGroup("text", first_check, first_failure);
+}
+
+// Function to write len bytes to a new temporary file, whose path is put
+// in path
+static bool writeTemp(char *path, const char *data, size_t len) {
+    strcpy(path, "/tmp/unicon-check-XXXXXX");
+    int fd = mkstemp(path);
+    if (fd < 0) {
+        return false;
+    }
+    bool ok = (write(fd, data, len) == (ssize_t)len);
+    close(fd);
+    return ok;
+}
+
+// Function to run a batch conversion of the file at path with what it
+// writes to stdout caught in out, and its messages on stderr dropped.
+// Returns whether the output was caught, the run's own exit status going
+// in status.
+static bool captureBatch(Batch *batch, const char *path, OutBuffer *out, int *status) {
+    char out_path[32];
+    if (!writeTemp(out_path, "", 0)) {
+        return false;
+    }
+    fflush(stdout);
+    fflush(stderr);
+    int saved_out = dup(STDOUT_FILENO), saved_err = dup(STDERR_FILENO);
+    int fd = open(out_path, O_RDWR | O_TRUNC);
+    int null = open("/dev/null", O_WRONLY);
+    dup2(fd, STDOUT_FILENO);
+    dup2(null, STDERR_FILENO);
+    close(null);
+
+    *status = runBatch(batch, path);
+
+    fflush(stdout);
+    fflush(stderr);
+    dup2(saved_out, STDOUT_FILENO);
+    dup2(saved_err, STDERR_FILENO);
+    close(saved_out);
+    close(saved_err);
+
+    out->used = 0;
+    off_t size = lseek(fd, 0, SEEK_END);
+    char *data = (size >= 0) ? reserveOutput(out, (size_t)size + 1) : NULL;
+    bool ok = (data != NULL && pread(fd, data, size, 0) == size);
+    out->used = ok ? (size_t)size : 0;
+    close(fd);
+    unlink(out_path);
+    return ok;
+}
+
+// Function to append text to a buffer
+static void appendText(OutBuffer *buf, const char *text, size_t len) {
+    char *p = reserveOutput(buf, len);
+    if (p == NULL) {
+        perror("unicon-check");
+        exit(1);
+    }
+    memcpy(p, text, len);
+    buf->used += len;
+}
+
+// Function to append a number the way batch output prints it, with the
+// reference printf() formatting for fixed decimals
+static void appendNumber(OutBuffer *buf, double value, OutputFormat format, int places) {
+    char text[UNICON_FORMAT_MAX(19)];
+    size_t len = (format == FORMAT_SHORTEST) ? unicon_format_shortest(text, sizeof(text), value)
+                                            : (size_t)snprintf(text, sizeof(text), "%.*f", places, value);
+    appendText(buf, text, len);
+}
+
+// Function to compare the output of a run with the expected output and
+// report the first line that differs, or the first byte of binary output
+static void compareOutput(const char *what, const OutBuffer *got, const OutBuffer *want, bool binary) {
+    size_t n = got->used < want->used ? got->used : want->used;
+    size_t at = 0;
+    while (at < n && got->data[at] == want->data[at]) {
+        at++;
+    }
+    if (expect(at == n && got->used == want->used)) {
+        return;
+    }
+    if (binary) {
+        report(what, "%zu bytes differ from byte %zu on", want->used - at, at);
+        return;
+    }
+    size_t line_start = at;
+    while (line_start > 0 && want->data[line_start - 1] != '\n') {
+        line_start--;
+    }
+    const char *got_line = got->data + line_start, *want_line = want->data + line_start;
+    const char *got_end = memchr(got_line, '\n', got->used - line_start);
+    const char *want_end = memchr(want_line, '\n', want->used - line_start);
+    report(what, "at byte %zu, '%.*s' instead of '%.*s'", at, got_end ? (int)(got_end - got_line) : 0, got_line,
+           want_end ? (int)(want_end - want_line) : 0, want_line);
+}
+
+// Ways a batch run is done, each given the same input
+typedef struct _BatchRun {
+    int jobs;
+    IOMode io;
+    const char *name;
+} BatchRun;
+
+static const BatchRun batch_runs[] = {
+    {1, IO_SYNC, "-j1 sync"},
+    {1, IO_THREAD, "-j1 thread"},
+    {2, IO_THREAD, "-j2 thread"},
+    {4, IO_AUTO, "-j4 auto"},
+};
+
+// Function to run one batch setting the ways of batch_runs and compare
+// each output with the expected one
+static void checkRuns(Batch *batch, const char *path, const OutBuffer *want, const char *setting) {
+    OutBuffer got = {0};
+    char what[96];
+    for (size_t r = 0; r < sizeof(batch_runs) / sizeof(batch_runs[0]); r++) {
+        batch->jobs = batch_runs[r].jobs;
+        batch->io = batch_runs[r].io;
+        snprintf(what, sizeof(what), "batch %s %s", setting, batch_runs[r].name);
+        int status;
+        if (!expect(captureBatch(batch, path, &got, &status) && status == 0)) {
+            report(what, "the run failed");
+        } else {
+            compareOutput(what, &got, want, recordSize(batch->format) > 0);
+        }
+    }
+    free(got.data);
+}
+
+// Function to check whole runs of one value per line to two targets,
+// binary values and values with their own units, on every thread count and
+// I/O mode, against output built line by line from strtod() and the
+// scalar conversion
+static void checkBatch(uint64_t *state) {
+    unsigned long first_check = checks, first_failure = failures;
+    const UniconRegistry *registry = unicon_registry_builtin();
+    static const char *const targets[] = {"miles", "meters"};
+    Conversion convs[2];
+    unicon_compile(KILOMETERS, MILE, &convs[0]);
+    unicon_compile(KILOMETERS, METERS, &convs[1]);
+
+    // Values one per line, spelled in every way and padded with spaces,
+    // with blank lines between
+    OutBuffer input = {0}, want = {0};
+    double *values = malloc(BATCH_LINES * sizeof(*values));
+    size_t nvalues = 0;
+    if (values == NULL) {
+        perror("unicon-check");
+        exit(1);
+    }
+    for (size_t i = 0; i < BATCH_LINES; i++) {
+        char text[128];
+        int len = 0;
+        if (randomBelow(state, 50) == 0) {
+            len = snprintf(text, sizeof(text), " \n");
+        } else {
+            // Only whole, finite numbers, the rest are for the parser
+            size_t n;
+            char *end;
+            do {
+                n = randomNumberText(state, text + 1, sizeof(text) - 3);
+                values[nvalues] = strtod(text + 1, &end);
+            } while (end != text + 1 + n || !isfinite(values[nvalues]));
+            nvalues++;
+            text[0] = (nextRandom(state) & 7) ? '\t' : ' ';
+            len = 1 + (int)n;
+            text[len++] = '\n';
+        }
+        appendText(&input, text, len);
+    }
+    char path[32];
+    if (!writeTemp(path, input.data, input.used)) {
+        perror("unicon-check");
+        exit(1);
+    }
+
+    static const struct {
+        OutputFormat format;
+        int places;
+        const char *name;
+    } settings[] = {
+        {FORMAT_FIXED, -1, "fixed"},
+        {FORMAT_FIXED, 6, "fixed -r 6"},
+        {FORMAT_SHORTEST, -1, "shortest"},
+    };
+    for (size_t s = 0; s < sizeof(settings) / sizeof(settings[0]); s++) {
+        Batch batch = {.registry = registry, .ntargets = 2, .round_places = settings[s].places,
+                       .format = settings[s].format};
+        unicon_registry_parse_expression(registry, "kilometers", 10, &batch.from);
+        for (size_t t = 0; t < 2; t++) {
+            unicon_registry_parse_expression(registry, targets[t], strlen(targets[t]), &batch.targets[t].unit);
+        }
+        compileTargets(&batch, NULL, NULL);
+
+        int places = settings[s].places >= 0 ? settings[s].places : 2;
+        want.used = 0;
+        for (size_t i = 0; i < nvalues; i++) {
+            appendNumber(&want, values[i], settings[s].format, places);
+            appendText(&want, " kilometers = ", 14);
+            appendNumber(&want, unicon_apply_rounded(&convs[0], values[i], settings[s].places), settings[s].format, places);
+            appendText(&want, " miles, ", 8);
+            appendNumber(&want, unicon_apply_rounded(&convs[1], values[i], settings[s].places), settings[s].format, places);
+            appendText(&want, " meters\n", 8);
+        }
+        checkRuns(&batch, path, &want, settings[s].name);
+    }
+    unlink(path);
+
+    // The same values packed as doubles
+    Batch binary = {.registry = registry, .ntargets = 1, .round_places = 3, .format = FORMAT_F64LE};
+    unicon_registry_parse_expression(registry, "kilometers", 10, &binary.from);
+    unicon_registry_parse_expression(registry, "miles", 5, &binary.targets[0].unit);
+    compileTargets(&binary, NULL, NULL);
+    want.used = 0;
+    for (size_t i = 0; i < nvalues; i++) {
+        double result = unicon_apply_rounded(&convs[0], values[i], 3);
+        appendText(&want, (const char *)&result, sizeof(result));
+    }
+    if (!writeTemp(path, (const char *)values, nvalues * sizeof(*values))) {
+        perror("unicon-check");
+        exit(1);
+    }
+    checkRuns(&binary, path, &want, "f64le");
+    unlink(path);
+
+    // Counts of bytes packed as 64-bit integers, to whole SI megabytes
+    const UniconRegistry *si = unicon_registry_builtin_si();
+    Batch counts = {.registry = si, .ntargets = 1, .format = FORMAT_U64LE};
+    unicon_registry_parse_expression(si, "bytes", 5, &counts.from);
+    unicon_registry_parse_expression(si, "megabytes", 9, &counts.targets[0].unit);
+    compileTargets(&counts, NULL, NULL);
+    input.used = 0;
+    want.used = 0;
+    for (size_t i = 0; i < BATCH_LINES; i++) {
+        uint64_t count = nextRandom(state) >> randomBelow(state, 64);
+        uint64_t result = count / 1000000;
+        appendText(&input, (const char *)&count, sizeof(count));
+        appendText(&want, (const char *)&result, sizeof(result));
+    }
+    if (!writeTemp(path, input.data, input.used)) {
+        perror("unicon-check");
+        exit(1);
+    }
+    checkRuns(&counts, path, &want, "u64le");
+    unlink(path);
+
+    // Binary input too short for a single value writes nothing and fails
+    // the run for the partial value
+    Batch floats = binary;
+    floats.format = FORMAT_F32LE;
+    Batch *binaries[] = {&binary, &floats, &counts};
+    OutBuffer got = {0};
+    for (size_t b = 0; b < sizeof(binaries) / sizeof(binaries[0]); b++) {
+        size_t size = recordSize(binaries[b]->format);
+        for (size_t len = 1; len < size; len++) {
+            if (!writeTemp(path, "12345678", len)) {
+                perror("unicon-check");
+                exit(1);
+            }
+            for (size_t r = 0; r < sizeof(batch_runs) / sizeof(batch_runs[0]); r++) {
+                binaries[b]->jobs = batch_runs[r].jobs;
+                binaries[b]->io = batch_runs[r].io;
+                int status;
+                if (!expect(captureBatch(binaries[b], path, &got, &status) && status != 0 && got.used == 0)) {
+                    report("batch partial value", "%zu bytes of %zu %s gave status %d and %zu bytes", len, size,
+                           batch_runs[r].name, status, got.used);
+                }
+            }
+            unlink(path);
+        }
+    }
+    free(got.data);
+
+    // Values with their own units of length, named by any of their names,
+    // to a single target
+    Unit lengths[NUNITS];
+    size_t nlengths = 0;
+    for (Unit unit = 0; unit < NUNITS; unit++) {
+        if (unicon_unit_type(unit) == unicon_unit_type(MILE)) {
+            lengths[nlengths++] = unit;
+        }
+    }
+    size_t nkeys = unicon_registry_keys(registry);
+    input.used = 0;
+    want.used = 0;
+    for (size_t i = 0; i < BATCH_LINES; i++) {
+        Unit unit = lengths[randomBelow(state, nlengths)];
+        const char *name = unicon_unit_name(unit);
+        for (unsigned tries = randomBelow(state, 4); tries > 0; tries--) {
+            // Now and then an alias of the unit, when one is drawn
+            Unit key_unit;
+            const char *key = unicon_registry_key_name(registry, randomBelow(state, nkeys), &key_unit);
+            if (key_unit == unit) {
+                name = key;
+            }
+        }
+        double value = values[i % nvalues];
+        char text[192];
+        char number[UNICON_FORMAT_MAX(19)];
+        snprintf(number, sizeof(number), "%.17g", value);
+        int len = snprintf(text, sizeof(text), "%s %s\n", number, name);
+        appendText(&input, text, len);
+
+        Conversion conv;
+        unicon_compile(unit, MILE, &conv);
+        appendNumber(&want, value, FORMAT_FIXED, 4);
+        len = snprintf(text, sizeof(text), " %s = ", unicon_unit_name(unit));
+        appendText(&want, text, len);
+        appendNumber(&want, unicon_apply_rounded(&conv, value, 4), FORMAT_FIXED, 4);
+        appendText(&want, " miles\n", 7);
+    }
+    if (!writeTemp(path, input.data, input.used)) {
+        perror("unicon-check");
+        exit(1);
+    }
+    Batch mixed = {.registry = registry, .ntargets = 1, .round_places = 4, .mixed = true};
+    unicon_registry_parse_expression(registry, "miles", 5, &mixed.targets[0].unit);
+    mixed.from = mixed.targets[0].unit;
+    compileTargets(&mixed, NULL, NULL);
+    checkRuns(&mixed, path, &want, "mixed");
+    unlink(path);
+
+    free(values);
+    free(want.data);
+    free(input.data);
+    finishGroup("batch", first_check, first_failure);
+}
+
+int main(int argc, char **argv) {
+    uint64_t seed = (argc > 1) ? strtoull(argv[1], NULL, 0) : 1;
+    printf("unicon-check seed %llu\n", (unsigned long long)seed);
+    uint64_t state = seed;
+    checkConversions(&state);
+    checkIntegers(&state);
+    checkText(&state);
+    checkBatch(&state);
+    if (failures > 0) {
+        printf("%lu of %lu checks failed\n", failures, checks);
+        return 1;
+    }
+    printf("all %lu checks passed\n", checks);
+    return 0;
+}
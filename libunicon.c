@@ -0,0 +1,2746 @@
+/* 
+ * libunicon.c
+ *
+ * Copyright 2024 Clay Gomera
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-only
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <math.h>
+#include <errno.h>
+#include <locale.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define HAVE_X86_KERNELS 1
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#define HAVE_NEON_KERNELS 1
+#endif
+
+#include "unicon.h"
+#include "unicon_pairs.h"
+#include "unicon_private.h"
+
+// Struct for the units table
+//
+// A value in the base unit of its type converts to this unit as
+// value * conversion_factor + offset. Only temperatures use the offset.
+typedef struct _UnitTable {
+    UnitType type;
+    Unit unit;
+    const char *name;
+    double conversion_factor;
+    double offset;
+} UnitTable;
+
+// The factor and offset of a unit from its exact definition in units.def.
+// Both terms of every built-in unit are exact doubles, so the division
+// rounds the exact value once.
+#define UNIT_FACTOR(num, den) ((double)(den) / (double)(num))
+#define UNIT_OFFSET(offset_num, offset_den) ((double)(offset_num) / (double)(offset_den))
+
+// Units table with conversion factors
+static const UnitTable unit_table[] = {
+#define UNIT(id, type, name, num, den, offset_num, offset_den) \
+    {type, id, name, UNIT_FACTOR(num, den), UNIT_OFFSET(offset_num, offset_den)},
+#include "units.def"
+};
+
+// Buffer sizes the formatters need for their fast paths
+#define FORMAT_FIXED_FAST 64
+#define FORMAT_SHORTEST_MAX 32
+
+// Function to convert a value from one unit to another
+int unicon_convert(double value, Unit from, Unit to, double *result) {
+    if ((unsigned)from >= NUNITS || (unsigned)to >= NUNITS) {
+        return UNICON_EUNIT;
+    }
+    if (unit_table[from].type != unit_table[to].type) {
+        return UNICON_ETYPE;
+    }
+    if (from == to) {
+        *result = value;
+        return UNICON_OK;
+    }
+
+    // Temperatures need to be handled by formula
+    switch (from) {
+        case CELSIUS:
+            switch (to) {
+                case FAHRENHEIT:
+                    *result = (value * 9/5) + 32;
+                    return UNICON_OK;
+                case KELVIN:
+                    *result = value + 273.15;
+                    return UNICON_OK;
+                default:
+                    break;
+            }
+        case FAHRENHEIT:
+            switch (to) {
+                case CELSIUS:
+                    *result = (value - 32) * 5/9;
+                    return UNICON_OK;
+                case KELVIN:
+                    *result = (value - 32) * 5/9 + 273.15;
+                    return UNICON_OK;
+                default:
+                    break;
+            }
+        case KELVIN:
+            switch (to) {
+                case CELSIUS:
+                    *result = value - 273.15;
+                    return UNICON_OK;
+                case FAHRENHEIT:
+                    *result = (value - 273.15) * 9/5 + 32;
+                    return UNICON_OK;
+                default:
+                    break;
+            }
+        default:
+            break;
+    }
+    double factor = unit_table[to].conversion_factor / unit_table[from].conversion_factor;
+    *result = value * factor;
+    return UNICON_OK;
+}
+
+// Function to fold the conversion from one unit to another, both given as
+// factor and offset from their base unit, into one scale and offset. The
+// factors may be exact long double scales.
+static void compileAffine(long double from_factor, double from_offset, long double to_factor, double to_offset,
+                          Conversion *conv) {
+    long double scale = to_factor / from_factor;
+    conv->scale = (double)scale;
+    conv->offset = (double)(to_offset - from_offset * scale);
+}
+
+// Function to fold a conversion the same way, keeping long double precision
+static void compileAffineExact(long double from_factor, double from_offset, long double to_factor, double to_offset,
+                               ExactConversion *conv) {
+    conv->scale = (long double)to_factor / from_factor;
+    conv->offset = to_offset - from_offset * conv->scale;
+}
+
+// Function to resolve the conversion between two units into an affine
+// scale and offset, so converting a value needs no branches
+int unicon_compile(Unit from, Unit to, Conversion *conv) {
+    if ((unsigned)from >= NUNITS || (unsigned)to >= NUNITS) {
+        return UNICON_EUNIT;
+    }
+    if (unit_table[from].type != unit_table[to].type) {
+        return UNICON_ETYPE;
+    }
+    // Folded at build time by unitgen
+    *conv = unicon_pairs[from * NUNITS + to];
+    return UNICON_OK;
+}
+
+// Function to resolve a conversion in long double precision
+int unicon_compile_exact(Unit from, Unit to, ExactConversion *conv) {
+    if ((unsigned)from >= NUNITS || (unsigned)to >= NUNITS) {
+        return UNICON_EUNIT;
+    }
+    if (unit_table[from].type != unit_table[to].type) {
+        return UNICON_ETYPE;
+    }
+    *conv = unicon_pairs_exact[from * NUNITS + to];
+    return UNICON_OK;
+}
+
+// Exact powers of ten, up to the largest a double holds without rounding
+static const double exact_pow10[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+// The same for long double, whose 64-bit significand holds up to 10^27
+static const long double exact_pow10l[] = {
+    1e0L, 1e1L, 1e2L, 1e3L, 1e4L, 1e5L, 1e6L, 1e7L, 1e8L, 1e9L, 1e10L, 1e11L, 1e12L, 1e13L,
+    1e14L, 1e15L, 1e16L, 1e17L, 1e18L, 1e19L, 1e20L, 1e21L, 1e22L, 1e23L, 1e24L, 1e25L, 1e26L, 1e27L
+};
+
+// Function to get the scale of a rounding to places decimals, 10^places,
+// from the table for every rounding short of 23 places. pow() gives the
+// same correctly rounded value beyond.
+static inline double powerOfTen(int places) {
+    return places < 23 ? exact_pow10[places] : pow(10, places);
+}
+
+static inline long double powerOfTenl(int places) {
+    return places < 28 ? exact_pow10l[places] : powl(10, places);
+}
+
+// Functions to round to the nearest integer, halfway cases away from zero,
+// giving exactly what round(), roundl() and roundf() give without the
+// call into libm. Values from 2^52 (2^63, 2^23) up are integers already.
+// The fraction |x| - |t| is exact, and stepping by a selected 0 or 1
+// instead of branching keeps random halves from costing mispredictions.
+static inline double roundHalfAway(double x) {
+    if (!(fabs(x) < 0x1p52)) {
+        return x;
+    }
+    double t = fabs((double)(int64_t)x);
+    double step = (fabs(x) - t >= 0.5) ? 1.0 : 0.0;
+    return copysign(t + step, x);
+}
+
+static inline long double roundHalfAwayl(long double x) {
+    if (!(fabsl(x) < 0x1p63L)) {
+        return x;
+    }
+    long double t = fabsl((long double)(int64_t)x);
+    long double step = (fabsl(x) - t >= 0.5L) ? 1.0L : 0.0L;
+    return copysignl(t + step, x);
+}
+
+static inline float roundHalfAwayf(float x) {
+    if (!(fabsf(x) < 0x1p23f)) {
+        return x;
+    }
+    float t = fabsf((float)(int32_t)x);
+    float step = (fabsf(x) - t >= 0.5f) ? 1.0f : 0.0f;
+    return copysignf(t + step, x);
+}
+
+// Function to round a value to round_places decimals
+double unicon_round(double value, int round_places) {
+    if (round_places < 0) {
+        return value;
+    }
+    double p10 = powerOfTen(round_places);
+    return roundHalfAway(value * p10) / p10;
+}
+
+// Function to convert a value in long double precision and round it
+double unicon_apply_exact(const ExactConversion *conv, double value, int round_places) {
+    long double result = value * conv->scale + conv->offset;
+
+    if (round_places >= 0) {
+        long double p10 = powerOfTenl(round_places);
+        result = roundHalfAwayl(result * p10) / p10;
+    }
+    return (double)result;
+}
+
+// Function to convert an array in long double precision
+void unicon_apply_array_exact(const ExactConversion *conv, const double *in, double *out, size_t n, int round_places) {
+    if (round_places < 0) {
+        for (size_t i = 0; i < n; i++) {
+            out[i] = (double)(in[i] * conv->scale + conv->offset);
+        }
+        return;
+    }
+    long double p10 = powerOfTenl(round_places);
+    for (size_t i = 0; i < n; i++) {
+        out[i] = (double)(roundHalfAwayl((in[i] * conv->scale + conv->offset) * p10) / p10);
+    }
+}
+
+// Function to convert a value and apply the requested rounding
+double unicon_apply_rounded(const Conversion *conv, double value, int round_places) {
+    return unicon_round(unicon_apply(conv, value), round_places);
+}
+
+// Kernels converting an array of values, rounding when p10 is not zero.
+// They all perform the same IEEE operations in the same order as
+// unicon_apply_rounded(), so every kernel gives bit for bit the same results.
+typedef void (*ConvertKernel)(const double *in, double *out, size_t n, const Conversion *conv, double p10);
+
+static void convertArrayScalar(const double *in, double *out, size_t n, const Conversion *conv, double p10) {
+    if (p10 == 0) {
+        for (size_t i = 0; i < n; i++) {
+            out[i] = unicon_apply(conv, in[i]);
+        }
+    } else {
+        for (size_t i = 0; i < n; i++) {
+            out[i] = roundHalfAway(unicon_apply(conv, in[i]) * p10) / p10;
+        }
+    }
+}
+
+#ifdef HAVE_X86_KERNELS
+// round() rounds halfway cases away from zero, which no SSE/AVX rounding
+// mode does, so truncate and step away from zero when the fraction is at
+// least one half. The blend keeps the sign of zero results intact.
+__attribute__((target("avx2")))
+static inline __m256d roundAvx2(__m256d x) {
+    const __m256d sign = _mm256_set1_pd(-0.0);
+    __m256d t = _mm256_round_pd(x, _MM_FROUND_TO_ZERO | _MM_FROUND_NO_EXC);
+    __m256d frac = _mm256_andnot_pd(sign, _mm256_sub_pd(x, t));
+    __m256d away = _mm256_cmp_pd(frac, _mm256_set1_pd(0.5), _CMP_GE_OQ);
+    __m256d step = _mm256_or_pd(_mm256_and_pd(x, sign), _mm256_set1_pd(1.0));
+    return _mm256_blendv_pd(t, _mm256_add_pd(t, step), away);
+}
+
+__attribute__((target("avx2")))
+static void convertArrayAvx2(const double *in, double *out, size_t n, const Conversion *conv, double p10) {
+    __m256d scale = _mm256_set1_pd(conv->scale);
+    __m256d offset = _mm256_set1_pd(conv->offset);
+    __m256d pow10 = _mm256_set1_pd(p10);
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m256d x = _mm256_add_pd(_mm256_mul_pd(_mm256_loadu_pd(in + i), scale), offset);
+        if (p10 != 0) {
+            x = _mm256_div_pd(roundAvx2(_mm256_mul_pd(x, pow10)), pow10);
+        }
+        _mm256_storeu_pd(out + i, x);
+    }
+    convertArrayScalar(in + i, out + i, n - i, conv, p10);
+}
+
+__attribute__((target("avx512f")))
+static void convertArrayAvx512(const double *in, double *out, size_t n, const Conversion *conv, double p10) {
+    const __m512d one = _mm512_set1_pd(1.0);
+    const __m512i sign = _mm512_set1_epi64(INT64_MIN);
+    __m512d scale = _mm512_set1_pd(conv->scale);
+    __m512d offset = _mm512_set1_pd(conv->offset);
+    __m512d pow10 = _mm512_set1_pd(p10);
+    for (size_t i = 0; i < n; i += 8) {
+        __mmask8 lanes = (n - i >= 8) ? 0xff : (__mmask8)((1u << (n - i)) - 1);
+        __m512d x = _mm512_maskz_loadu_pd(lanes, in + i);
+        x = _mm512_add_pd(_mm512_mul_pd(x, scale), offset);
+        if (p10 != 0) {
+            x = _mm512_mul_pd(x, pow10);
+            __m512d t = _mm512_roundscale_pd(x, _MM_FROUND_TO_ZERO | _MM_FROUND_NO_EXC);
+            __m512d frac = _mm512_abs_pd(_mm512_sub_pd(x, t));
+            __mmask8 away = _mm512_cmp_pd_mask(frac, _mm512_set1_pd(0.5), _CMP_GE_OQ);
+            __m512d step = _mm512_castsi512_pd(_mm512_or_si512(
+                _mm512_and_si512(_mm512_castpd_si512(x), sign), _mm512_castpd_si512(one)));
+            x = _mm512_div_pd(_mm512_mask_add_pd(t, away, t, step), pow10);
+        }
+        _mm512_mask_storeu_pd(out + i, lanes, x);
+    }
+}
+#endif
+
+#ifdef HAVE_NEON_KERNELS
+static void convertArrayNeon(const double *in, double *out, size_t n, const Conversion *conv, double p10) {
+    float64x2_t scale = vdupq_n_f64(conv->scale);
+    float64x2_t offset = vdupq_n_f64(conv->offset);
+    float64x2_t pow10 = vdupq_n_f64(p10);
+    size_t i = 0;
+    for (; i + 2 <= n; i += 2) {
+        float64x2_t x = vaddq_f64(vmulq_f64(vld1q_f64(in + i), scale), offset);
+        if (p10 != 0) {
+            // vrndaq rounds halfway cases away from zero, exactly like round()
+            x = vdivq_f64(vrndaq_f64(vmulq_f64(x, pow10)), pow10);
+        }
+        vst1q_f64(out + i, x);
+    }
+    convertArrayScalar(in + i, out + i, n - i, conv, p10);
+}
+#endif
+
+// Function to pick the widest kernel the running CPU supports
+static ConvertKernel selectKernel(void) {
+#ifdef HAVE_X86_KERNELS
+    if (__builtin_cpu_supports("avx512f")) {
+        return convertArrayAvx512;
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        return convertArrayAvx2;
+    }
+#elif defined(HAVE_NEON_KERNELS)
+    return convertArrayNeon;
+#endif
+    return convertArrayScalar;
+}
+
+// Function to convert and round an array of values in a single pass
+void unicon_apply_array(const Conversion *conv, const double *in, double *out, size_t n, int round_places) {
+    double p10 = (round_places >= 0) ? powerOfTen(round_places) : 0;
+    selectKernel()(in, out, n, conv, p10);
+}
+
+// The same kernels for single precision values. The conversion is
+// narrowed to float once and every operation is done in float, so these
+// move half the memory of the double kernels at the cost of precision.
+typedef void (*ConvertKernelF32)(const float *in, float *out, size_t n, float scale, float offset, float p10);
+
+static void convertArrayScalarF32(const float *in, float *out, size_t n, float scale, float offset, float p10) {
+    if (p10 == 0) {
+        for (size_t i = 0; i < n; i++) {
+            out[i] = in[i] * scale + offset;
+        }
+    } else {
+        for (size_t i = 0; i < n; i++) {
+            out[i] = roundHalfAwayf((in[i] * scale + offset) * p10) / p10;
+        }
+    }
+}
+
+#ifdef HAVE_X86_KERNELS
+__attribute__((target("avx2")))
+static inline __m256 roundAvx2F32(__m256 x) {
+    const __m256 sign = _mm256_set1_ps(-0.0f);
+    __m256 t = _mm256_round_ps(x, _MM_FROUND_TO_ZERO | _MM_FROUND_NO_EXC);
+    __m256 frac = _mm256_andnot_ps(sign, _mm256_sub_ps(x, t));
+    __m256 away = _mm256_cmp_ps(frac, _mm256_set1_ps(0.5f), _CMP_GE_OQ);
+    __m256 step = _mm256_or_ps(_mm256_and_ps(x, sign), _mm256_set1_ps(1.0f));
+    return _mm256_blendv_ps(t, _mm256_add_ps(t, step), away);
+}
+
+__attribute__((target("avx2")))
+static void convertArrayAvx2F32(const float *in, float *out, size_t n, float scale, float offset, float p10) {
+    __m256 vscale = _mm256_set1_ps(scale);
+    __m256 voffset = _mm256_set1_ps(offset);
+    __m256 pow10 = _mm256_set1_ps(p10);
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256 x = _mm256_add_ps(_mm256_mul_ps(_mm256_loadu_ps(in + i), vscale), voffset);
+        if (p10 != 0) {
+            x = _mm256_div_ps(roundAvx2F32(_mm256_mul_ps(x, pow10)), pow10);
+        }
+        _mm256_storeu_ps(out + i, x);
+    }
+    convertArrayScalarF32(in + i, out + i, n - i, scale, offset, p10);
+}
+
+__attribute__((target("avx512f")))
+static void convertArrayAvx512F32(const float *in, float *out, size_t n, float scale, float offset, float p10) {
+    const __m512 one = _mm512_set1_ps(1.0f);
+    const __m512i sign = _mm512_set1_epi32(INT32_MIN);
+    __m512 vscale = _mm512_set1_ps(scale);
+    __m512 voffset = _mm512_set1_ps(offset);
+    __m512 pow10 = _mm512_set1_ps(p10);
+    for (size_t i = 0; i < n; i += 16) {
+        __mmask16 lanes = (n - i >= 16) ? 0xffff : (__mmask16)((1u << (n - i)) - 1);
+        __m512 x = _mm512_maskz_loadu_ps(lanes, in + i);
+        x = _mm512_add_ps(_mm512_mul_ps(x, vscale), voffset);
+        if (p10 != 0) {
+            x = _mm512_mul_ps(x, pow10);
+            __m512 t = _mm512_roundscale_ps(x, _MM_FROUND_TO_ZERO | _MM_FROUND_NO_EXC);
+            __m512 frac = _mm512_abs_ps(_mm512_sub_ps(x, t));
+            __mmask16 away = _mm512_cmp_ps_mask(frac, _mm512_set1_ps(0.5f), _CMP_GE_OQ);
+            __m512 step = _mm512_castsi512_ps(_mm512_or_si512(
+                _mm512_and_si512(_mm512_castps_si512(x), sign), _mm512_castps_si512(one)));
+            x = _mm512_div_ps(_mm512_mask_add_ps(t, away, t, step), pow10);
+        }
+        _mm512_mask_storeu_ps(out + i, lanes, x);
+    }
+}
+#endif
+
+#ifdef HAVE_NEON_KERNELS
+static void convertArrayNeonF32(const float *in, float *out, size_t n, float scale, float offset, float p10) {
+    float32x4_t vscale = vdupq_n_f32(scale);
+    float32x4_t voffset = vdupq_n_f32(offset);
+    float32x4_t pow10 = vdupq_n_f32(p10);
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        float32x4_t x = vaddq_f32(vmulq_f32(vld1q_f32(in + i), vscale), voffset);
+        if (p10 != 0) {
+            x = vdivq_f32(vrndaq_f32(vmulq_f32(x, pow10)), pow10);
+        }
+        vst1q_f32(out + i, x);
+    }
+    convertArrayScalarF32(in + i, out + i, n - i, scale, offset, p10);
+}
+#endif
+
+// Function to pick the widest single precision kernel the running CPU supports
+static ConvertKernelF32 selectKernelF32(void) {
+#ifdef HAVE_X86_KERNELS
+    if (__builtin_cpu_supports("avx512f")) {
+        return convertArrayAvx512F32;
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        return convertArrayAvx2F32;
+    }
+#elif defined(HAVE_NEON_KERNELS)
+    return convertArrayNeonF32;
+#endif
+    return convertArrayScalarF32;
+}
+
+// Function to convert and round an array of single precision values.
+// Rounding beyond what a float can scale by is left out.
+void unicon_apply_array_f32(const Conversion *conv, const float *in, float *out, size_t n, int round_places) {
+    float p10 = (round_places >= 0) ? (float)powerOfTen(round_places) : 0;
+    if (isinf(p10)) {
+        p10 = 0;
+    }
+    selectKernelF32()(in, out, n, (float)conv->scale, (float)conv->offset, p10);
+}
+
+// Function to convert an array of values between two units
+int unicon_convert_array(const double *in, double *out, size_t n, Unit from, Unit to) {
+    Conversion conv;
+    int status = unicon_compile(from, to, &conv);
+    if (status == UNICON_OK) {
+        unicon_apply_array(&conv, in, out, n, -1);
+    }
+    return status;
+}
+
+// How an integer conversion computes count * num / den, the kind of an
+// IntegerConversion
+enum {
+    // num is 1 and den 2^shift: a right shift, the low bits the remainder
+    INTEGER_SHIFT,
+    // den is 1: a multiply, or a left shift by shift when num is 2^shift,
+    // saturating counts above limit
+    INTEGER_MULTIPLY,
+    // num is 1: a multiply by the reciprocal magic and a shift by shift
+    INTEGER_DIVIDE,
+    // Anything else, through the 128-bit product, shifted when den is
+    // 2^shift
+    INTEGER_FRACTION
+};
+
+// Function to get the high 64 bits of the product of a and b
+static inline uint64_t mulHigh(uint64_t a, uint64_t b) {
+#ifdef __SIZEOF_INT128__
+    return (uint64_t)(((unsigned __int128)a * b) >> 64);
+#else
+    uint64_t a_lo = (uint32_t)a, a_hi = a >> 32, b_lo = (uint32_t)b, b_hi = b >> 32;
+    uint64_t mid = (a_lo * b_lo >> 32) + (uint32_t)(a_hi * b_lo) + a_lo * b_hi;
+    return a_hi * b_hi + (a_hi * b_lo >> 32) + (mid >> 32);
+#endif
+}
+
+// Function to divide the 128-bit number high:low by d, where high < d so
+// the quotient fits in 64 bits, putting the remainder in rest
+static inline uint64_t divideWide(uint64_t high, uint64_t low, uint64_t d, uint64_t *rest) {
+#ifdef __SIZEOF_INT128__
+    unsigned __int128 n = ((unsigned __int128)high << 64) | low;
+    *rest = (uint64_t)(n % d);
+    return (uint64_t)(n / d);
+#else
+    uint64_t q = 0;
+    for (int i = 63; i >= 0; i--) {
+        bool carry = high >> 63;
+        high = (high << 1) | (low >> i & 1);
+        q <<= 1;
+        if (carry || high >= d) {
+            high -= d;
+            q |= 1;
+        }
+    }
+    *rest = high;
+    return q;
+#endif
+}
+
+// Kernels converting an array of counts exactly, each returning how many
+// results were too large and saturated to UINT64_MAX with no remainder.
+// remainder may be NULL, in and quotient may be the same array.
+typedef size_t (*IntegerKernel)(const IntegerConversion *conv, const uint64_t *in, uint64_t *quotient,
+                                uint64_t *remainder, size_t n);
+
+static size_t convertIntegerScalar(const IntegerConversion *conv, const uint64_t *in, uint64_t *quotient,
+                                   uint64_t *remainder, size_t n) {
+    size_t overflows = 0;
+    int shift = conv->shift;
+    for (size_t i = 0; i < n; i++) {
+        uint64_t x = in[i], q, r = 0;
+        switch (conv->kind) {
+            case INTEGER_SHIFT:
+                q = x >> shift;
+                r = x & (conv->den - 1);
+                break;
+            case INTEGER_MULTIPLY:
+                q = (x > conv->limit) ? UINT64_MAX : (shift >= 0 ? x << shift : x * conv->num);
+                overflows += (x > conv->limit);
+                break;
+            case INTEGER_DIVIDE: {
+                uint64_t t = mulHigh(x, conv->magic);
+                q = (t + ((x - t) >> 1)) >> (shift - 1);
+                r = x - q * conv->den;
+                break;
+            }
+            default: {
+                uint64_t high = mulHigh(x, conv->num), low = x * conv->num;
+                if (shift >= 0 ? (high >> shift) != 0 : high >= conv->den) {
+                    q = UINT64_MAX;
+                    overflows++;
+                } else if (shift >= 0) {
+                    q = (high << (63 - shift) << 1) | (low >> shift);
+                    r = low & (conv->den - 1);
+                } else {
+                    q = divideWide(high, low, conv->den, &r);
+                }
+                break;
+            }
+        }
+        quotient[i] = q;
+        if (remainder != NULL) {
+            remainder[i] = r;
+        }
+    }
+    return overflows;
+}
+
+// The shifts of power of two conversions, such as bytes to kibibytes or
+// exbibytes to bits, are whole vectors of counts at a time. The rest are
+// multiplies no SIMD unit has at 64 bits, left to the scalar loop.
+static bool shiftsCounts(const IntegerConversion *conv) {
+    return conv->kind == INTEGER_SHIFT || (conv->kind == INTEGER_MULTIPLY && conv->shift >= 0);
+}
+
+#ifdef HAVE_X86_KERNELS
+__attribute__((target("avx2")))
+static size_t convertIntegerAvx2(const IntegerConversion *conv, const uint64_t *in, uint64_t *quotient,
+                                 uint64_t *remainder, size_t n) {
+    if (!shiftsCounts(conv)) {
+        return convertIntegerScalar(conv, in, quotient, remainder, n);
+    }
+    const __m128i count = _mm_cvtsi32_si128(conv->shift);
+    size_t overflows = 0;
+    size_t i = 0;
+    if (conv->kind == INTEGER_SHIFT) {
+        __m256i mask = _mm256_set1_epi64x((int64_t)(conv->den - 1));
+        for (; i + 4 <= n; i += 4) {
+            __m256i x = _mm256_loadu_si256((const __m256i *)(in + i));
+            if (remainder != NULL) {
+                _mm256_storeu_si256((__m256i *)(remainder + i), _mm256_and_si256(x, mask));
+            }
+            _mm256_storeu_si256((__m256i *)(quotient + i), _mm256_srl_epi64(x, count));
+        }
+    } else {
+        // AVX2 compares signed only, so both sides get their sign flipped.
+        // The lanes above the limit are all ones, UINT64_MAX once or'ed in.
+        const __m256i sign = _mm256_set1_epi64x(INT64_MIN);
+        __m256i limit = _mm256_set1_epi64x((int64_t)(conv->limit ^ (uint64_t)INT64_MIN));
+        for (; i + 4 <= n; i += 4) {
+            __m256i x = _mm256_loadu_si256((const __m256i *)(in + i));
+            __m256i over = _mm256_cmpgt_epi64(_mm256_xor_si256(x, sign), limit);
+            overflows += __builtin_popcount(_mm256_movemask_pd(_mm256_castsi256_pd(over)));
+            if (remainder != NULL) {
+                _mm256_storeu_si256((__m256i *)(remainder + i), _mm256_setzero_si256());
+            }
+            _mm256_storeu_si256((__m256i *)(quotient + i), _mm256_or_si256(_mm256_sll_epi64(x, count), over));
+        }
+    }
+    return overflows + convertIntegerScalar(conv, in + i, quotient + i, remainder ? remainder + i : NULL, n - i);
+}
+
+__attribute__((target("avx512f")))
+static size_t convertIntegerAvx512(const IntegerConversion *conv, const uint64_t *in, uint64_t *quotient,
+                                   uint64_t *remainder, size_t n) {
+    if (!shiftsCounts(conv)) {
+        return convertIntegerScalar(conv, in, quotient, remainder, n);
+    }
+    const __m128i count = _mm_cvtsi32_si128(conv->shift);
+    __m512i mask = _mm512_set1_epi64((int64_t)(conv->den - 1));
+    __m512i limit = _mm512_set1_epi64((int64_t)conv->limit);
+    bool right = (conv->kind == INTEGER_SHIFT);
+    size_t overflows = 0;
+    for (size_t i = 0; i < n; i += 8) {
+        __mmask8 lanes = (n - i >= 8) ? 0xff : (__mmask8)((1u << (n - i)) - 1);
+        __m512i x = _mm512_maskz_loadu_epi64(lanes, in + i);
+        __m512i q, r;
+        if (right) {
+            q = _mm512_srl_epi64(x, count);
+            r = _mm512_and_si512(x, mask);
+        } else {
+            __mmask8 over = _mm512_mask_cmpgt_epu64_mask(lanes, x, limit);
+            overflows += __builtin_popcount(over);
+            q = _mm512_mask_mov_epi64(_mm512_sll_epi64(x, count), over, _mm512_set1_epi64(-1));
+            r = _mm512_setzero_si512();
+        }
+        if (remainder != NULL) {
+            _mm512_mask_storeu_epi64(remainder + i, lanes, r);
+        }
+        _mm512_mask_storeu_epi64(quotient + i, lanes, q);
+    }
+    return overflows;
+}
+#endif
+
+#ifdef HAVE_NEON_KERNELS
+static size_t convertIntegerNeon(const IntegerConversion *conv, const uint64_t *in, uint64_t *quotient,
+                                 uint64_t *remainder, size_t n) {
+    if (!shiftsCounts(conv)) {
+        return convertIntegerScalar(conv, in, quotient, remainder, n);
+    }
+    // vshlq shifts right by negative counts
+    bool right = (conv->kind == INTEGER_SHIFT);
+    int64x2_t count = vdupq_n_s64(right ? -conv->shift : conv->shift);
+    uint64x2_t mask = vdupq_n_u64(conv->den - 1);
+    uint64x2_t limit = vdupq_n_u64(conv->limit);
+    size_t overflows = 0;
+    size_t i = 0;
+    for (; i + 2 <= n; i += 2) {
+        uint64x2_t x = vld1q_u64(in + i);
+        uint64x2_t q = vshlq_u64(x, count), r = vandq_u64(x, mask);
+        if (!right) {
+            uint64x2_t over = vcgtq_u64(x, limit);
+            overflows += (vgetq_lane_u64(over, 0) & 1) + (vgetq_lane_u64(over, 1) & 1);
+            q = vorrq_u64(q, over);
+            r = vdupq_n_u64(0);
+        }
+        if (remainder != NULL) {
+            vst1q_u64(remainder + i, r);
+        }
+        vst1q_u64(quotient + i, q);
+    }
+    return overflows + convertIntegerScalar(conv, in + i, quotient + i, remainder ? remainder + i : NULL, n - i);
+}
+#endif
+
+// Function to pick the widest integer kernel the running CPU supports
+static IntegerKernel selectIntegerKernel(void) {
+#ifdef HAVE_X86_KERNELS
+    if (__builtin_cpu_supports("avx512f")) {
+        return convertIntegerAvx512;
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        return convertIntegerAvx2;
+    }
+#elif defined(HAVE_NEON_KERNELS)
+    return convertIntegerNeon;
+#endif
+    return convertIntegerScalar;
+}
+
+// Function to convert a count exactly, into the quotient and the remainder
+// in 1 / den of the target unit
+int unicon_apply_integer(const IntegerConversion *conv, uint64_t value, uint64_t *quotient, uint64_t *remainder) {
+    uint64_t rest;
+    size_t overflows = convertIntegerScalar(conv, &value, quotient, &rest, 1);
+    if (remainder != NULL) {
+        *remainder = rest;
+    }
+    return overflows ? UNICON_ERANGE : UNICON_OK;
+}
+
+// Function to convert an array of counts exactly with the widest kernel
+// the CPU supports
+size_t unicon_apply_integer_array(const IntegerConversion *conv, const uint64_t *in, uint64_t *quotient,
+                                  uint64_t *remainder, size_t n) {
+    return selectIntegerKernel()(conv, in, quotient, remainder, n);
+}
+
+// The "C" locale for strtod_l(), whatever locale the embedding program uses
+static locale_t c_locale;
+static pthread_once_t c_locale_once = PTHREAD_ONCE_INIT;
+
+static void createCLocale(void) {
+    c_locale = newlocale(LC_NUMERIC_MASK, "C", (locale_t)0);
+}
+
+// Function to validate and parse a number in [str, end) in a single pass.
+// Accepts an optional sign, digits with an optional decimal point and an
+// optional exponent. Returns the end of the number, or NULL when there are
+// no digits. The decimal point is always '.', whatever the locale.
+const char *unicon_parse_number(const char *str, const char *end, double *value) {
+    const char *p = str;
+    bool negative = false;
+    if (p < end && (*p == '-' || *p == '+')) {
+        negative = (*p == '-');
+        p++;
+    }
+
+    // Keep the first 19 significant digits, as many as a uint64_t holds
+    uint64_t mantissa = 0;
+    int digits = 0;
+    int exponent = 0;
+    bool seen_digit = false;
+    bool seen_dot = false;
+    bool truncated = false;
+    for (; p < end; p++) {
+        unsigned d = (unsigned char)*p - '0';
+        if (d < 10) {
+            seen_digit = true;
+            if (digits < 19) {
+                mantissa = mantissa * 10 + d;
+                digits += (mantissa != 0);
+                exponent -= seen_dot;
+            } else {
+                truncated |= (d != 0);
+                exponent += !seen_dot;
+            }
+        } else if (*p == '.' && !seen_dot) {
+            seen_dot = true;
+        } else {
+            break;
+        }
+    }
+    if (!seen_digit) {
+        return NULL;
+    }
+
+    // The exponent needs at least one digit, large ones saturate
+    if (p < end && (*p == 'e' || *p == 'E')) {
+        const char *q = p + 1;
+        bool exp_negative = false;
+        if (q < end && (*q == '-' || *q == '+')) {
+            exp_negative = (*q == '-');
+            q++;
+        }
+        if (q < end && (unsigned)(*q - '0') < 10) {
+            int e = 0;
+            for (; q < end && (unsigned)(*q - '0') < 10; q++) {
+                if (e < 100000) {
+                    e = e * 10 + (*q - '0');
+                }
+            }
+            exponent += exp_negative ? -e : e;
+            p = q;
+        }
+    }
+
+    // With both operands exact a single multiply or divide rounds
+    // correctly, anything else is left to strtod()
+    if (mantissa == 0 || (!truncated && mantissa <= (1ULL << 53) && exponent >= -22 && exponent <= 22)) {
+        double result = (double)mantissa;
+        result = exponent < 0 ? result / exact_pow10[-exponent % 23] : result * exact_pow10[exponent % 23];
+        *value = negative ? -result : result;
+        return p;
+    }
+
+    char local[128];
+    size_t len = p - str;
+    char *copy = len < sizeof(local) ? local : malloc(len + 1);
+    if (copy == NULL) {
+        return NULL;
+    }
+    memcpy(copy, str, len);
+    copy[len] = '\0';
+    pthread_once(&c_locale_once, createCLocale);
+    *value = c_locale ? strtod_l(copy, NULL, c_locale) : strtod(copy, NULL);
+    if (copy != local) {
+        free(copy);
+    }
+    return p;
+}
+
+// Cached powers of ten 10^-348, 10^-340, ..., 10^340 as normalized 64-bit
+// significands and binary exponents, for Grisu2
+static const struct { uint64_t f; int e; } cached_pow10[] = {
+    {0xfa8fd5a0081c0288ULL, -1220}, {0xbaaee17fa23ebf76ULL, -1193}, {0x8b16fb203055ac76ULL, -1166},
+    {0xcf42894a5dce35eaULL, -1140}, {0x9a6bb0aa55653b2dULL, -1113}, {0xe61acf033d1a45dfULL, -1087},
+    {0xab70fe17c79ac6caULL, -1060}, {0xff77b1fcbebcdc4fULL, -1034}, {0xbe5691ef416bd60cULL, -1007},
+    {0x8dd01fad907ffc3cULL, -980}, {0xd3515c2831559a83ULL, -954}, {0x9d71ac8fada6c9b5ULL, -927},
+    {0xea9c227723ee8bcbULL, -901}, {0xaecc49914078536dULL, -874}, {0x823c12795db6ce57ULL, -847},
+    {0xc21094364dfb5637ULL, -821}, {0x9096ea6f3848984fULL, -794}, {0xd77485cb25823ac7ULL, -768},
+    {0xa086cfcd97bf97f4ULL, -741}, {0xef340a98172aace5ULL, -715}, {0xb23867fb2a35b28eULL, -688},
+    {0x84c8d4dfd2c63f3bULL, -661}, {0xc5dd44271ad3cdbaULL, -635}, {0x936b9fcebb25c996ULL, -608},
+    {0xdbac6c247d62a584ULL, -582}, {0xa3ab66580d5fdaf6ULL, -555}, {0xf3e2f893dec3f126ULL, -529},
+    {0xb5b5ada8aaff80b8ULL, -502}, {0x87625f056c7c4a8bULL, -475}, {0xc9bcff6034c13053ULL, -449},
+    {0x964e858c91ba2655ULL, -422}, {0xdff9772470297ebdULL, -396}, {0xa6dfbd9fb8e5b88fULL, -369},
+    {0xf8a95fcf88747d94ULL, -343}, {0xb94470938fa89bcfULL, -316}, {0x8a08f0f8bf0f156bULL, -289},
+    {0xcdb02555653131b6ULL, -263}, {0x993fe2c6d07b7facULL, -236}, {0xe45c10c42a2b3b06ULL, -210},
+    {0xaa242499697392d3ULL, -183}, {0xfd87b5f28300ca0eULL, -157}, {0xbce5086492111aebULL, -130},
+    {0x8cbccc096f5088ccULL, -103}, {0xd1b71758e219652cULL, -77}, {0x9c40000000000000ULL, -50},
+    {0xe8d4a51000000000ULL, -24}, {0xad78ebc5ac620000ULL, 3}, {0x813f3978f8940984ULL, 30},
+    {0xc097ce7bc90715b3ULL, 56}, {0x8f7e32ce7bea5c70ULL, 83}, {0xd5d238a4abe98068ULL, 109},
+    {0x9f4f2726179a2245ULL, 136}, {0xed63a231d4c4fb27ULL, 162}, {0xb0de65388cc8ada8ULL, 189},
+    {0x83c7088e1aab65dbULL, 216}, {0xc45d1df942711d9aULL, 242}, {0x924d692ca61be758ULL, 269},
+    {0xda01ee641a708deaULL, 295}, {0xa26da3999aef774aULL, 322}, {0xf209787bb47d6b85ULL, 348},
+    {0xb454e4a179dd1877ULL, 375}, {0x865b86925b9bc5c2ULL, 402}, {0xc83553c5c8965d3dULL, 428},
+    {0x952ab45cfa97a0b3ULL, 455}, {0xde469fbd99a05fe3ULL, 481}, {0xa59bc234db398c25ULL, 508},
+    {0xf6c69a72a3989f5cULL, 534}, {0xb7dcbf5354e9beceULL, 561}, {0x88fcf317f22241e2ULL, 588},
+    {0xcc20ce9bd35c78a5ULL, 614}, {0x98165af37b2153dfULL, 641}, {0xe2a0b5dc971f303aULL, 667},
+    {0xa8d9d1535ce3b396ULL, 694}, {0xfb9b7cd9a4a7443cULL, 720}, {0xbb764c4ca7a44410ULL, 747},
+    {0x8bab8eefb6409c1aULL, 774}, {0xd01fef10a657842cULL, 800}, {0x9b10a4e5e9913129ULL, 827},
+    {0xe7109bfba19c0c9dULL, 853}, {0xac2820d9623bf429ULL, 880}, {0x80444b5e7aa7cf85ULL, 907},
+    {0xbf21e44003acdd2dULL, 933}, {0x8e679c2f5e44ff8fULL, 960}, {0xd433179d9c8cb841ULL, 986},
+    {0x9e19db92b4e31ba9ULL, 1013}, {0xeb96bf6ebadf77d9ULL, 1039}, {0xaf87023b9bf0ee6bULL, 1066}
+};
+
+static const uint64_t pow10_u64[] = {
+    1ULL, 10ULL, 100ULL, 1000ULL, 10000ULL, 100000ULL, 1000000ULL, 10000000ULL,
+    100000000ULL, 1000000000ULL, 10000000000ULL, 100000000000ULL, 1000000000000ULL,
+    10000000000000ULL, 100000000000000ULL, 1000000000000000ULL, 10000000000000000ULL,
+    100000000000000000ULL, 1000000000000000000ULL, 10000000000000000000ULL
+};
+
+#ifdef __SIZEOF_INT128__
+// Struct for a floating point value m * 2^e with a 64-bit significand
+typedef struct _DiyFp {
+    uint64_t f;
+    int e;
+} DiyFp;
+
+static DiyFp diyFpMultiply(DiyFp a, DiyFp b) {
+    unsigned __int128 p = (unsigned __int128)a.f * b.f;
+    DiyFp r = {(uint64_t)(p >> 64) + ((uint64_t)p >> 63), a.e + b.e + 64};
+    return r;
+}
+
+static DiyFp diyFpNormalize(DiyFp a) {
+    int s = __builtin_clzll(a.f);
+    DiyFp r = {a.f << s, a.e - s};
+    return r;
+}
+
+// Function to round the last digit towards the value being printed
+static void grisuRound(char *buffer, int len, uint64_t delta, uint64_t rest, uint64_t ten_kappa, uint64_t wp_w) {
+    while (rest < wp_w && delta - rest >= ten_kappa &&
+           (rest + ten_kappa < wp_w || wp_w - rest > rest + ten_kappa - wp_w)) {
+        buffer[len - 1]--;
+        rest += ten_kappa;
+    }
+}
+
+// Function to generate the shortest digits of a positive finite value,
+// which is then buffer[0..len) * 10^k
+static int grisu2(double value, char *buffer, int *k) {
+    uint64_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    int biased = (int)(bits >> 52) & 0x7ff;
+    uint64_t significand = bits & ((1ULL << 52) - 1);
+    DiyFp v = biased ? (DiyFp){significand | (1ULL << 52), biased - 1075} : (DiyFp){significand, -1074};
+
+    // The boundaries halfway to the neighbouring doubles
+    DiyFp plus = diyFpNormalize((DiyFp){(v.f << 1) + 1, v.e - 1});
+    DiyFp minus = (v.f == (1ULL << 52)) ? (DiyFp){(v.f << 2) - 1, v.e - 2} : (DiyFp){(v.f << 1) - 1, v.e - 1};
+    minus.f <<= minus.e - plus.e;
+    minus.e = plus.e;
+
+    // Scale by a cached power of ten so the digits come out of the integer part
+    double dk = (-61 - plus.e) * 0.30102999566398114 + 347;
+    int ik = (int)dk;
+    if (dk - ik > 0.0) {
+        ik++;
+    }
+    unsigned index = (unsigned)(ik >> 3) + 1;
+    *k = -(-348 + (int)index * 8);
+    DiyFp c = {cached_pow10[index].f, cached_pow10[index].e};
+    DiyFp w = diyFpMultiply(diyFpNormalize(v), c);
+    DiyFp wp = diyFpMultiply(plus, c);
+    DiyFp wm = diyFpMultiply(minus, c);
+    wm.f++;
+    wp.f--;
+
+    uint64_t delta = wp.f - wm.f;
+    uint64_t wp_w = wp.f - w.f;
+    int shift = -wp.e;
+    uint64_t one = 1ULL << shift;
+    uint32_t p1 = (uint32_t)(wp.f >> shift);
+    uint64_t p2 = wp.f & (one - 1);
+    int kappa = 1;
+    while (kappa < 10 && p1 >= pow10_u64[kappa]) {
+        kappa++;
+    }
+    int len = 0;
+    while (kappa > 0) {
+        uint32_t d = p1 / (uint32_t)pow10_u64[kappa - 1];
+        p1 %= (uint32_t)pow10_u64[kappa - 1];
+        if (d || len) {
+            buffer[len++] = (char)('0' + d);
+        }
+        kappa--;
+        uint64_t rest = ((uint64_t)p1 << shift) + p2;
+        if (rest <= delta) {
+            *k += kappa;
+            grisuRound(buffer, len, delta, rest, pow10_u64[kappa] << shift, wp_w);
+            return len;
+        }
+    }
+    for (;;) {
+        p2 *= 10;
+        delta *= 10;
+        char d = (char)(p2 >> shift);
+        if (d || len) {
+            buffer[len++] = (char)('0' + d);
+        }
+        p2 &= one - 1;
+        kappa--;
+        if (p2 < delta) {
+            *k += kappa;
+            grisuRound(buffer, len, delta, p2, one, wp_w * (-kappa < 20 ? pow10_u64[-kappa] : 0));
+            return len;
+        }
+    }
+}
+
+#endif
+
+// Function to write v backwards ending at end, at least min_digits long
+static char *writeDigitsBackwards(char *end, uint64_t v, int min_digits) {
+    char *p = end;
+    while (v > 0 || min_digits > 0) {
+        *--p = (char)('0' + v % 10);
+        v /= 10;
+        min_digits--;
+    }
+    return p;
+}
+
+// Function to format a value with places decimals into a caller owned
+// buffer, exactly as printf("%.*f") does. Returns the length like
+// snprintf(). Values printf() needs more digits for than fit in 128 bits
+// are handed to snprintf().
+size_t unicon_format_fixed(char *buf, size_t size, double value, int places) {
+    uint64_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    int biased = (int)(bits >> 52) & 0x7ff;
+    uint64_t m = bits & ((1ULL << 52) - 1);
+    int e = biased ? biased - 1075 : -1074;
+    m |= biased ? (1ULL << 52) : 0;
+
+#ifndef __SIZEOF_INT128__
+    return (size_t)snprintf(buf, size, "%.*f", places, value);
+#else
+    if (biased == 0x7ff || places < 0 || places > 19 || e > 74 || size < FORMAT_FIXED_FAST) {
+        return (size_t)snprintf(buf, size, "%.*f", places, value);
+    }
+
+    // Scale by 10^places exactly and round the binary point away, ties to even
+    unsigned __int128 q;
+    if (e >= 0) {
+        q = (unsigned __int128)m << e;
+    } else {
+        unsigned __int128 n = (unsigned __int128)m * pow10_u64[places];
+        if (-e >= 128) {
+            q = 0;
+        } else {
+            q = n >> -e;
+            unsigned __int128 rest = n - (q << -e);
+            unsigned __int128 half = (unsigned __int128)1 << (-e - 1);
+            q += (rest > half || (rest == half && (q & 1)));
+        }
+    }
+
+    // Integer values are printed whole, then padded with zero decimals
+    char digits[48];
+    char *end = digits + sizeof(digits);
+    char *p = end;
+    int frac = (e >= 0) ? 0 : places;
+    do {
+        uint64_t chunk = (uint64_t)(q % 10000000000000000000ULL);
+        q /= 10000000000000000000ULL;
+        p = writeDigitsBackwards(p, chunk, q > 0 ? 19 : 0);
+    } while (q > 0);
+    while (end - p < frac + 1) {
+        *--p = '0';
+    }
+
+    char *out = buf;
+    if (bits >> 63) {
+        *out++ = '-';
+    }
+    size_t whole = (end - p) - frac;
+    memcpy(out, p, whole);
+    out += whole;
+    if (places > 0) {
+        *out++ = '.';
+        if (frac > 0) {
+            memcpy(out, end - frac, frac);
+        } else {
+            memset(out, '0', places);
+        }
+        out += places;
+    }
+    *out = '\0';
+    return out - buf;
+#endif
+}
+
+// Function to format the shortest decimal that reads back as the same
+// value, in plain notation for moderate magnitudes and scientific
+// notation otherwise. Returns the length like snprintf().
+size_t unicon_format_shortest(char *buf, size_t size, double value) {
+#ifndef __SIZEOF_INT128__
+    return (size_t)snprintf(buf, size, "%.17g", value);
+#else
+    if (!isfinite(value) || size < FORMAT_SHORTEST_MAX) {
+        return (size_t)snprintf(buf, size, "%.17g", value);
+    }
+
+    char *out = buf;
+    if (signbit(value)) {
+        *out++ = '-';
+        value = -value;
+    }
+    if (value == 0) {
+        *out++ = '0';
+        *out = '\0';
+        return out - buf;
+    }
+
+    char digits[20];
+    int k;
+    int len = grisu2(value, digits, &k);
+    int point = len + k;
+
+    if (k >= 0 && point <= 21) {
+        // An integer: 1234 or 1234000
+        memcpy(out, digits, len);
+        memset(out + len, '0', k);
+        out += point;
+    } else if (point > 0 && point <= 21) {
+        // 12.34
+        memcpy(out, digits, point);
+        out[point] = '.';
+        memcpy(out + point + 1, digits + point, len - point);
+        out += len + 1;
+    } else if (point > -6 && point <= 0) {
+        // 0.001234
+        *out++ = '0';
+        *out++ = '.';
+        memset(out, '0', -point);
+        memcpy(out - point, digits, len);
+        out += len - point;
+    } else {
+        // 1.234e+30
+        *out++ = digits[0];
+        if (len > 1) {
+            *out++ = '.';
+            memcpy(out, digits + 1, len - 1);
+            out += len - 1;
+        }
+        int exponent = point - 1;
+        *out++ = 'e';
+        *out++ = exponent < 0 ? '-' : '+';
+        exponent = exponent < 0 ? -exponent : exponent;
+        char *end = out + (exponent >= 100 ? 3 : 2);
+        writeDigitsBackwards(end, exponent, 2);
+        out = end;
+    }
+    *out = '\0';
+    return out - buf;
+#endif
+}
+
+// Function to hash a unit name, folding ASCII letters to lower case
+static uint64_t hashUnitName(const char *name) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (; *name; name++) {
+        unsigned char c = (unsigned char)*name;
+        if (c >= 'A' && c <= 'Z') {
+            c += 'a' - 'A';
+        }
+        h = (h ^ c) * 0x100000001b3ULL;
+    }
+    // Finalize so every bit of the name reaches the bucket and slot bits
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    return h;
+}
+
+// Function to pick the slot of a name hash for the displacement d, which
+// reseeds the whole hash so two names never collide for every d
+static inline uint32_t unitIndexSlot(const UnitIndex *index, uint64_t h, uint32_t d) {
+    h = (h ^ (d * 0x9e3779b97f4a7c15ULL)) * 0xff51afd7ed558ccdULL;
+    return (uint32_t)(h >> 32) & index->slot_mask;
+}
+
+// Function to place every key of one bucket with displacement d, or none
+static bool placeUnitBucket(UnitIndex *index, const uint64_t *hashes, const uint32_t *keys, size_t size, uint32_t d) {
+    for (size_t i = 0; i < size; i++) {
+        uint32_t slot = unitIndexSlot(index, hashes[keys[i]], d);
+        if (index->slots[slot] != -1) {
+            // Undo the keys of this bucket placed so far
+            while (i-- > 0) {
+                index->slots[unitIndexSlot(index, hashes[keys[i]], d)] = -1;
+            }
+            return false;
+        }
+        index->slots[slot] = (int32_t)keys[i];
+    }
+    return true;
+}
+
+// Function to build a perfect hash over keys in caller provided storage.
+// buckets and nslots must be powers of two and nslots at least count.
+// Only building allocates, for scratch space released before returning.
+bool buildUnitIndex(UnitIndex *index, const char *const *keys, size_t count, uint32_t *displacement, size_t buckets, int32_t *slots, size_t nslots) {
+    index->keys = keys;
+    index->count = count;
+    index->bucket_mask = (uint32_t)buckets - 1;
+    index->slot_mask = (uint32_t)nslots - 1;
+    index->displacement = displacement;
+    index->slots = slots;
+    if (count > nslots) {
+        return false;
+    }
+
+    uint64_t *hashes = malloc(count * sizeof(*hashes) + 1);
+    uint32_t *order = malloc(count * sizeof(*order) + 1);
+    uint32_t *start = calloc(buckets + 1, sizeof(*start));
+    bool built = hashes != NULL && order != NULL && start != NULL;
+
+    // Sort the keys by bucket
+    for (size_t k = 0; built && k < count; k++) {
+        hashes[k] = hashUnitName(keys[k]);
+        start[(hashes[k] & index->bucket_mask) + 1]++;
+    }
+    size_t largest = 0;
+    for (size_t b = 0; built && b < buckets; b++) {
+        if (start[b + 1] > largest) {
+            largest = start[b + 1];
+        }
+        start[b + 1] += start[b];
+        displacement[b] = start[b];
+    }
+    for (size_t k = 0; built && k < count; k++) {
+        order[displacement[hashes[k] & index->bucket_mask]++] = (uint32_t)k;
+    }
+
+    // Place the largest buckets first, while most slots are still free
+    for (size_t i = 0; i < nslots; i++) {
+        slots[i] = -1;
+    }
+    memset(displacement, 0, buckets * sizeof(*displacement));
+    for (size_t size = largest; built && size > 0; size--) {
+        for (size_t b = 0; built && b < buckets; b++) {
+            if (start[b + 1] - start[b] != size) {
+                continue;
+            }
+            uint32_t d = 0;
+            while (!placeUnitBucket(index, hashes, order + start[b], size, d)) {
+                if (++d > nslots * 16) {
+                    built = false;
+                    break;
+                }
+            }
+            displacement[b] = d;
+        }
+    }
+
+    free(start);
+    free(order);
+    free(hashes);
+    return built;
+}
+
+// Function to find the position of a key in the index, or -1
+int lookupUnitIndex(const UnitIndex *index, const char *name) {
+    uint64_t h = hashUnitName(name);
+    int32_t k = index->slots[unitIndexSlot(index, h, index->displacement[h & index->bucket_mask])];
+    if (k >= 0 && strcasecmp(index->keys[k], name) == 0) {
+        return k;
+    }
+    return -1;
+}
+
+// Struct for a node of a BK-tree over unit names. Each child of a node is
+// a given number of edits away from it, so a search for the names close to
+// another only descends into the children at about the right distance.
+typedef struct _SuggestNode {
+    int32_t child;
+    int32_t sibling;
+    uint32_t distance;
+} SuggestNode;
+
+// Function to count the single character edits turning one name into
+// another, ignoring case. Only the first UNICON_EXPRESSION_MAX characters
+// of each are compared, names are never longer.
+static unsigned editDistance(const char *a, const char *b) {
+    size_t la = strnlen(a, UNICON_EXPRESSION_MAX);
+    size_t lb = strnlen(b, UNICON_EXPRESSION_MAX);
+    unsigned row[UNICON_EXPRESSION_MAX + 1];
+    for (size_t j = 0; j <= lb; j++) {
+        row[j] = (unsigned)j;
+    }
+    for (size_t i = 1; i <= la; i++) {
+        unsigned diagonal = row[0];
+        row[0] = (unsigned)i;
+        unsigned char ca = (unsigned char)a[i - 1];
+        ca += (ca >= 'A' && ca <= 'Z') ? 'a' - 'A' : 0;
+        for (size_t j = 1; j <= lb; j++) {
+            unsigned char cb = (unsigned char)b[j - 1];
+            cb += (cb >= 'A' && cb <= 'Z') ? 'a' - 'A' : 0;
+            unsigned best = diagonal + (ca != cb);
+            best = row[j] + 1 < best ? row[j] + 1 : best;
+            best = row[j - 1] + 1 < best ? row[j - 1] + 1 : best;
+            diagonal = row[j];
+            row[j] = best;
+        }
+    }
+    return row[lb];
+}
+
+// Function to build the BK-tree of count keys, key 0 being the root
+static void buildSuggestTree(SuggestNode *nodes, const char *const *keys, size_t count) {
+    for (size_t k = 0; k < count; k++) {
+        nodes[k] = (SuggestNode){-1, -1, 0};
+    }
+    for (size_t k = 1; k < count; k++) {
+        int32_t node = 0;
+        for (;;) {
+            unsigned d = editDistance(keys[node], keys[k]);
+            if (d == 0) {
+                break;
+            }
+            int32_t child = nodes[node].child;
+            while (child >= 0 && nodes[child].distance != d) {
+                child = nodes[child].sibling;
+            }
+            if (child < 0) {
+                nodes[k] = (SuggestNode){-1, nodes[node].child, d};
+                nodes[node].child = (int32_t)k;
+                break;
+            }
+            node = child;
+        }
+    }
+}
+
+// Function to find the key closest to name below the subtree of node,
+// within *best edits, preferring the earliest key among equally close ones
+static void searchSuggestTree(const SuggestNode *nodes, const char *const *keys, int32_t node, const char *name,
+                              unsigned *best, int32_t *found) {
+    unsigned d = editDistance(keys[node], name);
+    if (d < *best || (d == *best && (*found < 0 || node < *found))) {
+        *best = d;
+        *found = node;
+    }
+    for (int32_t child = nodes[node].child; child >= 0; child = nodes[child].sibling) {
+        if (nodes[child].distance + *best >= d && nodes[child].distance <= d + *best) {
+            searchSuggestTree(nodes, keys, child, name, best, found);
+        }
+    }
+}
+
+// Struct for the size of a unit as the exact fraction num / den of the
+// base unit of its type, for conversions of whole counts
+typedef struct _UnitRatio {
+    uint64_t num;
+    uint64_t den;
+} UnitRatio;
+
+// Struct for a registry of units, laid out as separate arrays per field
+// so a lookup or a compile only touches the fields it needs. Keys are the
+// unit names, unit i being key i, followed by the aliases.
+struct _UniconRegistry {
+    size_t nunits;
+    size_t ntypes;
+    size_t nkeys;
+    const double *factors;
+    const double *offsets;
+    const uint32_t *types;
+    const uint32_t *key_units;
+    const char *const *type_names;
+    const char *const *keys;
+    // The exact sizes of the units, for registries that know them beyond
+    // the built-in units: scales like factors and fractions of the base unit
+    const long double *scales;
+    const UnitRatio *ratios;
+    UnitIndex index;
+    bool indexed;
+    // The BK-tree for suggestions, built by the first one asked for
+    SuggestNode *suggest;
+    bool suggest_built;
+    pthread_mutex_t suggest_lock;
+    // What a loaded registry owns: a mapped compiled file, or arrays and
+    // strings of its own for definitions parsed from text
+    void *map;
+    size_t map_len;
+    bool owns_arrays;
+};
+
+// Compiled registries start with this header, followed by the arrays
+// factors, offsets, types, type name offsets, key offsets, key units,
+// displacements and slots, then the strings, each array 8 byte aligned.
+// Names are stored as offsets into the strings.
+#define REGISTRY_MAGIC "UNICONR1"
+#define REGISTRY_BYTE_ORDER 0x01020304u
+
+typedef struct _RegistryHeader {
+    char magic[8];
+    uint32_t byte_order;
+    uint32_t nunits;
+    uint32_t ntypes;
+    uint32_t nkeys;
+    uint32_t nbuckets;
+    uint32_t nslots;
+    uint32_t strings_len;
+    uint32_t reserved;
+} RegistryHeader;
+
+// Struct for where each array of a compiled registry starts
+typedef struct _RegistryLayout {
+    size_t factors;
+    size_t offsets;
+    size_t types;
+    size_t type_names;
+    size_t keys;
+    size_t key_units;
+    size_t displacement;
+    size_t slots;
+    size_t strings;
+    size_t size;
+} RegistryLayout;
+
+// Function to round a size up to a multiple of 8
+static size_t align8(size_t n) {
+    return (n + 7) & ~(size_t)7;
+}
+
+// Function to lay out the arrays of a compiled registry
+static void registryLayout(const RegistryHeader *h, RegistryLayout *l) {
+    l->factors = align8(sizeof(*h));
+    l->offsets = l->factors + align8(h->nunits * sizeof(double));
+    l->types = l->offsets + align8(h->nunits * sizeof(double));
+    l->type_names = l->types + align8(h->nunits * sizeof(uint32_t));
+    l->keys = l->type_names + align8(h->ntypes * sizeof(uint32_t));
+    l->key_units = l->keys + align8(h->nkeys * sizeof(uint32_t));
+    l->displacement = l->key_units + align8(h->nkeys * sizeof(uint32_t));
+    l->slots = l->displacement + align8(h->nbuckets * sizeof(uint32_t));
+    l->strings = l->slots + align8(h->nslots * sizeof(int32_t));
+    l->size = l->strings + h->strings_len;
+}
+
+// Function to pick index sizes for count keys, powers of two with about
+// four keys per bucket and at most half the slots taken
+static void unitIndexSizes(size_t count, size_t *buckets, size_t *nslots) {
+    *buckets = 1;
+    *nslots = 2;
+    while (*buckets * 4 < count) {
+        *buckets <<= 1;
+    }
+    while (*nslots < count * 2) {
+        *nslots <<= 1;
+    }
+}
+
+// The built-in registry, straight from units.def. Only its index is
+// filled in, once per process, and never changes afterwards, so lookups
+// need no locking.
+static const double builtin_factors[] = {
+#define UNIT(id, type, name, num, den, offset_num, offset_den) UNIT_FACTOR(num, den),
+#include "units.def"
+};
+static const double builtin_offsets[] = {
+#define UNIT(id, type, name, num, den, offset_num, offset_den) UNIT_OFFSET(offset_num, offset_den),
+#include "units.def"
+};
+static const uint32_t builtin_types[] = {
+#define UNIT(id, type, name, num, den, offset_num, offset_den) type,
+#include "units.def"
+};
+static const uint32_t builtin_key_units[] = {
+#define UNIT(id, type, name, num, den, offset_num, offset_den) id,
+#define ALIAS(id, name) id,
+#include "units.def"
+};
+static const char *const builtin_type_names[] = {
+#define UNIT_TYPE(id, name) name,
+#include "units.def"
+};
+static const char *const builtin_keys[] = {
+#define UNIT(id, type, name, num, den, offset_num, offset_den) name,
+#define ALIAS(id, name) name,
+#include "units.def"
+};
+
+// The exact scales and offsets of the built-in units in long double, which
+// unit expressions combine instead of the rounded doubles
+static const long double builtin_scales[] = {
+#define UNIT(id, type, name, num, den, offset_num, offset_den) (long double)(den) / (long double)(num),
+#include "units.def"
+};
+static const long double builtin_offsets_exact[] = {
+#define UNIT(id, type, name, num, den, offset_num, offset_den) (long double)(offset_num) / (long double)(offset_den),
+#include "units.def"
+};
+
+static const UnitRatio builtin_ratios[] = {
+#define UNIT(id, type, name, num, den, offset_num, offset_den) {num, den},
+#include "units.def"
+};
+
+#define BUILTIN_KEYS (sizeof(builtin_keys) / sizeof(builtin_keys[0]))
+
+_Static_assert(BUILTIN_KEYS <= UNIT_INDEX_BUCKETS * 4 && BUILTIN_KEYS * 2 <= UNIT_INDEX_SLOTS,
+               "the index sizes in unicon_private.h are too small for the built-in units");
+
+static uint32_t builtin_displacement[UNIT_INDEX_BUCKETS];
+static int32_t builtin_slots[UNIT_INDEX_SLOTS];
+static SuggestNode builtin_suggest[BUILTIN_KEYS];
+
+static UniconRegistry builtin_registry = {
+    .nunits = NUNITS,
+    .ntypes = NUNIT_TYPES,
+    .nkeys = BUILTIN_KEYS,
+    .factors = builtin_factors,
+    .offsets = builtin_offsets,
+    .types = builtin_types,
+    .key_units = builtin_key_units,
+    .type_names = builtin_type_names,
+    .keys = builtin_keys,
+    .scales = builtin_scales,
+    .ratios = builtin_ratios,
+    .suggest = builtin_suggest,
+    .suggest_lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static pthread_once_t builtin_registry_once = PTHREAD_ONCE_INIT;
+
+// Function to index the built-in unit names, run once per process
+static void buildBuiltinRegistry(void) {
+    builtin_registry.indexed = buildUnitIndex(&builtin_registry.index, builtin_keys, BUILTIN_KEYS,
+                                              builtin_displacement, UNIT_INDEX_BUCKETS,
+                                              builtin_slots, UNIT_INDEX_SLOTS);
+}
+
+// Function to get the registry of the built-in units
+const UniconRegistry *unicon_registry_builtin(void) {
+    pthread_once(&builtin_registry_once, buildBuiltinRegistry);
+    return &builtin_registry;
+}
+
+// The SI family of the built-in registry: the same units and names, with
+// the byte multiples of units.def's DECIMAL entries in powers of 1000.
+// Its tables are the built-in ones with those entries put in, filled in
+// once per process, and it shares the index of the built-in registry.
+static const struct {
+    Unit unit;
+    UnitRatio ratio;
+} decimal_units[] = {
+#define DECIMAL(id, num, den) {id, {num, den}},
+#include "units.def"
+};
+
+static double si_factors[NUNITS];
+static long double si_scales[NUNITS];
+static UnitRatio si_ratios[NUNITS];
+static SuggestNode si_suggest[BUILTIN_KEYS];
+
+static UniconRegistry si_registry = {
+    .nunits = NUNITS,
+    .ntypes = NUNIT_TYPES,
+    .nkeys = BUILTIN_KEYS,
+    .factors = si_factors,
+    .offsets = builtin_offsets,
+    .types = builtin_types,
+    .key_units = builtin_key_units,
+    .type_names = builtin_type_names,
+    .keys = builtin_keys,
+    .scales = si_scales,
+    .ratios = si_ratios,
+    .suggest = si_suggest,
+    .suggest_lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static pthread_once_t si_registry_once = PTHREAD_ONCE_INIT;
+
+// Function to fill in the SI family's tables, run once per process
+static void buildSiRegistry(void) {
+    const UniconRegistry *builtin = unicon_registry_builtin();
+    memcpy(si_factors, builtin_factors, sizeof(si_factors));
+    memcpy(si_scales, builtin_scales, sizeof(si_scales));
+    memcpy(si_ratios, builtin_ratios, sizeof(si_ratios));
+    for (size_t i = 0; i < sizeof(decimal_units) / sizeof(decimal_units[0]); i++) {
+        UnitRatio ratio = decimal_units[i].ratio;
+        si_factors[decimal_units[i].unit] = UNIT_FACTOR(ratio.num, ratio.den);
+        si_scales[decimal_units[i].unit] = (long double)ratio.den / (long double)ratio.num;
+        si_ratios[decimal_units[i].unit] = ratio;
+    }
+    si_registry.index = builtin->index;
+    si_registry.indexed = builtin->indexed;
+}
+
+// Function to get the built-in units with kilobytes, megabytes and the
+// other byte multiples in powers of 1000
+const UniconRegistry *unicon_registry_builtin_si(void) {
+    pthread_once(&si_registry_once, buildSiRegistry);
+    return &si_registry;
+}
+
+// Function to release a registry from unicon_registry_load()
+void unicon_registry_free(UniconRegistry *registry) {
+    if (registry == NULL || registry == &builtin_registry || registry == &si_registry) {
+        return;
+    }
+    if (registry->owns_arrays) {
+        for (size_t i = 0; i < registry->ntypes; i++) {
+            free((char *)registry->type_names[i]);
+        }
+        for (size_t i = 0; i < registry->nkeys; i++) {
+            free((char *)registry->keys[i]);
+        }
+        free((double *)registry->factors);
+        free((double *)registry->offsets);
+        free((uint32_t *)registry->types);
+        free((uint32_t *)registry->key_units);
+        free(registry->index.displacement);
+        free(registry->index.slots);
+    }
+    free((char **)registry->type_names);
+    free((char **)registry->keys);
+    free(registry->suggest);
+    pthread_mutex_destroy(&registry->suggest_lock);
+    if (registry->map != NULL) {
+        munmap(registry->map, registry->map_len);
+    }
+    free(registry);
+}
+
+// Function to check that an offset points at a string in the strings of a
+// compiled registry
+static const char *registryString(const char *strings, size_t len, uint32_t offset) {
+    return (offset < len) ? strings + offset : NULL;
+}
+
+// Function to use a mapped compiled registry in place. The arrays are
+// checked, but nothing is parsed or hashed, so this costs a few pointer
+// fixups per unit.
+static int openCompiledRegistry(UniconRegistry *registry, void *data, size_t len) {
+    RegistryHeader h;
+    RegistryLayout l;
+    memcpy(&h, data, sizeof(h));
+    if (h.byte_order != REGISTRY_BYTE_ORDER || h.nbuckets == 0 || (h.nbuckets & (h.nbuckets - 1)) != 0 ||
+        h.nslots < h.nkeys || (h.nslots & (h.nslots - 1)) != 0 || h.nkeys < h.nunits || h.strings_len == 0) {
+        return UNICON_EDEFS;
+    }
+    registryLayout(&h, &l);
+    const char *base = data;
+    const char *strings = base + l.strings;
+    if (l.size > len || strings[h.strings_len - 1] != '\0') {
+        return UNICON_EDEFS;
+    }
+
+    const uint32_t *types = (const uint32_t *)(base + l.types);
+    const uint32_t *type_offsets = (const uint32_t *)(base + l.type_names);
+    const uint32_t *key_offsets = (const uint32_t *)(base + l.keys);
+    const uint32_t *key_units = (const uint32_t *)(base + l.key_units);
+    const int32_t *slots = (const int32_t *)(base + l.slots);
+    for (size_t i = 0; i < h.nunits; i++) {
+        if (types[i] >= h.ntypes || key_units[i] != i) {
+            return UNICON_EDEFS;
+        }
+    }
+    for (size_t i = 0; i < h.nkeys; i++) {
+        if (key_units[i] >= h.nunits) {
+            return UNICON_EDEFS;
+        }
+    }
+    for (size_t i = 0; i < h.nslots; i++) {
+        if (slots[i] < -1 || slots[i] >= (int32_t)h.nkeys) {
+            return UNICON_EDEFS;
+        }
+    }
+
+    const char **type_names = malloc(h.ntypes * sizeof(*type_names) + 1);
+    const char **keys = malloc(h.nkeys * sizeof(*keys) + 1);
+    if (type_names == NULL || keys == NULL) {
+        free(type_names);
+        free(keys);
+        return UNICON_ENOMEM;
+    }
+    registry->type_names = type_names;
+    registry->keys = keys;
+    for (size_t i = 0; i < h.ntypes; i++) {
+        type_names[i] = registryString(strings, h.strings_len, type_offsets[i]);
+    }
+    for (size_t i = 0; i < h.nkeys; i++) {
+        keys[i] = registryString(strings, h.strings_len, key_offsets[i]);
+    }
+    for (size_t i = 0; i < h.ntypes; i++) {
+        if (type_names[i] == NULL) {
+            return UNICON_EDEFS;
+        }
+    }
+    for (size_t i = 0; i < h.nkeys; i++) {
+        if (keys[i] == NULL) {
+            return UNICON_EDEFS;
+        }
+    }
+
+    registry->nunits = h.nunits;
+    registry->ntypes = h.ntypes;
+    registry->nkeys = h.nkeys;
+    registry->factors = (const double *)(base + l.factors);
+    registry->offsets = (const double *)(base + l.offsets);
+    registry->types = types;
+    registry->key_units = key_units;
+    registry->index = (UnitIndex){keys, h.nkeys, h.nbuckets - 1, h.nslots - 1,
+                                  (uint32_t *)(base + l.displacement), (int32_t *)slots};
+    registry->indexed = true;
+    return UNICON_OK;
+}
+
+// Struct for the growing arrays of a registry parsed from definitions
+typedef struct _RegistryBuilder {
+    double *factors;
+    double *offsets;
+    uint32_t *types;
+    size_t nunits;
+    char **type_names;
+    size_t ntypes;
+    char **keys;
+    uint32_t *key_units;
+    unsigned long *key_lines;
+    size_t nkeys;
+    size_t capacity;
+    size_t types_capacity;
+} RegistryBuilder;
+
+// Function to find a unit key or type name in a list, ignoring case
+static int findName(char *const *names, size_t count, const char *name) {
+    for (size_t i = 0; i < count; i++) {
+        if (strcasecmp(names[i], name) == 0) {
+            return (int)i;
+        }
+    }
+    return -1;
+}
+
+// Function to add a type to a registry being built
+static bool addRegistryType(RegistryBuilder *b, const char *name) {
+    if (b->ntypes == b->types_capacity) {
+        size_t capacity = b->types_capacity ? b->types_capacity * 2 : 16;
+        char **names = realloc(b->type_names, capacity * sizeof(*names));
+        if (names == NULL) {
+            return false;
+        }
+        b->type_names = names;
+        b->types_capacity = capacity;
+    }
+    if ((b->type_names[b->ntypes] = strdup(name)) == NULL) {
+        return false;
+    }
+    b->ntypes++;
+    return true;
+}
+
+// Function to add a key to a registry being built. Keys of units go
+// before all aliases, so unit i stays key i.
+static bool addRegistryKey(RegistryBuilder *b, const char *name, uint32_t unit, bool is_unit, unsigned long line) {
+    if (b->nkeys == b->capacity) {
+        size_t capacity = b->capacity ? b->capacity * 2 : 64;
+        char **keys = realloc(b->keys, capacity * sizeof(*keys));
+        uint32_t *key_units = keys ? realloc(b->key_units, capacity * sizeof(*key_units)) : NULL;
+        unsigned long *key_lines = key_units ? realloc(b->key_lines, capacity * sizeof(*key_lines)) : NULL;
+        double *factors = key_lines ? realloc(b->factors, capacity * sizeof(*factors)) : NULL;
+        double *offsets = factors ? realloc(b->offsets, capacity * sizeof(*offsets)) : NULL;
+        uint32_t *types = offsets ? realloc(b->types, capacity * sizeof(*types)) : NULL;
+        b->keys = keys ? keys : b->keys;
+        b->key_units = key_units ? key_units : b->key_units;
+        b->key_lines = key_lines ? key_lines : b->key_lines;
+        b->factors = factors ? factors : b->factors;
+        b->offsets = offsets ? offsets : b->offsets;
+        b->types = types ? types : b->types;
+        if (types == NULL) {
+            return false;
+        }
+        b->capacity = capacity;
+    }
+    char *key = strdup(name);
+    if (key == NULL) {
+        return false;
+    }
+    size_t at = is_unit ? b->nunits : b->nkeys;
+    memmove(&b->keys[at + 1], &b->keys[at], (b->nkeys - at) * sizeof(*b->keys));
+    memmove(&b->key_units[at + 1], &b->key_units[at], (b->nkeys - at) * sizeof(*b->key_units));
+    memmove(&b->key_lines[at + 1], &b->key_lines[at], (b->nkeys - at) * sizeof(*b->key_lines));
+    b->keys[at] = key;
+    b->key_units[at] = unit;
+    b->key_lines[at] = line;
+    b->nkeys++;
+    return true;
+}
+
+// Function to add a unit to a registry being built
+static bool addRegistryUnit(RegistryBuilder *b, const char *name, uint32_t type, double factor, double offset, unsigned long line) {
+    if (!addRegistryKey(b, name, (uint32_t)b->nunits, true, line)) {
+        return false;
+    }
+    b->factors[b->nunits] = factor;
+    b->offsets[b->nunits] = offset;
+    b->types[b->nunits] = type;
+    b->nunits++;
+    return true;
+}
+
+// Function to release a registry builder and everything in it
+static void freeRegistryBuilder(RegistryBuilder *b) {
+    for (size_t i = 0; i < b->ntypes; i++) {
+        free(b->type_names[i]);
+    }
+    for (size_t i = 0; i < b->nkeys; i++) {
+        free(b->keys[i]);
+    }
+    free(b->type_names);
+    free(b->keys);
+    free(b->key_units);
+    free(b->key_lines);
+    free(b->factors);
+    free(b->offsets);
+    free(b->types);
+}
+
+// Function to parse a whole word of a definitions line as a number or as
+// a fraction N/D, which keeps factors like 1/0.3048 as exact as a double
+static bool parseDefinitionNumber(const char *word, double *value) {
+    const char *end = word + strlen(word);
+    const char *slash = memchr(word, '/', (size_t)(end - word));
+    if (slash != NULL) {
+        double den;
+        if (unicon_parse_number(word, slash, value) != slash ||
+            unicon_parse_number(slash + 1, end, &den) != end || den == 0) {
+            return false;
+        }
+        *value /= den;
+    } else if (unicon_parse_number(word, end, value) != end) {
+        return false;
+    }
+    return isfinite(*value);
+}
+
+// Function to add the definitions of a text file to a registry being
+// built. Each line is blank, a '#' comment or one of
+//   type NAME
+//   unit NAME TYPE FACTOR [OFFSET]
+//   alias NAME UNIT
+static int parseDefinitions(RegistryBuilder *b, FILE *file, unsigned long *error_line) {
+    char *line = NULL;
+    size_t capacity = 0;
+    unsigned long number = 0;
+    int status = UNICON_OK;
+    while (status == UNICON_OK && getline(&line, &capacity, file) >= 0) {
+        number++;
+        char *comment = strchr(line, '#');
+        if (comment != NULL) {
+            *comment = '\0';
+        }
+        char *words[6];
+        size_t count = 0;
+        for (char *save, *word = strtok_r(line, " \t\r\n", &save); word != NULL; word = strtok_r(NULL, " \t\r\n", &save)) {
+            if (count == 6) {
+                count = 7;
+                break;
+            }
+            words[count++] = word;
+        }
+        if (count == 0) {
+            continue;
+        }
+
+        status = UNICON_EDEFS;
+        double factor, offset = 0;
+        // Names longer than this could not be looked up from a record
+        if (count > 1 && strlen(words[1]) >= 64) {
+            break;
+        }
+        if (strcmp(words[0], "type") == 0 && count == 2) {
+            if (findName(b->type_names, b->ntypes, words[1]) < 0) {
+                status = addRegistryType(b, words[1]) ? UNICON_OK : UNICON_ENOMEM;
+            }
+        } else if (strcmp(words[0], "unit") == 0 && (count == 4 || count == 5)) {
+            int type = findName(b->type_names, b->ntypes, words[2]);
+            if (type >= 0 && parseDefinitionNumber(words[3], &factor) && factor != 0 &&
+                (count == 4 || parseDefinitionNumber(words[4], &offset))) {
+                status = addRegistryUnit(b, words[1], (uint32_t)type, factor, offset, number) ? UNICON_OK : UNICON_ENOMEM;
+            }
+        } else if (strcmp(words[0], "alias") == 0 && count == 3) {
+            int unit = findName(b->keys, b->nunits, words[2]);
+            int known = findName(b->keys, b->nkeys, words[1]);
+            if (unit >= 0 && known >= 0 && b->key_units[known] == (uint32_t)unit) {
+                // Files written before an alias was built in still load
+                status = UNICON_OK;
+            } else if (unit >= 0) {
+                status = addRegistryKey(b, words[1], (uint32_t)unit, false, number) ? UNICON_OK : UNICON_ENOMEM;
+            }
+        }
+    }
+    free(line);
+    if (status == UNICON_EDEFS && error_line != NULL) {
+        *error_line = number;
+    }
+    return status;
+}
+
+// Struct for a key and the definitions line it came from
+typedef struct _KeyLine {
+    const char *name;
+    unsigned long line;
+} KeyLine;
+
+// Function to order keys by name ignoring case, for finding duplicates
+static int compareKeyLines(const void *a, const void *b) {
+    return strcasecmp(((const KeyLine *)a)->name, ((const KeyLine *)b)->name);
+}
+
+// Function to turn the arrays of a builder into a registry, once no two
+// keys are the same. The registry takes the arrays over.
+static int finishRegistry(RegistryBuilder *b, UniconRegistry *registry, unsigned long *error_line) {
+    KeyLine *sorted = malloc(b->nkeys * sizeof(*sorted) + 1);
+    if (sorted == NULL) {
+        return UNICON_ENOMEM;
+    }
+    for (size_t i = 0; i < b->nkeys; i++) {
+        sorted[i] = (KeyLine){b->keys[i], b->key_lines[i]};
+    }
+    qsort(sorted, b->nkeys, sizeof(*sorted), compareKeyLines);
+    for (size_t i = 1; i < b->nkeys; i++) {
+        if (strcasecmp(sorted[i - 1].name, sorted[i].name) == 0) {
+            // Blame the later definition, the built-in units come first
+            if (error_line != NULL) {
+                *error_line = sorted[i - 1].line > sorted[i].line ? sorted[i - 1].line : sorted[i].line;
+            }
+            free(sorted);
+            return UNICON_EDEFS;
+        }
+    }
+    free(sorted);
+
+    size_t buckets, nslots;
+    unitIndexSizes(b->nkeys, &buckets, &nslots);
+    uint32_t *displacement = malloc(buckets * sizeof(*displacement));
+    int32_t *slots = malloc(nslots * sizeof(*slots));
+    if (displacement == NULL || slots == NULL ||
+        !buildUnitIndex(&registry->index, (const char *const *)b->keys, b->nkeys, displacement, buckets, slots, nslots)) {
+        free(displacement);
+        free(slots);
+        return UNICON_ENOMEM;
+    }
+
+    registry->nunits = b->nunits;
+    registry->ntypes = b->ntypes;
+    registry->nkeys = b->nkeys;
+    registry->factors = b->factors;
+    registry->offsets = b->offsets;
+    registry->types = b->types;
+    registry->key_units = b->key_units;
+    registry->type_names = (const char *const *)b->type_names;
+    registry->keys = (const char *const *)b->keys;
+    registry->indexed = true;
+    registry->owns_arrays = true;
+    free(b->key_lines);
+    *b = (RegistryBuilder){0};
+    return UNICON_OK;
+}
+
+// Function to load a registry from a compiled file or from definitions
+int unicon_registry_load(const char *path, UniconRegistry **registry, unsigned long *error_line) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return UNICON_EIO;
+    }
+    UniconRegistry *r = calloc(1, sizeof(*r));
+    if (r == NULL) {
+        close(fd);
+        return UNICON_ENOMEM;
+    }
+    pthread_mutex_init(&r->suggest_lock, NULL);
+
+    // A compiled registry is used straight from the page cache
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && (size_t)st.st_size >= sizeof(RegistryHeader)) {
+        void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map != MAP_FAILED && memcmp(map, REGISTRY_MAGIC, 8) == 0) {
+            close(fd);
+            r->map = map;
+            r->map_len = st.st_size;
+            int status = openCompiledRegistry(r, map, st.st_size);
+            if (status != UNICON_OK) {
+                unicon_registry_free(r);
+                return status;
+            }
+            *registry = r;
+            return UNICON_OK;
+        }
+        if (map != MAP_FAILED) {
+            munmap(map, st.st_size);
+        }
+    }
+
+    // Anything else holds definitions added to the built-in units
+    FILE *file = fdopen(fd, "r");
+    if (file == NULL) {
+        close(fd);
+        unicon_registry_free(r);
+        return UNICON_EIO;
+    }
+    RegistryBuilder b = {0};
+    int status = UNICON_OK;
+    for (size_t i = 0; status == UNICON_OK && i < NUNIT_TYPES; i++) {
+        status = addRegistryType(&b, builtin_type_names[i]) ? UNICON_OK : UNICON_ENOMEM;
+    }
+    for (size_t i = 0; status == UNICON_OK && i < BUILTIN_KEYS; i++) {
+        if (i < NUNITS) {
+            status = addRegistryUnit(&b, builtin_keys[i], builtin_types[i], builtin_factors[i], builtin_offsets[i], 0)
+                   ? UNICON_OK : UNICON_ENOMEM;
+        } else {
+            status = addRegistryKey(&b, builtin_keys[i], builtin_key_units[i], false, 0) ? UNICON_OK : UNICON_ENOMEM;
+        }
+    }
+    if (status == UNICON_OK) {
+        status = parseDefinitions(&b, file, error_line);
+    }
+    if (status == UNICON_OK && ferror(file)) {
+        status = UNICON_EIO;
+    }
+    fclose(file);
+    if (status == UNICON_OK) {
+        status = finishRegistry(&b, r, error_line);
+    }
+    freeRegistryBuilder(&b);
+    if (status != UNICON_OK) {
+        // Nothing is left in r on failure but the lock
+        unicon_registry_free(r);
+        return status;
+    }
+    *registry = r;
+    return UNICON_OK;
+}
+
+// Function to write a registry in the compiled form
+int unicon_registry_save(const UniconRegistry *registry, const char *path) {
+    if (!registry->indexed) {
+        return UNICON_ENOMEM;
+    }
+    RegistryHeader h = {REGISTRY_MAGIC, REGISTRY_BYTE_ORDER, (uint32_t)registry->nunits, (uint32_t)registry->ntypes,
+                        (uint32_t)registry->nkeys, registry->index.bucket_mask + 1, registry->index.slot_mask + 1, 0, 0};
+    size_t strings_len = 0;
+    for (size_t i = 0; i < registry->ntypes; i++) {
+        strings_len += strlen(registry->type_names[i]) + 1;
+    }
+    for (size_t i = 0; i < registry->nkeys; i++) {
+        strings_len += strlen(registry->keys[i]) + 1;
+    }
+    if (strings_len > UINT32_MAX) {
+        return UNICON_EDEFS;
+    }
+    h.strings_len = (uint32_t)strings_len;
+
+    RegistryLayout l;
+    registryLayout(&h, &l);
+    char *data = calloc(1, l.size);
+    if (data == NULL) {
+        return UNICON_ENOMEM;
+    }
+    memcpy(data, &h, sizeof(h));
+    memcpy(data + l.factors, registry->factors, h.nunits * sizeof(double));
+    memcpy(data + l.offsets, registry->offsets, h.nunits * sizeof(double));
+    memcpy(data + l.types, registry->types, h.nunits * sizeof(uint32_t));
+    memcpy(data + l.key_units, registry->key_units, h.nkeys * sizeof(uint32_t));
+    memcpy(data + l.displacement, registry->index.displacement, h.nbuckets * sizeof(uint32_t));
+    memcpy(data + l.slots, registry->index.slots, h.nslots * sizeof(int32_t));
+    uint32_t offset = 0;
+    for (size_t i = 0; i < h.ntypes + h.nkeys; i++) {
+        const char *name = (i < h.ntypes) ? registry->type_names[i] : registry->keys[i - h.ntypes];
+        uint32_t *slot = (i < h.ntypes) ? (uint32_t *)(data + l.type_names) + i : (uint32_t *)(data + l.keys) + (i - h.ntypes);
+        size_t len = strlen(name) + 1;
+        memcpy(data + l.strings + offset, name, len);
+        *slot = offset;
+        offset += (uint32_t)len;
+    }
+
+    // Write a temporary file and rename it, so readers never map half of one
+    size_t path_len = strlen(path);
+    char *temp = malloc(path_len + 8);
+    if (temp == NULL) {
+        free(data);
+        return UNICON_ENOMEM;
+    }
+    memcpy(temp, path, path_len);
+    memcpy(temp + path_len, ".XXXXXX", 8);
+    int fd = mkstemp(temp);
+    int status = (fd < 0 || fchmod(fd, 0644) != 0) ? UNICON_EIO : UNICON_OK;
+    for (size_t done = 0; status == UNICON_OK && done < l.size;) {
+        ssize_t n = write(fd, data + done, l.size - done);
+        if (n < 0 && errno != EINTR) {
+            status = UNICON_EIO;
+        }
+        done += (n > 0) ? (size_t)n : 0;
+    }
+    if (fd >= 0 && close(fd) != 0) {
+        status = UNICON_EIO;
+    }
+    if (status == UNICON_OK && rename(temp, path) != 0) {
+        status = UNICON_EIO;
+    }
+    if (status != UNICON_OK && fd >= 0) {
+        unlink(temp);
+    }
+    free(temp);
+    free(data);
+    return status;
+}
+
+// Functions to list and describe the units and types of a registry
+size_t unicon_registry_units(const UniconRegistry *registry) {
+    return registry->nunits;
+}
+
+size_t unicon_registry_types(const UniconRegistry *registry) {
+    return registry->ntypes;
+}
+
+const char *unicon_registry_unit_name(const UniconRegistry *registry, Unit unit) {
+    return ((size_t)unit < registry->nunits) ? registry->keys[unit] : NULL;
+}
+
+int unicon_registry_unit_type(const UniconRegistry *registry, Unit unit) {
+    return ((size_t)unit < registry->nunits) ? (int)registry->types[unit] : -1;
+}
+
+const char *unicon_registry_type_name(const UniconRegistry *registry, int type) {
+    return ((size_t)type < registry->ntypes) ? registry->type_names[type] : NULL;
+}
+
+size_t unicon_registry_keys(const UniconRegistry *registry) {
+    return registry->nkeys;
+}
+
+const char *unicon_registry_key_name(const UniconRegistry *registry, size_t key, Unit *unit) {
+    if (key >= registry->nkeys) {
+        return NULL;
+    }
+    if (unit != NULL) {
+        *unit = (Unit)registry->key_units[key];
+    }
+    return registry->keys[key];
+}
+
+// Function to find a unit of a registry by name or alias
+int unicon_registry_lookup(const UniconRegistry *registry, const char *name, Unit *unit) {
+    if (registry->indexed) {
+        int k = lookupUnitIndex(&registry->index, name);
+        if (k < 0) {
+            return UNICON_EUNIT;
+        }
+        *unit = (Unit)registry->key_units[k];
+        return UNICON_OK;
+    }
+
+    // Fall back to a linear scan should the index ever fail to build
+    for (size_t i = 0; i < registry->nkeys; i++) {
+        if (strcasecmp(name, registry->keys[i]) == 0) {
+            *unit = (Unit)registry->key_units[i];
+            return UNICON_OK;
+        }
+    }
+    return UNICON_EUNIT;
+}
+
+// Function to suggest the name closest to one the registry does not know.
+// Two letter names are never close enough to anything, the edits allowed
+// grow with the length.
+int unicon_registry_suggest(const UniconRegistry *registry, const char *name, const char **suggestion) {
+    size_t len = strnlen(name, UNICON_EXPRESSION_MAX);
+    if (len < 3 || len >= UNICON_EXPRESSION_MAX || registry->nkeys == 0) {
+        return UNICON_EUNIT;
+    }
+    // The tree is the one part of a registry that changes after loading,
+    // once and under its lock
+    UniconRegistry *r = (UniconRegistry *)registry;
+    pthread_mutex_lock(&r->suggest_lock);
+    if (!r->suggest_built) {
+        SuggestNode *nodes = r->suggest ? r->suggest : malloc(r->nkeys * sizeof(*nodes));
+        if (nodes != NULL) {
+            buildSuggestTree(nodes, r->keys, r->nkeys);
+            r->suggest = nodes;
+            r->suggest_built = true;
+        }
+    }
+    bool built = r->suggest_built;
+    pthread_mutex_unlock(&r->suggest_lock);
+    if (!built) {
+        return UNICON_ENOMEM;
+    }
+
+    unsigned best = len <= 5 ? 1 : 2;
+    int32_t found = -1;
+    searchSuggestTree(registry->suggest, registry->keys, 0, name, &best, &found);
+    if (found < 0) {
+        return UNICON_EUNIT;
+    }
+    *suggestion = registry->keys[found];
+    return UNICON_OK;
+}
+
+// Function to tell whether a unit of a registry is a built-in unit, whose
+// conversions to other built-in units were folded exactly by unitgen. A
+// compiled registry from another build may define it differently, so the
+// definition is compared too.
+static int isBuiltinUnit(const UniconRegistry *registry, Unit unit) {
+    return (unsigned)unit < NUNITS && registry->factors[unit] == builtin_factors[unit] &&
+           registry->offsets[unit] == builtin_offsets[unit] && registry->types[unit] == builtin_types[unit];
+}
+
+// Function to compile the conversion between two units of a registry
+int unicon_registry_compile(const UniconRegistry *registry, Unit from, Unit to, Conversion *conv) {
+    if ((size_t)from >= registry->nunits || (size_t)to >= registry->nunits) {
+        return UNICON_EUNIT;
+    }
+    if (registry->types[from] != registry->types[to]) {
+        return UNICON_ETYPE;
+    }
+    if (isBuiltinUnit(registry, from) && isBuiltinUnit(registry, to)) {
+        *conv = unicon_pairs[from * NUNITS + to];
+    } else if (registry->scales != NULL) {
+        compileAffine(registry->scales[from], registry->offsets[from], registry->scales[to], registry->offsets[to], conv);
+    } else {
+        compileAffine(registry->factors[from], registry->offsets[from], registry->factors[to], registry->offsets[to],
+                      conv);
+    }
+    return UNICON_OK;
+}
+
+// Function to compile the conversion between two units of a registry in
+// long double precision
+int unicon_registry_compile_exact(const UniconRegistry *registry, Unit from, Unit to, ExactConversion *conv) {
+    if ((size_t)from >= registry->nunits || (size_t)to >= registry->nunits) {
+        return UNICON_EUNIT;
+    }
+    if (registry->types[from] != registry->types[to]) {
+        return UNICON_ETYPE;
+    }
+    if (isBuiltinUnit(registry, from) && isBuiltinUnit(registry, to)) {
+        *conv = unicon_pairs_exact[from * NUNITS + to];
+    } else if (registry->scales != NULL) {
+        compileAffineExact(registry->scales[from], registry->offsets[from], registry->scales[to], registry->offsets[to],
+                           conv);
+    } else {
+        compileAffineExact(registry->factors[from], registry->offsets[from], registry->factors[to],
+                           registry->offsets[to], conv);
+    }
+    return UNICON_OK;
+}
+
+// Function to get the greatest common divisor of two counts
+static uint64_t gcd64(uint64_t a, uint64_t b) {
+    while (b != 0) {
+        uint64_t t = a % b;
+        a = b;
+        b = t;
+    }
+    return a;
+}
+
+// Function to get the exact size of a unit of a registry, if it is known
+static bool unitRatio(const UniconRegistry *registry, Unit unit, UnitRatio *ratio) {
+    if (registry->ratios != NULL) {
+        *ratio = registry->ratios[unit];
+    } else if (isBuiltinUnit(registry, unit)) {
+        *ratio = builtin_ratios[unit];
+    } else {
+        return false;
+    }
+    uint64_t g = gcd64(ratio->num, ratio->den);
+    ratio->num /= g;
+    ratio->den /= g;
+    return true;
+}
+
+// Function to compile the conversion of whole counts between two units of
+// a registry. x of from is x * from.num / from.den base units, so
+// x * from.num * to.den / (from.den * to.num) of to, which is reduced and
+// has to fit 64 bits on both sides. Units with offsets or sizes only known
+// as doubles have no exact form.
+int unicon_registry_compile_integer(const UniconRegistry *registry, Unit from, Unit to, IntegerConversion *conv) {
+    if ((size_t)from >= registry->nunits || (size_t)to >= registry->nunits) {
+        return UNICON_EUNIT;
+    }
+    if (registry->types[from] != registry->types[to]) {
+        return UNICON_ETYPE;
+    }
+    UnitRatio a, b;
+    if (registry->offsets[from] != 0 || registry->offsets[to] != 0 || !unitRatio(registry, from, &a) ||
+        !unitRatio(registry, to, &b)) {
+        return UNICON_EINEXACT;
+    }
+    uint64_t g1 = gcd64(a.num, b.num), g2 = gcd64(a.den, b.den);
+    uint64_t num, den;
+    if (__builtin_mul_overflow(a.num / g1, b.den / g2, &num) || __builtin_mul_overflow(a.den / g2, b.num / g1, &den)) {
+        return UNICON_EINEXACT;
+    }
+
+    *conv = (IntegerConversion){.num = num, .den = den, .shift = -1, .limit = UINT64_MAX};
+    bool den_power = (den & (den - 1)) == 0;
+    if (num == 1 && den_power) {
+        conv->kind = INTEGER_SHIFT;
+        conv->shift = __builtin_ctzll(den);
+    } else if (den == 1) {
+        conv->kind = INTEGER_MULTIPLY;
+        conv->shift = (num & (num - 1)) == 0 ? __builtin_ctzll(num) : -1;
+        conv->limit = UINT64_MAX / num;
+    } else if (num == 1) {
+        // The reciprocal rounded up, 2^64 * (2^l - den) / den + 1 with
+        // 2^l the power of two above den, as Granlund and Montgomery give
+        int l = 64 - __builtin_clzll(den - 1);
+        uint64_t rest;
+        conv->kind = INTEGER_DIVIDE;
+        conv->shift = l;
+        conv->magic = divideWide(l == 64 ? -den : (1ULL << l) - den, 0, den, &rest) + 1;
+    } else {
+#ifndef __SIZEOF_INT128__
+        if (!den_power) {
+            // Without 128-bit integers the division would be a bit at a time
+            return UNICON_EINEXACT;
+        }
+#endif
+        conv->kind = INTEGER_FRACTION;
+        conv->shift = den_power ? __builtin_ctzll(den) : -1;
+    }
+    return UNICON_OK;
+}
+
+// Function to compile the conversion of whole counts between two built-in
+// units
+int unicon_compile_integer(Unit from, Unit to, IntegerConversion *conv) {
+    return unicon_registry_compile_integer(unicon_registry_builtin(), from, to, conv);
+}
+
+// SI prefixes a unit name of an expression may start with, as the number
+// of the unit the prefixed unit is
+static const struct {
+    const char *name;
+    long double size;
+} unit_prefixes[] = {
+    {"exa", 1e18L}, {"peta", 1e15L}, {"tera", 1e12L}, {"giga", 1e9L}, {"mega", 1e6L},
+    {"kilo", 1e3L}, {"hecto", 1e2L}, {"deca", 1e1L}, {"deci", 1e-1L}, {"centi", 1e-2L},
+    {"milli", 1e-3L}, {"micro", 1e-6L}, {"nano", 1e-9L}, {"pico", 1e-12L},
+};
+
+// Function to find the unit a name of an expression stands for: a unit
+// of the registry, or one with an SI prefix, each also without its plural
+// 's'. size is how many of the unit the named one is.
+static int findExpressionUnit(const UniconRegistry *registry, const char *name, Unit *unit, long double *size) {
+    char plural[UNICON_EXPRESSION_MAX + 1];
+    size_t len = strlen(name);
+    memcpy(plural, name, len);
+    plural[len] = 's';
+    plural[len + 1] = '\0';
+    const char *candidates[2] = {name, plural};
+    for (int c = 0; c < (name[len - 1] == 's' ? 1 : 2); c++) {
+        if (unicon_registry_lookup(registry, candidates[c], unit) == UNICON_OK) {
+            *size = 1;
+            return UNICON_OK;
+        }
+        for (size_t i = 0; i < sizeof(unit_prefixes) / sizeof(unit_prefixes[0]); i++) {
+            size_t n = strlen(unit_prefixes[i].name);
+            if (strncmp(candidates[c], unit_prefixes[i].name, n) == 0 && candidates[c][n] != '\0' &&
+                unicon_registry_lookup(registry, candidates[c] + n, unit) == UNICON_OK) {
+                *size = unit_prefixes[i].size;
+                return UNICON_OK;
+            }
+        }
+    }
+    return UNICON_EUNIT;
+}
+
+// Function to bring an expression to the form its cache is keyed by: lower
+// cased, without spaces. Returns the length, or -1 when it is too long.
+static int normalizeExpression(const char *text, size_t len, char *out) {
+    size_t n = 0;
+    for (size_t i = 0; i < len; i++) {
+        unsigned char c = (unsigned char)text[i];
+        if (isspace(c)) {
+            continue;
+        }
+        if (n + 1 >= UNICON_EXPRESSION_MAX) {
+            return -1;
+        }
+        out[n++] = (char)tolower(c);
+    }
+    out[n] = '\0';
+    return (int)n;
+}
+
+// Function to parse a unit expression into its dimensions and scale
+int unicon_registry_parse_expression(const UniconRegistry *registry, const char *text, size_t len,
+                                     UniconExpression *expr) {
+    memset(expr, 0, sizeof(*expr));
+    expr->unit = -1;
+    expr->type = -1;
+    int n = normalizeExpression(text, len, expr->name);
+    if (n <= 0) {
+        return UNICON_EEXPR;
+    }
+
+    // Each term is a unit name and an optional power, '/' negating it
+    int dimensions[UNICON_MAX_DIMENSIONS] = {0};
+    long double scale = 1;
+    int terms = 0;
+    bool plain = true;
+    bool wide = false;
+    Unit last = 0;
+    int sign = 1;
+    const char *p = expr->name;
+    for (;;) {
+        const char *start = p;
+        while (*p != '\0' && *p != '/' && *p != '*' && *p != '^') {
+            p++;
+        }
+        if (p == start) {
+            return UNICON_EEXPR;
+        }
+        char name[UNICON_EXPRESSION_MAX];
+        memcpy(name, start, p - start);
+        name[p - start] = '\0';
+        Unit unit;
+        long double size;
+        int status = findExpressionUnit(registry, name, &unit, &size);
+        if (status != UNICON_OK) {
+            return status;
+        }
+
+        int power = 1;
+        if (*p == '^') {
+            p++;
+            bool negative = (*p == '-');
+            p += negative;
+            if (!isdigit((unsigned char)*p)) {
+                return UNICON_EEXPR;
+            }
+            for (power = 0; isdigit((unsigned char)*p); p++) {
+                power = power * 10 + (*p - '0');
+                if (power > 32) {
+                    return UNICON_EEXPR;
+                }
+            }
+            power = negative ? -power : power;
+        }
+        plain = plain && terms == 0 && power == 1 && size == 1 && sign == 1;
+        power *= sign;
+
+        // One of the unit is 1 / scale base units, one of the prefixed
+        // one size times that
+        long double term = (registry->scales != NULL      ? registry->scales[unit]
+                            : isBuiltinUnit(registry, unit) ? builtin_scales[unit]
+                                                            : registry->factors[unit]) / size;
+        for (int i = 0; i < (power < 0 ? -power : power); i++) {
+            scale = (power < 0) ? scale / term : scale * term;
+        }
+        uint32_t type = registry->types[unit];
+        if (type < UNICON_MAX_DIMENSIONS) {
+            dimensions[type] += power;
+        } else {
+            wide = true;
+        }
+        last = unit;
+        terms++;
+
+        if (*p == '\0') {
+            break;
+        }
+        if (*p != '/' && *p != '*') {
+            return UNICON_EEXPR;
+        }
+        sign = (*p == '/') ? -1 : 1;
+        p++;
+    }
+
+    // Types past the dimension vector only work on their own
+    if (wide && !plain) {
+        return UNICON_EEXPR;
+    }
+    int measured = 0;
+    for (int i = 0; i < UNICON_MAX_DIMENSIONS; i++) {
+        if (dimensions[i] < INT8_MIN || dimensions[i] > INT8_MAX) {
+            return UNICON_EEXPR;
+        }
+        expr->dimensions[i] = (int8_t)dimensions[i];
+        if (dimensions[i] != 0) {
+            expr->type = (dimensions[i] == 1 && measured == 0) ? i : -1;
+            measured++;
+        }
+    }
+    expr->scale = scale;
+    if (plain) {
+        expr->unit = last;
+        expr->type = (int)registry->types[last];
+        expr->offset = isBuiltinUnit(registry, last) ? builtin_offsets_exact[last] : registry->offsets[last];
+        snprintf(expr->name, sizeof(expr->name), "%s", unicon_registry_unit_name(registry, last));
+    }
+    return UNICON_OK;
+}
+
+// Function to get the power of a unit type in an expression. Types past
+// the dimension vector only come as a plain unit of their own.
+static int expressionPower(const UniconExpression *expr, int type) {
+    return (type < UNICON_MAX_DIMENSIONS) ? expr->dimensions[type] : (expr->type == type);
+}
+
+// Function to check that two expressions measure the same thing. Matching
+// ones cost one compare, only a mismatch looks for its first type.
+int unicon_expression_check(const UniconExpression *from, const UniconExpression *to, UniconCheckError *error) {
+    bool wide = (from->type >= UNICON_MAX_DIMENSIONS || to->type >= UNICON_MAX_DIMENSIONS);
+    if (memcmp(from->dimensions, to->dimensions, sizeof(from->dimensions)) == 0 && (!wide || from->type == to->type)) {
+        if (error != NULL) {
+            *error = (UniconCheckError){UNICON_OK, -1, 0, 0};
+        }
+        return UNICON_OK;
+    }
+    if (error != NULL) {
+        int last = from->type > to->type ? from->type : to->type;
+        last = last >= UNICON_MAX_DIMENSIONS ? last : UNICON_MAX_DIMENSIONS - 1;
+        int type = 0;
+        while (type < last && expressionPower(from, type) == expressionPower(to, type)) {
+            type++;
+        }
+        *error = (UniconCheckError){UNICON_ETYPE, type, expressionPower(from, type), expressionPower(to, type)};
+    }
+    return UNICON_ETYPE;
+}
+
+// Function to write what an expression measures, the types to positive
+// powers first and those divided by after them
+size_t unicon_expression_describe(const UniconRegistry *registry, const UniconExpression *expr, char *buf,
+                                  size_t size) {
+    size_t len = 0;
+    bool any = false;
+    if (expr->type >= UNICON_MAX_DIMENSIONS) {
+        return snprintf(buf, size, "%s", unicon_registry_type_name(registry, expr->type));
+    }
+    for (int sign = 1; sign >= -1; sign -= 2) {
+        for (int type = 0; type < UNICON_MAX_DIMENSIONS; type++) {
+            int power = expr->dimensions[type] * sign;
+            if (power <= 0) {
+                continue;
+            }
+            const char *name = unicon_registry_type_name(registry, type);
+            len += snprintf(buf + (len < size ? len : size), len < size ? size - len : 0, "%s%s",
+                            sign < 0 ? (any ? "/" : "1/") : any ? "*" : "", name ? name : "unknown");
+            if (power > 1) {
+                len += snprintf(buf + (len < size ? len : size), len < size ? size - len : 0, "^%d", power);
+            }
+            any = true;
+        }
+    }
+    if (!any) {
+        return snprintf(buf, size, "dimensionless");
+    }
+    return len;
+}
+
+// Function to fold the conversion between two expressions of the same
+// dimensions into a scale and offset
+static int foldExpressions(const UniconExpression *from, const UniconExpression *to, long double *scale,
+                           long double *offset) {
+    if (unicon_expression_check(from, to, NULL) != UNICON_OK) {
+        return UNICON_ETYPE;
+    }
+    *scale = to->scale / from->scale;
+    *offset = to->offset - from->offset * *scale;
+    return UNICON_OK;
+}
+
+// Function to compile the conversion between two unit expressions
+int unicon_expression_compile(const UniconRegistry *registry, const UniconExpression *from,
+                              const UniconExpression *to, Conversion *conv) {
+    if (from->unit >= 0 && to->unit >= 0) {
+        return unicon_registry_compile(registry, from->unit, to->unit, conv);
+    }
+    long double scale, offset;
+    int status = foldExpressions(from, to, &scale, &offset);
+    if (status == UNICON_OK) {
+        conv->scale = (double)scale;
+        conv->offset = (double)offset;
+    }
+    return status;
+}
+
+// Function to compile the conversion between two unit expressions in long
+// double precision
+int unicon_expression_compile_exact(const UniconRegistry *registry, const UniconExpression *from,
+                                    const UniconExpression *to, ExactConversion *conv) {
+    if (from->unit >= 0 && to->unit >= 0) {
+        return unicon_registry_compile_exact(registry, from->unit, to->unit, conv);
+    }
+    return foldExpressions(from, to, &conv->scale, &conv->offset);
+}
+
+// Struct for a parsed expression in a cache, on the chain of its hash
+// bucket and on the list from the most to the least recently used
+typedef struct _CachedExpression {
+    char key[UNICON_EXPRESSION_MAX];
+    uint32_t hash;
+    int32_t chain;
+    int32_t newer;
+    int32_t older;
+    UniconExpression expr;
+} CachedExpression;
+
+struct _UniconExpressionCache {
+    const UniconRegistry *registry;
+    size_t capacity;
+    size_t count;
+    uint32_t bucket_mask;
+    int32_t *buckets;
+    CachedExpression *entries;
+    int32_t newest;
+    int32_t oldest;
+};
+
+// Function to create an expression cache
+UniconExpressionCache *unicon_expression_cache_new(const UniconRegistry *registry, size_t capacity) {
+    UniconExpressionCache *cache = calloc(1, sizeof(*cache));
+    if (cache == NULL) {
+        return NULL;
+    }
+    size_t nbuckets = 16;
+    while (nbuckets < 2 * capacity) {
+        nbuckets *= 2;
+    }
+    cache->registry = registry;
+    cache->capacity = capacity > 0 ? capacity : 1;
+    cache->bucket_mask = (uint32_t)(nbuckets - 1);
+    cache->buckets = malloc(nbuckets * sizeof(*cache->buckets));
+    cache->entries = calloc(cache->capacity, sizeof(*cache->entries));
+    if (cache->buckets == NULL || cache->entries == NULL) {
+        unicon_expression_cache_free(cache);
+        return NULL;
+    }
+    for (size_t i = 0; i < nbuckets; i++) {
+        cache->buckets[i] = -1;
+    }
+    cache->newest = cache->oldest = -1;
+    return cache;
+}
+
+// Function to release an expression cache
+void unicon_expression_cache_free(UniconExpressionCache *cache) {
+    if (cache != NULL) {
+        free(cache->buckets);
+        free(cache->entries);
+        free(cache);
+    }
+}
+
+// Functions to take an entry off the recently used list and to put it
+// back at the front
+static void unlinkCachedExpression(UniconExpressionCache *cache, int32_t i) {
+    CachedExpression *entry = &cache->entries[i];
+    if (entry->newer >= 0) {
+        cache->entries[entry->newer].older = entry->older;
+    } else {
+        cache->newest = entry->older;
+    }
+    if (entry->older >= 0) {
+        cache->entries[entry->older].newer = entry->newer;
+    } else {
+        cache->oldest = entry->newer;
+    }
+}
+
+static void pushCachedExpression(UniconExpressionCache *cache, int32_t i) {
+    CachedExpression *entry = &cache->entries[i];
+    entry->newer = -1;
+    entry->older = cache->newest;
+    if (cache->newest >= 0) {
+        cache->entries[cache->newest].newer = i;
+    } else {
+        cache->oldest = i;
+    }
+    cache->newest = i;
+}
+
+// Function to look an expression up in a cache, parsing it on a miss
+int unicon_expression_cache_lookup(UniconExpressionCache *cache, const char *text, size_t len,
+                                   const UniconExpression **expr) {
+    char key[UNICON_EXPRESSION_MAX];
+    int n = normalizeExpression(text, len, key);
+    if (n <= 0) {
+        return UNICON_EEXPR;
+    }
+    // FNV-1a over the normalized key
+    uint32_t hash = 2166136261u;
+    for (int i = 0; i < n; i++) {
+        hash = (hash ^ (unsigned char)key[i]) * 16777619u;
+    }
+    int32_t *bucket = &cache->buckets[hash & cache->bucket_mask];
+    for (int32_t i = *bucket; i >= 0; i = cache->entries[i].chain) {
+        CachedExpression *entry = &cache->entries[i];
+        if (entry->hash == hash && strcmp(entry->key, key) == 0) {
+            if (cache->newest != i) {
+                unlinkCachedExpression(cache, i);
+                pushCachedExpression(cache, i);
+            }
+            *expr = &entry->expr;
+            return UNICON_OK;
+        }
+    }
+
+    UniconExpression parsed;
+    int status = unicon_registry_parse_expression(cache->registry, key, n, &parsed);
+    if (status != UNICON_OK) {
+        return status;
+    }
+
+    // A full cache gives up its least recently used entry
+    int32_t i;
+    if (cache->count < cache->capacity) {
+        i = (int32_t)cache->count++;
+    } else {
+        i = cache->oldest;
+        unlinkCachedExpression(cache, i);
+        int32_t *link = &cache->buckets[cache->entries[i].hash & cache->bucket_mask];
+        while (*link != i) {
+            link = &cache->entries[*link].chain;
+        }
+        *link = cache->entries[i].chain;
+    }
+    CachedExpression *entry = &cache->entries[i];
+    memcpy(entry->key, key, n + 1);
+    entry->hash = hash;
+    entry->expr = parsed;
+    entry->chain = *bucket;
+    *bucket = i;
+    pushCachedExpression(cache, i);
+    *expr = &entry->expr;
+    return UNICON_OK;
+}
+
+// Function to find a unit by name
+int unicon_lookup(const char *name, Unit *unit) {
+    return unicon_registry_lookup(unicon_registry_builtin(), name, unit);
+}
+
+// Function to get the name of a unit
+const char *unicon_unit_name(Unit unit) {
+    return ((unsigned)unit < NUNITS) ? unit_table[unit].name : NULL;
+}
+
+// Function to get the type of a unit
+int unicon_unit_type(Unit unit) {
+    return ((unsigned)unit < NUNITS) ? (int)unit_table[unit].type : -1;
+}
+
+// Function to describe a status code
+const char *unicon_strerror(int status) {
+    switch (status) {
+        case UNICON_OK:
+            return "Success";
+        case UNICON_EUNIT:
+            return "Unknown unit";
+        case UNICON_ETYPE:
+            return "Cannot convert between different unit types";
+        case UNICON_EVALUE:
+            return "Invalid numeric value";
+        case UNICON_EIO:
+            return "Cannot read or write the file";
+        case UNICON_EDEFS:
+            return "Invalid unit definitions";
+        case UNICON_ENOMEM:
+            return "Out of memory";
+        case UNICON_EEXPR:
+            return "Invalid unit expression";
+        case UNICON_EINEXACT:
+            return "No exact conversion between whole counts of these units";
+        case UNICON_ERANGE:
+            return "Result out of range";
+        default:
+            return "Unknown error";
+    }
+}
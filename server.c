@@ -0,0 +1,417 @@
+/* 
+ * server.c
+ *
+ * Copyright 2024 Clay Gomera
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-only
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <ctype.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "unicon.h"
+#include "batch.h"
+#include "server.h"
+
+// Struct for a connected client. Requests may arrive split across reads,
+// so an incomplete last line is kept until the rest of it comes in.
+// Responses that the socket does not take at once wait in out, and the
+// client is not read from again until they are sent.
+typedef struct _Client {
+    int fd;
+    char partial[SERVER_LINE_MAX];
+    size_t partial_len;
+    OutBuffer out;
+    size_t out_pos;
+    // Next client of the free list once disconnected
+    struct _Client *next_free;
+} Client;
+
+// Struct for the state of a running server
+typedef struct _Server {
+    int epoll_fd;
+    int listen_fd;
+    int round_places;
+    OutputFormat format;
+    size_t clients;
+    const UniconRegistry *registry;
+    // Requests mostly repeat a few pairs, each compiled once, and unit
+    // expressions are each parsed once
+    PairCache conversions;
+    UniconExpressionCache *expressions;
+    // The loop runs on one thread, so one set of statistics
+    Stats stats;
+    unsigned long reported_allocations;
+    // Disconnected clients, kept with their buffers for the next ones
+    Client *free_clients;
+} Server;
+
+static volatile sig_atomic_t stop_requested;
+
+// Function to ask the event loop to stop
+static void requestStop(int signal) {
+    (void)signal;
+    stop_requested = 1;
+}
+
+// Function to split the next whitespace separated word off a request,
+// terminating it in place
+static char *nextWord(char **p, char *end) {
+    while (*p < end && isspace((unsigned char)**p)) {
+        (*p)++;
+    }
+    if (*p == end) {
+        return NULL;
+    }
+    char *word = *p;
+    while (*p < end && !isspace((unsigned char)**p)) {
+        (*p)++;
+    }
+    **p = '\0';
+    if (*p < end) {
+        (*p)++;
+    }
+    return word;
+}
+
+// Function to answer one request line "VALUE FROM TO" with the converted
+// value, or "error: " and the reason. The line is modified in place and
+// may be followed by at least one writable byte.
+static void answerRequest(Server *server, char *line, char *end, OutBuffer *out) {
+    int decimal_places = (server->round_places >= 0) ? server->round_places : 2;
+    char *reply = reserveOutput(out, UNICON_FORMAT_MAX(decimal_places) + 64);
+    if (reply == NULL) {
+        return;
+    }
+    bool timed = sampleStats(&server->stats);
+    uint64_t parse_start = timed ? statsNow() : 0;
+
+    char *p = line;
+    char *value_text = nextWord(&p, end);
+    char *from_name = nextWord(&p, end);
+    char *to_name = nextWord(&p, end);
+    int status = UNICON_OK;
+    double value;
+    Unit from, to;
+    int type = -1;
+    Conversion compound;
+    const Conversion *conv = NULL;
+    if (to_name == NULL || nextWord(&p, end) != NULL) {
+        status = UNICON_EVALUE;
+    } else if (unicon_parse_number(value_text, value_text + strlen(value_text), &value) != value_text + strlen(value_text)) {
+        status = UNICON_EVALUE;
+    } else if (unicon_registry_lookup(server->registry, from_name, &from) == UNICON_OK &&
+               unicon_registry_lookup(server->registry, to_name, &to) == UNICON_OK) {
+        const PairCacheEntry *entry = lookupPairCache(&server->conversions, server->registry, from, to);
+        conv = entry ? &entry->conv : NULL;
+        status = entry ? UNICON_OK : UNICON_ETYPE;
+        type = unicon_registry_unit_type(server->registry, from);
+    } else {
+        // Unit expressions such as "kilometers/hours", the target's copied
+        // out as the next lookup may evict it
+        const UniconExpression *expr;
+        UniconExpression target;
+        status = unicon_expression_cache_lookup(server->expressions, to_name, strlen(to_name), &expr);
+        if (status == UNICON_OK) {
+            target = *expr;
+            status = unicon_expression_cache_lookup(server->expressions, from_name, strlen(from_name), &expr);
+        }
+        if (status == UNICON_OK) {
+            status = unicon_expression_compile(server->registry, expr, &target, &compound);
+            conv = &compound;
+            type = expr->type;
+        }
+    }
+    if (status != UNICON_OK) {
+        out->used += snprintf(reply, 64, "error: %s\n", unicon_strerror(status));
+        server->stats.errors++;
+        return;
+    }
+
+    uint64_t convert_start = timed ? statsNow() : 0;
+    double result = unicon_apply_rounded(conv, value, server->round_places);
+    uint64_t format_start = timed ? statsNow() : 0;
+    size_t len = formatNumber(reply, UNICON_FORMAT_MAX(decimal_places), result, server->format, decimal_places);
+    reply[len++] = '\n';
+    out->used += len;
+    if (timed) {
+        recordLatency(&server->stats, STAGE_PARSE, convert_start - parse_start, 1);
+        recordLatency(&server->stats, STAGE_CONVERT, format_start - convert_start, 1);
+        recordLatency(&server->stats, STAGE_FORMAT, statsNow() - format_start, 1);
+    }
+    server->stats.records++;
+    countConversions(&server->stats, type, 1);
+}
+
+// Function to answer the "stats" request with the statistics so far
+static void answerStats(Server *server, OutBuffer *out) {
+    server->stats.allocations = countedAllocations();
+    server->stats.steady_allocations = server->stats.allocations - server->reported_allocations;
+    server->reported_allocations = server->stats.allocations;
+    appendStats(out, &server->stats, server->registry);
+}
+
+// Function to answer every complete line in [data, end), returning the
+// start of the incomplete line left at the end
+static char *answerRequests(Server *server, char *data, char *end, OutBuffer *out) {
+    for (;;) {
+        char *eol = memchr(data, '\n', end - data);
+        if (eol == NULL) {
+            return data;
+        }
+        char *line = data;
+        while (line < eol && isspace((unsigned char)*line)) {
+            line++;
+        }
+        // Blank lines get no answer
+        char *stop = eol;
+        while (stop > line && isspace((unsigned char)stop[-1])) {
+            stop--;
+        }
+        if (stop - line == 5 && memcmp(line, "stats", 5) == 0) {
+            answerStats(server, out);
+        } else if (line < eol) {
+            answerRequest(server, line, eol, out);
+        }
+        data = eol + 1;
+    }
+}
+
+// Function to disconnect a client, keeping it for reuse
+static void closeClient(Server *server, Client *client) {
+    epoll_ctl(server->epoll_fd, EPOLL_CTL_DEL, client->fd, NULL);
+    close(client->fd);
+    client->partial_len = 0;
+    client->out.used = 0;
+    client->out_pos = 0;
+    client->next_free = server->free_clients;
+    server->free_clients = client;
+    server->clients--;
+}
+
+// Function to get a client for a new connection, reusing a disconnected
+// one and its buffers when there is one
+static Client *newClient(Server *server) {
+    Client *client = server->free_clients;
+    if (client != NULL) {
+        server->free_clients = client->next_free;
+        return client;
+    }
+    return countedCalloc(1, sizeof(*client));
+}
+
+// Function to send the responses waiting for a client, watching for the
+// socket to drain when it cannot take them all. Returns false when the
+// client is gone.
+static bool flushClient(Server *server, Client *client) {
+    while (client->out_pos < client->out.used) {
+        ssize_t n = send(client->fd, client->out.data + client->out_pos, client->out.used - client->out_pos, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                return false;
+            }
+            struct epoll_event ev = {.events = EPOLLOUT, .data.ptr = client};
+            return epoll_ctl(server->epoll_fd, EPOLL_CTL_MOD, client->fd, &ev) == 0;
+        }
+        client->out_pos += n;
+        server->stats.bytes_out += n;
+    }
+    if (client->out_pos > 0) {
+        client->out.used = 0;
+        client->out_pos = 0;
+        struct epoll_event ev = {.events = EPOLLIN, .data.ptr = client};
+        return epoll_ctl(server->epoll_fd, EPOLL_CTL_MOD, client->fd, &ev) == 0;
+    }
+    return true;
+}
+
+// Function to read whatever a client sent and answer all of it with a
+// single send. Returns false when the client is gone.
+static bool serveClient(Server *server, Client *client, char *buf) {
+    memcpy(buf, client->partial, client->partial_len);
+    ssize_t n = recv(client->fd, buf + client->partial_len, SERVER_READ_SIZE, 0);
+    if (n <= 0) {
+        return n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR);
+    }
+    server->stats.bytes_in += n;
+    char *end = buf + client->partial_len + n;
+    char *rest = answerRequests(server, buf, end, &client->out);
+
+    // A line longer than any request can be is refused
+    client->partial_len = end - rest;
+    if (client->partial_len >= SERVER_LINE_MAX) {
+        return false;
+    }
+    memcpy(client->partial, rest, client->partial_len);
+    return flushClient(server, client);
+}
+
+// Function to take every pending connection
+static void acceptClients(Server *server) {
+    for (;;) {
+        int fd = accept4(server->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return;
+        }
+        Client *client = (server->clients < SERVER_MAX_CLIENTS) ? newClient(server) : NULL;
+        if (client == NULL) {
+            close(fd);
+            continue;
+        }
+        client->fd = fd;
+        struct epoll_event ev = {.events = EPOLLIN, .data.ptr = client};
+        if (epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, fd, &ev) != 0) {
+            close(fd);
+            client->next_free = server->free_clients;
+            server->free_clients = client;
+            continue;
+        }
+        server->clients++;
+    }
+}
+
+// Function to create the listening socket at path, replacing a stale
+// socket file left by an earlier run
+static int listenUnix(const char *path) {
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    unlink(path);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(fd, SOMAXCONN) != 0) {
+        int saved = errno;
+        close(fd);
+        errno = saved;
+        return -1;
+    }
+    return fd;
+}
+
+// Function to serve conversion requests on a Unix socket until SIGINT or
+// SIGTERM. Each request is a line "VALUE FROM TO" answered by a line with
+// the result, in order, so clients may pipeline as many as they like. All
+// the answers to one read go back in one send.
+int runServer(const UniconRegistry *registry, const char *path, int round_places, OutputFormat format, bool stats) {
+    Server *server = calloc(1, sizeof(*server));
+    char *buf = malloc(SERVER_LINE_MAX + SERVER_READ_SIZE);
+    UniconExpressionCache *expressions = unicon_expression_cache_new(registry, EXPRESSION_CACHE_SIZE);
+    if (server == NULL || buf == NULL || expressions == NULL) {
+        perror("unicon");
+        free(server);
+        free(buf);
+        unicon_expression_cache_free(expressions);
+        return 1;
+    }
+    server->expressions = expressions;
+    server->round_places = round_places;
+    server->format = format;
+    server->registry = registry;
+    server->stats.timing = stats;
+    initPairCache(&server->conversions);
+
+    server->listen_fd = listenUnix(path);
+    server->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    struct epoll_event ev = {.events = EPOLLIN, .data.ptr = NULL};
+    if (server->listen_fd < 0 || server->epoll_fd < 0 ||
+        epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, server->listen_fd, &ev) != 0) {
+        fprintf(stderr, "unicon: %s: %s\n", path, strerror(errno));
+        if (server->listen_fd >= 0) {
+            close(server->listen_fd);
+            unlink(path);
+        }
+        if (server->epoll_fd >= 0) {
+            close(server->epoll_fd);
+        }
+        unicon_expression_cache_free(server->expressions);
+        free(server);
+        free(buf);
+        return 1;
+    }
+
+    struct sigaction action = {.sa_handler = requestStop};
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+
+    struct epoll_event events[64];
+    while (!stop_requested) {
+        int n = epoll_wait(server->epoll_fd, events, 64, -1);
+        for (int i = 0; i < n; i++) {
+            Client *client = events[i].data.ptr;
+            if (client == NULL) {
+                acceptClients(server);
+                continue;
+            }
+            bool alive;
+            if (events[i].events & EPOLLOUT) {
+                alive = flushClient(server, client);
+            } else {
+                alive = !(events[i].events & EPOLLERR) && serveClient(server, client, buf);
+            }
+            if (!alive) {
+                closeClient(server, client);
+            }
+        }
+    }
+
+    if (stats) {
+        OutBuffer line = {0};
+        server->stats.allocations = countedAllocations();
+        server->stats.steady_allocations = server->stats.allocations - server->reported_allocations;
+        if (appendStats(&line, &server->stats, registry)) {
+            fprintf(stderr, "unicon: stats %.*s", (int)line.used, line.data);
+        }
+        free(line.data);
+    }
+
+    // Clients still connected are closed along with the process
+    close(server->epoll_fd);
+    close(server->listen_fd);
+    unlink(path);
+    while (server->free_clients != NULL) {
+        Client *client = server->free_clients;
+        server->free_clients = client->next_free;
+        free(client->out.data);
+        free(client);
+    }
+    unicon_expression_cache_free(server->expressions);
+    free(server);
+    free(buf);
+    return 0;
+}
@@ -0,0 +1,43 @@
+/* 
+ * server.h
+ *
+ * Copyright 2024 Clay Gomera
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-only
+ */
+
+// Conversion server answering requests over a Unix socket
+
+#ifndef SERVER_H
+#define SERVER_H
+
+#include "batch.h"
+
+// Largest request line the server accepts
+#define SERVER_LINE_MAX 256
+
+// Size of the buffer each read from a client goes into
+#define SERVER_READ_SIZE 65536
+
+// Most clients connected at once
+#define SERVER_MAX_CLIENTS 4096
+
+// Function to answer requests on a Unix socket until SIGINT or SIGTERM.
+// The request "stats" gets the statistics so far; with stats set request
+// stages are timed too and the statistics are printed on exit.
+int runServer(const UniconRegistry *registry, const char *path, int round_places, OutputFormat format, bool stats);
+
+#endif
@@ -0,0 +1,150 @@
+/* 
+ * stats.c
+ *
+ * Copyright 2024 Clay Gomera
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-only
+ */
+
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "stats.h"
+
+// Names of the timed stages in reports
+static const char *const stage_names[NSTAGES] = {"parse", "convert", "format"};
+
+// Number of buffer allocations so far. They are rare, so one shared
+// counter costs nothing measurable.
+static atomic_ulong allocations;
+
+// Function to allocate a zeroed buffer and count it
+void *countedCalloc(size_t n, size_t size) {
+    atomic_fetch_add_explicit(&allocations, 1, memory_order_relaxed);
+    return calloc(n, size);
+}
+
+// Function to grow a buffer and count it
+void *countedRealloc(void *ptr, size_t size) {
+    atomic_fetch_add_explicit(&allocations, 1, memory_order_relaxed);
+    return realloc(ptr, size);
+}
+
+// Function to get the number of buffer allocations so far
+unsigned long countedAllocations(void) {
+    return atomic_load_explicit(&allocations, memory_order_relaxed);
+}
+
+// Function to find the bucket of a value
+static size_t bucketOf(uint64_t value) {
+    if (value < STATS_SUB_BUCKETS) {
+        return (size_t)value;
+    }
+    int msb = 63 - __builtin_clzll(value);
+    size_t sub = (size_t)(value >> (msb - 3)) & (STATS_SUB_BUCKETS - 1);
+    return (size_t)(msb - 2) * STATS_SUB_BUCKETS + sub;
+}
+
+// Function to give the smallest value of a bucket
+static uint64_t bucketValue(size_t bucket) {
+    if (bucket < STATS_SUB_BUCKETS) {
+        return bucket;
+    }
+    int msb = (int)(bucket / STATS_SUB_BUCKETS) + 2;
+    return (uint64_t)(STATS_SUB_BUCKETS + bucket % STATS_SUB_BUCKETS) << (msb - 3);
+}
+
+// Function to add a timed stage of records records, which took ns
+// nanoseconds together, to the histogram of the stage
+void recordLatency(Stats *stats, Stage stage, uint64_t ns, unsigned long records) {
+    if (records > 0) {
+        stats->latency[stage].counts[bucketOf((ns + records / 2) / records)]++;
+    }
+}
+
+// Function to add the statistics of one thread to a total
+void addStats(Stats *total, const Stats *part) {
+    total->records += part->records;
+    total->errors += part->errors;
+    total->bytes_in += part->bytes_in;
+    total->bytes_out += part->bytes_out;
+    for (size_t i = 0; i < STATS_MAX_TYPES; i++) {
+        total->conversions[i] += part->conversions[i];
+    }
+    for (size_t stage = 0; stage < NSTAGES; stage++) {
+        for (size_t i = 0; i < STATS_BUCKETS; i++) {
+            total->latency[stage].counts[i] += part->latency[stage].counts[i];
+        }
+    }
+}
+
+// Function to find the value below which the fraction q of a histogram lies
+static uint64_t percentile(const Histogram *histogram, unsigned long total, double q) {
+    unsigned long rank = (unsigned long)(q * (total - 1));
+    unsigned long seen = 0;
+    for (size_t i = 0; i < STATS_BUCKETS; i++) {
+        seen += histogram->counts[i];
+        if (seen > rank) {
+            return bucketValue(i);
+        }
+    }
+    return 0;
+}
+
+// Function to append formatted text to buf, counting the length it needs
+// even once it no longer fits, like snprintf()
+static void append(char *buf, size_t size, size_t *len, const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    int n = vsnprintf(buf + (*len < size ? *len : size), *len < size ? size - *len : 0, format, args);
+    va_end(args);
+    *len += (n > 0) ? (size_t)n : 0;
+}
+
+// Function to describe statistics on one line of key=value words, ending
+// in a newline. Latencies are nanoseconds per record. Returns the length
+// of the whole line, which like snprintf() is cut short when that is size
+// or more.
+size_t formatStats(char *buf, size_t size, const Stats *stats, const UniconRegistry *registry) {
+    size_t len = 0;
+    append(buf, size, &len, "records=%lu errors=%lu bytes_in=%lu bytes_out=%lu allocations=%lu steady_allocations=%lu",
+           stats->records, stats->errors, stats->bytes_in, stats->bytes_out, stats->allocations,
+           stats->steady_allocations);
+    for (size_t type = 0; type < STATS_MAX_TYPES; type++) {
+        if (stats->conversions[type] == 0) {
+            continue;
+        }
+        const char *name = (type + 1 < STATS_MAX_TYPES) ? unicon_registry_type_name(registry, (int)type) : NULL;
+        append(buf, size, &len, " %s=%lu", name ? name : "other", stats->conversions[type]);
+    }
+    for (size_t stage = 0; stage < NSTAGES; stage++) {
+        const Histogram *histogram = &stats->latency[stage];
+        unsigned long total = 0;
+        for (size_t i = 0; i < STATS_BUCKETS; i++) {
+            total += histogram->counts[i];
+        }
+        if (total > 0) {
+            append(buf, size, &len, " %s_ns_p50=%llu %s_ns_p99=%llu %s_ns_p999=%llu", stage_names[stage],
+                   (unsigned long long)percentile(histogram, total, 0.5), stage_names[stage],
+                   (unsigned long long)percentile(histogram, total, 0.99), stage_names[stage],
+                   (unsigned long long)percentile(histogram, total, 0.999));
+        }
+    }
+    append(buf, size, &len, "\n");
+    return len;
+}
@@ -0,0 +1,106 @@
+/* 
+ * stats.h
+ *
+ * Copyright 2024 Clay Gomera
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-only
+ */
+
+// Counters and sampled latency histograms for batch and server runs
+
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "unicon.h"
+
+// Unit types counted apart, later ones share the last counter
+#define STATS_MAX_TYPES 32
+
+// Log-linear histogram buckets: eight per power of two, like HDR histograms
+// with three significant bits, so any value is within 12.5% of its bucket
+#define STATS_SUB_BUCKETS 8
+#define STATS_BUCKETS (64 * STATS_SUB_BUCKETS)
+
+// One block or request in this many is timed when timing is on
+#define STATS_SAMPLE_EVERY 64
+
+// Stages of converting a record that are timed
+typedef enum {
+    STAGE_PARSE,
+    STAGE_CONVERT,
+    STAGE_FORMAT,
+    NSTAGES
+} Stage;
+
+// Struct for a histogram of nanoseconds per record
+typedef struct _Histogram {
+    unsigned long counts[STATS_BUCKETS];
+} Histogram;
+
+// Struct for the statistics of one thread. Each thread only ever writes
+// its own, so the counters need no atomics, and the alignment keeps two
+// threads' counters off the same cache line. They are summed on demand.
+typedef struct _Stats {
+    _Alignas(64) unsigned long records;
+    unsigned long errors;
+    unsigned long bytes_in;
+    unsigned long bytes_out;
+    unsigned long conversions[STATS_MAX_TYPES];
+    // Buffer allocations of the whole process, filled in when reporting:
+    // in total and in steady state, which a batch run counts from once
+    // every chunk of its ring has been used and the server from its
+    // previous stats answer
+    unsigned long allocations;
+    unsigned long steady_allocations;
+    // Latencies are only sampled when timing is set
+    bool timing;
+    unsigned long samples;
+    Histogram latency[NSTAGES];
+} Stats;
+
+// Function to read the monotonic clock in nanoseconds
+static inline uint64_t statsNow(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+// Function to decide whether the next block or request is timed
+static inline bool sampleStats(Stats *stats) {
+    return stats->timing && stats->samples++ % STATS_SAMPLE_EVERY == 0;
+}
+
+// Function to count conversions of a unit type
+static inline void countConversions(Stats *stats, int type, unsigned long n) {
+    stats->conversions[(unsigned)type < STATS_MAX_TYPES ? type : STATS_MAX_TYPES - 1] += n;
+}
+
+// Functions to allocate or grow the buffers that records pass through
+// like calloc() and realloc(), and to count how often that happened. Each
+// buffer is kept and reused, so a warmed up run allocates nothing more.
+void *countedCalloc(size_t n, size_t size);
+void *countedRealloc(void *ptr, size_t size);
+unsigned long countedAllocations(void);
+
+void recordLatency(Stats *stats, Stage stage, uint64_t ns, unsigned long records);
+void addStats(Stats *total, const Stats *part);
+size_t formatStats(char *buf, size_t size, const Stats *stats, const UniconRegistry *registry);
+
+#endif
@@ -25,97 +25,73 @@
 #include <stdbool.h>
 #include <ctype.h>
 #include <string.h>
-#include <math.h>
+#include <strings.h>
+#include <unistd.h>
+
+#include "unicon.h"
+#include "batch.h"
+#include "server.h"
 
 #define VERSION 0.1
 
-// Enumeration for each unit type
-typedef enum {
-    TEMPERATURE,
-    LENGTH,
-    TIME,
-    MASS,
-    DIGITAL
-} UnitType;
-
-// Enumeration for each unit
-typedef enum {
-    // Temperature units
-    CELSIUS, FAHRENHEIT, KELVIN,
-    // Length units
-    METERS, CENTIMETERS, DECIMETERS, DECAMETERS, HECTOMETERS, KILOMETERS, MILLIMETERS, MILE, INCHES, FEET,
-    // Time units
-    SECONDS, MILLISECONDS, MINUTES, HOURS, DAYS, MONTHS, YEARS,
-    // Mass units
-    GRAMS, CENTIGRAMS, DECIGRAMS, DECAGRAMS, HECTOGRAMS, MILLIGRAMS, KILOGRAMS, POUNDS, OUNCES,
-    // Digital storage units
-    BYTES, KILOBYTES, MEGABYTES, GIGABYTES, TERABYTES, PETABYTES, EXABYTES
-} Unit;
-
-// Struct for the units table
-typedef struct _UnitTable {
-    UnitType type;
-    Unit unit;
-    const char *name;
-    double conversion_factor;
-} UnitTable;
-
-// Units table with conversion factors
-UnitTable unit_table[] = {
-    // Temperature units
-    {TEMPERATURE, CELSIUS, "celsius", 0},
-    {TEMPERATURE, FAHRENHEIT, "fahrenheit", 0},
-    {TEMPERATURE, KELVIN, "kelvin", 0},
-    // Length units
-    {LENGTH, METERS, "meters", 1.0},
-    {LENGTH, CENTIMETERS, "centimeters", 100.0},
-    {LENGTH, DECIMETERS, "decimeters", 10.0},
-    {LENGTH, DECAMETERS, "decameters", 0.1},
-    {LENGTH, HECTOMETERS, "hectometers", 0.01},
-    {LENGTH, KILOMETERS, "kilometers", 0.001},
-    {LENGTH, MILLIMETERS, "millimeters", 1000.0},
-    {LENGTH, MILE, "miles", 0.000621371},
-    {LENGTH, INCHES, "inches", 39.3701},
-    {LENGTH, FEET, "feet", 3.28084},
-    // Time units
-    {TIME, SECONDS, "seconds", 1.0},
-    {TIME, MILLISECONDS, "milliseconds", 1000.0},
-    {TIME, MINUTES, "minutes", 1.0 / 60.0},
-    {TIME, HOURS, "hours", 1.0 / 3600.0},
-    {TIME, DAYS, "days", 1.0 / 86400.0},
-    {TIME, MONTHS, "months", 1.0 / 2592000.0},
-    {TIME, YEARS, "years", 1.0 / 31536000.0},
-    // Mass units
-    {MASS, GRAMS, "grams", 1.0},
-    {MASS, CENTIGRAMS, "centigrams", 100.0},
-    {MASS, DECIGRAMS, "decigrams", 10.0},
-    {MASS, DECAGRAMS, "decagrams", 0.1},
-    {MASS, HECTOGRAMS, "hectograms", 0.01},
-    {MASS, MILLIGRAMS, "milligrams", 1000.0},
-    {MASS, KILOGRAMS, "kilograms", 0.001},
-    {MASS, POUNDS, "pounds", 0.00220462},
-    {MASS, OUNCES, "ounces", 0.03527396},
-    // Digital storage units
-    {DIGITAL, BYTES, "bytes", 1.0},
-    {DIGITAL, KILOBYTES, "kilobytes", 1.0 / 1024.0},
-    {DIGITAL, MEGABYTES, "megabytes", 1.0 / 1048576.0},
-    {DIGITAL, GIGABYTES, "gigabytes", 1.0 / 1073741824.0},
-    {DIGITAL, TERABYTES, "terabytes", 1.0 / 1099511627776.0},
-    {DIGITAL, PETABYTES, "petabytes", 1.0 / 1125899906842624.0},
-    {DIGITAL, EXABYTES, "exabytes", 1.0 / 1152921504606846976.0},
+// Most decimal places the one-shot result line holds on the stack, -r
+// beyond it puts the line on the heap
+#define LINE_PLACES_MAX 64
+
+// Size of the one-shot result line for every target
+#define LINE_SIZE(places, names_len) ((BATCH_MAX_TARGETS + 1) * (UNICON_FORMAT_MAX(places) + 4) + (names_len))
+
+// Codes of the options that only have a long form
+enum {
+    OPT_CSV = 256,
+    OPT_TSV,
+    OPT_HEADER,
+    OPT_FROM,
+    OPT_TO,
+    OPT_SERVE,
+    OPT_COMPILE_UNITS,
+    OPT_EXACT,
+    OPT_STATS,
+    OPT_AGGREGATE,
+    OPT_IO,
+    OPT_JSONL,
+    OPT_FIELD,
+    OPT_UNIT_FIELD,
+    OPT_SI
 };
 
+// The units every conversion looks its units up in
+static const UniconRegistry *registry;
+
 // Function prototypes
-bool isNumeric(const char *str);
-double convertUnit(double value, Unit from, Unit to);
-Unit matchArgument(const char *arg);
+bool findUnits(int argc, char **argv, int start, Batch *state);
+bool lookupUnits(const char *from_name, const char *to_names, Batch *state);
+bool lookupTargets(const char *list, Batch *state);
+bool parseColumns(const char *list, Batch *state);
 void displayHelp();
 void displayVersion();
 void displayUnits();
+static char *appendText(char *p, const char *a, const char *b, const char *c);
+static void reportInvalidUnit(const char *text, size_t len);
+static void reportMismatch(const Batch *state, size_t target, const UniconCheckError *error);
 
 int main(int argc, char **argv) {
     int opt;
     int round_places = -1; // Default value for rounding places
+    bool batch = false;
+    OutputFormat format = FORMAT_FIXED;
+    int jobs = 1;
+    const char *input = NULL;
+    const char *from_name = NULL;
+    const char *to_name = NULL;
+    const char *socket_path = NULL;
+    const char *units_path = NULL;
+    const char *compiled_path = NULL;
+    bool show = false;
+    bool si = false;
+    Batch state = {0};
+    size_t failed;
+    UniconCheckError error;
     
     // Check if there are no command-line arguments
     if (argc == 1) {
@@ -123,9 +99,32 @@ int main(int argc, char **argv) {
         return 0;
     }
 
-    static const char* const short_options = "r:shv";
+    static const char* const short_options = "r:bi:f:j:c:mu:shv";
     static struct option long_options[] = {
         {"round", required_argument, 0, 'r'},
+        {"batch", no_argument, 0, 'b'},
+        {"stdin", no_argument, 0, 'b'},
+        {"input", required_argument, 0, 'i'},
+        {"format", required_argument, 0, 'f'},
+        {"jobs", required_argument, 0, 'j'},
+        {"csv", no_argument, 0, OPT_CSV},
+        {"tsv", no_argument, 0, OPT_TSV},
+        {"column", required_argument, 0, 'c'},
+        {"header", no_argument, 0, OPT_HEADER},
+        {"jsonl", no_argument, 0, OPT_JSONL},
+        {"field", required_argument, 0, OPT_FIELD},
+        {"unit-field", required_argument, 0, OPT_UNIT_FIELD},
+        {"mixed", no_argument, 0, 'm'},
+        {"from", required_argument, 0, OPT_FROM},
+        {"to", required_argument, 0, OPT_TO},
+        {"serve", required_argument, 0, OPT_SERVE},
+        {"units", required_argument, 0, 'u'},
+        {"compile-units", required_argument, 0, OPT_COMPILE_UNITS},
+        {"si", no_argument, 0, OPT_SI},
+        {"exact", no_argument, 0, OPT_EXACT},
+        {"stats", no_argument, 0, OPT_STATS},
+        {"aggregate", required_argument, 0, OPT_AGGREGATE},
+        {"io", required_argument, 0, OPT_IO},
         {"show", no_argument, 0, 's'},
         {"help", no_argument, 0, 'h'},
         {"version", no_argument, 0, 'v'},
@@ -138,6 +137,114 @@ int main(int argc, char **argv) {
             case 'r':
                 round_places = atoi(optarg);
                 break;
+            case 'b':
+                batch = true;
+                break;
+            case 'i':
+                input = optarg;
+                batch = true;
+                break;
+            case 'f':
+                if (strcasecmp(optarg, "fixed") == 0) {
+                    format = FORMAT_FIXED;
+                } else if (strcasecmp(optarg, "shortest") == 0) {
+                    format = FORMAT_SHORTEST;
+                } else if (strcasecmp(optarg, "f64le") == 0) {
+                    // Binary values only make sense as a stream
+                    format = FORMAT_F64LE;
+                    batch = true;
+                } else if (strcasecmp(optarg, "f32le") == 0) {
+                    format = FORMAT_F32LE;
+                    batch = true;
+                } else if (strcasecmp(optarg, "u64le") == 0) {
+                    format = FORMAT_U64LE;
+                    batch = true;
+                } else {
+                    fprintf(stderr, "Invalid format '%s'. Use 'fixed', 'shortest', 'f64le', 'f32le' or 'u64le'.\n",
+                            optarg);
+                    return 1;
+                }
+                break;
+            case 'j':
+                jobs = atoi(optarg);
+                if (jobs <= 0) {
+                    long online = sysconf(_SC_NPROCESSORS_ONLN);
+                    jobs = online > 0 ? (int)online : 1;
+                }
+                break;
+            case OPT_CSV:
+                state.delimiter = ',';
+                batch = true;
+                break;
+            case OPT_TSV:
+                state.delimiter = '\t';
+                batch = true;
+                break;
+            case 'c':
+                if (!parseColumns(optarg, &state)) {
+                    return 1;
+                }
+                break;
+            case OPT_HEADER:
+                state.header = true;
+                break;
+            case OPT_JSONL:
+                state.jsonl = true;
+                batch = true;
+                break;
+            case OPT_FIELD:
+                state.field = optarg;
+                break;
+            case OPT_UNIT_FIELD:
+                state.unit_field = optarg;
+                break;
+            case 'm':
+                state.mixed = true;
+                batch = true;
+                break;
+            case OPT_FROM:
+                from_name = optarg;
+                break;
+            case OPT_TO:
+                to_name = optarg;
+                break;
+            case OPT_SERVE:
+                socket_path = optarg;
+                break;
+            case 'u':
+                units_path = optarg;
+                break;
+            case OPT_COMPILE_UNITS:
+                compiled_path = optarg;
+                break;
+            case OPT_SI:
+                si = true;
+                break;
+            case OPT_EXACT:
+                state.exact = true;
+                break;
+            case OPT_STATS:
+                state.stats = true;
+                break;
+            case OPT_AGGREGATE:
+                if (!parseAggregates(optarg, &state)) {
+                    return 1;
+                }
+                break;
+            case OPT_IO:
+                if (strcasecmp(optarg, "auto") == 0) {
+                    state.io = IO_AUTO;
+                } else if (strcasecmp(optarg, "uring") == 0) {
+                    state.io = IO_URING;
+                } else if (strcasecmp(optarg, "thread") == 0) {
+                    state.io = IO_THREAD;
+                } else if (strcasecmp(optarg, "sync") == 0) {
+                    state.io = IO_SYNC;
+                } else {
+                    fprintf(stderr, "Invalid I/O mode '%s'. Use 'auto', 'uring', 'thread' or 'sync'.\n", optarg);
+                    return 1;
+                }
+                break;
             case 'h':
                 displayHelp();
                 return 0;
@@ -145,33 +252,247 @@ int main(int argc, char **argv) {
                 displayVersion();
                 return 0;
             case 's':
-                displayUnits();
-                return 0;
+                show = true;
+                break;
             default:
                 fprintf(stderr, "Use '-h, --help' for help.\n");
                 return 1;
         }
     }
 
+    // Load the unit definitions before anything looks a unit up
+    // kilobytes and the like are powers of 1024 unless --si makes them
+    // powers of 1000
+    if (si && units_path != NULL) {
+        fprintf(stderr, "unicon: --si cannot be combined with --units\n");
+        return 1;
+    }
+    registry = si ? unicon_registry_builtin_si() : unicon_registry_builtin();
+    if (units_path != NULL) {
+        UniconRegistry *loaded;
+        unsigned long line = 0;
+        int status = unicon_registry_load(units_path, &loaded, &line);
+        if (status == UNICON_EDEFS && line > 0) {
+            fprintf(stderr, "unicon: %s:%lu: %s\n", units_path, line, unicon_strerror(status));
+            return 1;
+        }
+        if (status != UNICON_OK) {
+            fprintf(stderr, "unicon: %s: %s\n", units_path, unicon_strerror(status));
+            return 1;
+        }
+        registry = loaded;
+    }
+    if (compiled_path != NULL) {
+        int status = unicon_registry_save(registry, compiled_path);
+        if (status != UNICON_OK) {
+            fprintf(stderr, "unicon: %s: %s\n", compiled_path, unicon_strerror(status));
+            return 1;
+        }
+        return 0;
+    }
+    if (show) {
+        displayUnits();
+        return 0;
+    }
+    state.registry = registry;
+
+    // The server takes its units from each request
+    if (socket_path != NULL) {
+        if (batch || optind != argc) {
+            printf("Invalid command format. --serve takes no values or units.\n");
+            return 1;
+        }
+        if (state.exact) {
+            printf("--exact cannot be combined with --serve.\n");
+            return 1;
+        }
+        return runServer(registry, socket_path, round_places, format == FORMAT_SHORTEST ? FORMAT_SHORTEST : FORMAT_FIXED,
+                         state.stats);
+    }
+
+    // JSON Lines input names the field to convert, and the field with each
+    // record's unit when the records name their own, which is then like
+    // mixed unit input
+    if (!state.jsonl && (state.field != NULL || state.unit_field != NULL)) {
+        printf("--field and --unit-field need --jsonl.\n");
+        return 1;
+    }
+    if (state.jsonl) {
+        if (state.field == NULL) {
+            printf("Please provide the field to convert with --field.\n");
+            return 1;
+        }
+        if (state.mixed || state.delimiter != 0 || recordSize(format) > 0) {
+            printf("JSON Lines input cannot be combined with --mixed, --csv, --tsv or a binary format.\n");
+            return 1;
+        }
+        state.mixed = (state.unit_field != NULL);
+    }
+
+    // Mixed unit input only names the target unit
+    if (state.mixed) {
+        if (state.delimiter != 0 || recordSize(format) > 0 || from_name != NULL) {
+            printf("Mixed unit input cannot be combined with --csv, --tsv, --from or a binary format.\n");
+            return 1;
+        }
+        if (to_name == NULL && optind + 2 == argc && strcasecmp(argv[optind], "to") == 0) {
+            to_name = argv[optind + 1];
+            optind += 2;
+        }
+        if (to_name == NULL || optind != argc) {
+            printf("Invalid command format. Please provide the target unit with 'to <UNIT>'.\n");
+            displayHelp();
+            return 1;
+        }
+        state.round_places = round_places;
+        state.format = format;
+        state.jobs = jobs;
+        if (!lookupTargets(to_name, &state)) {
+            return 1;
+        }
+        if (state.ntargets > 1) {
+            printf("Mixed unit and JSON Lines input take a single target unit.\n");
+            return 1;
+        }
+        state.from = state.targets[0].unit;
+        return runBatch(&state, input);
+    }
+
+    // The units can be given as options instead of "from U to U"
+    bool unit_options = (from_name != NULL || to_name != NULL);
+    if (unit_options && (from_name == NULL || to_name == NULL)) {
+        printf("Invalid command format. Please provide both --from and --to units.\n");
+        return 1;
+    }
+    int unit_args = unit_options ? 0 : 4;
+
+    // Delimited input needs the columns to convert
+    if (state.delimiter != 0 && state.ncolumns == 0) {
+        printf("Please provide the columns to convert with --column.\n");
+        return 1;
+    }
+    if (state.delimiter != 0 && (recordSize(format) > 0)) {
+        printf("Delimited input cannot be combined with a binary format.\n");
+        return 1;
+    }
+
+    // In batch mode the values come from the input, only the units are given
+    if (batch) {
+        state.round_places = round_places;
+        state.format = format;
+        state.jobs = jobs;
+        if (optind + unit_args != argc) {
+            printf("Invalid command format. Please provide the correct number of arguments.\n");
+            displayHelp();
+            return 1;
+        }
+        if (unit_options ? !lookupUnits(from_name, to_name, &state)
+                         : !findUnits(argc, argv, optind, &state)) {
+            return 1;
+        }
+        if (state.ntargets > 1 && (state.delimiter != 0 || state.jsonl || recordSize(format) > 0)) {
+            printf("Several target units need one value per line.\n");
+            return 1;
+        }
+        if (state.naggregates > 0 && state.delimiter != 0) {
+            printf("--aggregate cannot be combined with --csv or --tsv.\n");
+            return 1;
+        }
+        if (!compileTargets(&state, &failed, &error)) {
+            reportMismatch(&state, failed, &error);
+            return 1;
+        }
+        return runBatch(&state, input);
+    }
+
     // Check if there are enough arguments
-    if (optind + 5 != argc) {
+    if (state.naggregates > 0) {
+        printf("--aggregate needs --batch or --mixed input.\n");
+        return 1;
+    }
+    if (optind + 1 + unit_args != argc) {
         printf("Invalid command format. Please provide the correct number of arguments.\n");
         displayHelp();
         return 1;
     }
 
     // Extract the value to convert
-    if (!isNumeric(argv[optind])) {
+    double value;
+    const char *end = argv[optind] + strlen(argv[optind]);
+    if (unicon_parse_number(argv[optind], end, &value) != end) {
         printf("Invalid value provided. Please provide a valid numeric value.\n");
         return 1;
     }
 
-    double value = atof(argv[optind]);
+    // Find the matching units
+    if (unit_options ? !lookupUnits(from_name, to_name, &state)
+                     : !findUnits(argc, argv, optind + 1, &state)) {
+        return 1;
+    }
+    if (!compileTargets(&state, &failed, &error)) {
+        reportMismatch(&state, failed, &error);
+        return 1;
+    }
+
+    // Determine the number of decimal places for formatting
+    int decimal_places = (round_places >= 0) ? round_places : 2;
+
+    // Convert the value to each target and display the results with the
+    // appropriate decimal places. The line is put together here and written
+    // with a single write(2), so the one-shot path never sets up stdio.
+    size_t names_len = strlen(state.from.name);
+    for (size_t t = 0; t < state.ntargets; t++) {
+        names_len += strlen(state.targets[t].unit.name);
+    }
+    char stack_line[LINE_SIZE(LINE_PLACES_MAX, (BATCH_MAX_TARGETS + 1) * UNICON_EXPRESSION_MAX)];
+    size_t line_size = LINE_SIZE(decimal_places, names_len);
+    char *line = (line_size <= sizeof(stack_line)) ? stack_line : malloc(line_size);
+    if (line == NULL) {
+        perror("unicon");
+        return 1;
+    }
+    char *p = line;
+    p += formatNumber(p, UNICON_FORMAT_MAX(decimal_places), value, format, decimal_places);
+    p = appendText(p, " ", state.from.name, " =");
+    for (size_t t = 0; t < state.ntargets; t++) {
+        const Target *target = &state.targets[t];
+        double result = state.exact ? unicon_apply_exact(&target->exact_conv, value, round_places)
+                                    : unicon_apply_rounded(&target->conv, value, round_places);
+        p = appendText(p, t > 0 ? ", " : " ", "", "");
+        p += formatNumber(p, UNICON_FORMAT_MAX(decimal_places), result, format, decimal_places);
+        p = appendText(p, " ", target->unit.name, t + 1 < state.ntargets ? "" : "\n");
+    }
+    bool written = (write(STDOUT_FILENO, line, p - line) == p - line);
+    if (line != stack_line) {
+        free(line);
+    }
+    if (!written) {
+        perror("unicon: stdout");
+        return 1;
+    }
 
+    return 0;
+}
+
+// Function to copy three strings to p, returning the end of the copy
+static char *appendText(char *p, const char *a, const char *b, const char *c) {
+    size_t n = strlen(a);
+    memcpy(p, a, n);
+    p += n;
+    n = strlen(b);
+    memcpy(p, b, n);
+    p += n;
+    n = strlen(c);
+    memcpy(p, c, n);
+    return p + n;
+}
+
+// Function to find the "from" and "to" units in the arguments after start
+bool findUnits(int argc, char **argv, int start, Batch *state) {
     // Find the positions of "from" and "to" keywords
     int fromPos = -1;
     int toPos = -1;
-    for (int i = optind + 1; i < argc - 1; i++) {
+    for (int i = start; i < argc - 1; i++) {
         if (strcasecmp(argv[i], "from") == 0) {
             fromPos = i + 1;
         } else if (strcasecmp(argv[i], "to") == 0) {
@@ -183,174 +504,187 @@ int main(int argc, char **argv) {
     if (fromPos == -1 || toPos == -1) {
         printf("Invalid command format. Please provide both 'from' and 'to' units.\n");
         displayHelp();
-        return 1;
-    }
-
-    // Find the matching units
-    Unit from = matchArgument(argv[fromPos]);
-    Unit to = matchArgument(argv[toPos]);
-
-    // Check if both units are valid
-    if (from == -1 || to == -1) {
-        printf("Invalid units provided. Please provide valid units.\n");
-        displayHelp();
-        return 1;
+        return false;
     }
 
-    // Convert the value
-    double result;
-    if (from < to) {
-        result = convertUnit(value, from, to);
-    } else {
-        result = convertUnit(value, to, from);
-    }
-    
-    // Round the result if round_places is set
-    if (round_places >= 0) {
-        result = round(result * pow(10, round_places)) / pow(10, round_places);
-    }
-    
-    // Determine the number of decimal places for formatting
-    int decimal_places = (round_places >= 0) ? round_places : 2;
-    
-    // Display the result with the appropriate decimal places
-    printf("%.*f %s = %.*f %s\n", decimal_places, value, unit_table[from].name, decimal_places, result, unit_table[to].name);
-    
-    return 0;
+    return lookupUnits(argv[fromPos], argv[toPos], state);
 }
 
-// Function to check if a string is a valid number
-bool isNumeric(const char *str) {
-    if (str == NULL || str[0] == '\0') {
+// Function to find the units with the given names
+bool lookupUnits(const char *from_name, const char *to_names, Batch *state) {
+    // Find the matching units and check that both are valid
+    if (unicon_registry_parse_expression(registry, from_name, strlen(from_name), &state->from) != UNICON_OK) {
+        reportInvalidUnit(from_name, strlen(from_name));
         return false;
     }
-    int i = 0;
-    if (str[0] == '-' || str[0] == '+') {
-        i++;
-    }
-    int dotCount = 0;
-    int len = strlen(str);
-    for (; i < len; i++) {
-        if (!isdigit(str[i])) {
-            if (str[i] == '.' && dotCount == 0) {
-                dotCount++;
-            } else {
-                return false;
-            }
-        }
-    }
-    return true;
+    return lookupTargets(to_names, state);
 }
 
-// Function to convert a value from one unit to another
-double convertUnit(double value, Unit from, Unit to) {
-    if (from == to) {
-        return value;
-    }
-
-    // Temperatures need to be handled by formula
-    switch (from) {
-        case CELSIUS:
-            switch (to) {
-                case FAHRENHEIT:
-                    return (value * 9/5) + 32;
-                case KELVIN:
-                    return value + 273.15;
-                default:
-                    break;
-            }
-        case FAHRENHEIT:
-            switch (to) {
-                case CELSIUS:
-                    return (value - 32) * 5/9;
-                case KELVIN:
-                    return (value - 32) * 5/9 + 273.15;
-                default:
-                    break;
-            }
-        case KELVIN:
-            switch (to) {
-                case CELSIUS:
-                    return value - 273.15;
-                case FAHRENHEIT:
-                    return (value - 273.15) * 9/5 + 32;
-                default:
-                    break;
-            }
-        default:
-            if (unit_table[from].type != unit_table[to].type) {
-                printf("Cannot convert between different unit types.\n");
-                exit(1);
-            }
-            double factor = unit_table[from].conversion_factor / unit_table[to].conversion_factor;
-            return value * factor;
+// Function to find the target units of a comma separated list, such as
+// "kilobytes,megabytes", each of which gets its own result
+bool lookupTargets(const char *list, Batch *state) {
+    state->ntargets = 0;
+    for (const char *p = list;;) {
+        const char *end = strchr(p, ',');
+        size_t len = end ? (size_t)(end - p) : strlen(p);
+        if (state->ntargets == BATCH_MAX_TARGETS) {
+            printf("At most %d target units can be given.\n", BATCH_MAX_TARGETS);
+            return false;
+        }
+        if (unicon_registry_parse_expression(registry, p, len, &state->targets[state->ntargets].unit) != UNICON_OK) {
+            reportInvalidUnit(p, len);
+            return false;
+        }
+        state->ntargets++;
+        if (end == NULL) {
+            return true;
+        }
+        p = end + 1;
     }
 }
-
-// Function to match an argument to a unit
-Unit matchArgument(const char *arg) {
-    for (int i = 0; i < sizeof(unit_table) / sizeof(unit_table[0]); i++) {
-        if (strcasecmp(arg, unit_table[i].name) == 0) {
-            return unit_table[i].unit;
+// Function to add a comma separated list of 1-based column numbers to the
+// columns to convert, keeping them sorted and unique
+bool parseColumns(const char *list, Batch *state) {
+    const char *p = list;
+    for (;;) {
+        char *end;
+        long column = strtol(p, &end, 10);
+        if (end == p || column <= 0 || column > 1000000 || (*end != ',' && *end != '\0')) {
+            fprintf(stderr, "Invalid column list '%s'. Use column numbers from 1, such as '2' or '2,5'.\n", list);
+            return false;
+        }
+        size_t i = 0;
+        while (i < state->ncolumns && state->columns[i] < column) {
+            i++;
         }
+        if (i == state->ncolumns || state->columns[i] != column) {
+            if (state->ncolumns == BATCH_MAX_COLUMNS) {
+                fprintf(stderr, "At most %d columns can be converted.\n", BATCH_MAX_COLUMNS);
+                return false;
+            }
+            memmove(&state->columns[i + 1], &state->columns[i], (state->ncolumns - i) * sizeof(state->columns[0]));
+            state->columns[i] = (int)column;
+            state->ncolumns++;
+        }
+        if (*end == '\0') {
+            return true;
+        }
+        p = end + 1;
     }
-    return -1;
 }
 
 // Function to display the help message
 void displayHelp() {
     printf("Usage: unicon [OPTIONS] VALUE from <UNIT> to <UNIT>\n");
-    printf("Convert between various units.\n\n");
+    printf("   or: unicon [OPTIONS] --batch from <UNIT> to <UNIT> < VALUES\n");
+    printf("   or: unicon [OPTIONS] --mixed to <UNIT> < VALUES_WITH_UNITS\n");
+    printf("   or: unicon [OPTIONS] --csv --column N --from <UNIT> --to <UNIT> < TABLE\n");
+    printf("   or: unicon [OPTIONS] --jsonl --field F [--unit-field U] [--from <UNIT>] --to <UNIT> < RECORDS\n");
+    printf("   or: unicon [OPTIONS] --serve SOCKET\n");
+    printf("Convert between various units.\n");
+    printf("A unit may be an expression of units and powers, such as 'kilometers/hour' or 'meters/second^2'.\n\n");
     printf("Options:\n");
     printf("\t-r, --round=PLACES   Round the result to the specified number of decimal places.\n");
+    printf("\t-b, --batch, --stdin  Read values from stdin, one per line, and convert each.\n");
+    printf("\t-i, --input=FILE     Read batch input from FILE instead of stdin.\n");
+    printf("\t-j, --jobs=N         Convert batch input on N threads, 0 for one per CPU.\n");
+    printf("\t    --io=MODE        Overlap batch I/O with the conversion using 'uring', a read-ahead\n");
+    printf("\t                     'thread', or neither with 'sync'. 'auto' (default) picks uring if it can.\n");
+    printf("\t-f, --format=FORMAT  Print numbers as 'fixed' decimals (default) or the 'shortest' exact form.\n");
+    printf("\t                     'f64le' and 'f32le' read and write packed binary doubles or floats,\n");
+    printf("\t                     'u64le' unsigned 64-bit counts converted exactly, rounding down.\n");
+    printf("\t-m, --mixed          Read a value and its unit per line, such as '12.5 kilometers'.\n");
+    printf("\t    --csv, --tsv     Read comma or tab separated lines and convert the given columns.\n");
+    printf("\t-c, --column=N[,N]   Convert column N of delimited input, counting from 1.\n");
+    printf("\t    --header         Copy the first line of delimited input through unchanged.\n");
+    printf("\t    --jsonl          Read JSON Lines objects and convert the number in one field.\n");
+    printf("\t    --field=NAME     The field of each object to convert.\n");
+    printf("\t    --unit-field=NAME  The field naming each object's unit, rewritten to the target.\n");
+    printf("\t    --from=UNIT, --to=UNIT  Give the units as options instead of 'from U to U'.\n");
+    printf("\t                     Several target units can be given as 'U1,U2,U3'.\n");
+    printf("\t    --serve=SOCKET   Answer 'VALUE FROM TO' request lines on a Unix socket.\n");
+    printf("\t    --aggregate=LIST Print only the sum, min, max, mean and/or count of the batch results.\n");
+    printf("\t    --stats          Print counters and sampled stage latencies on stderr at the end.\n");
+    printf("\t    --exact          Convert in long double precision, rounding to double once.\n");
+    printf("\t    --si             Make kilobytes to exabytes powers of 1000 instead of 1024.\n");
+    printf("\t-u, --units=FILE     Add the unit definitions in FILE, or use a compiled registry.\n");
+    printf("\t    --compile-units=OUT  Write the units in the compiled form to OUT and exit.\n");
     printf("\t-s, --show           Show the full table of supported units.\n");
     printf("\t-h, --help           Display this help message and exit.\n");
     printf("\t-v, --version        Display version information and exit.\n");
 }
 
+// Function to report a unit expression that is not valid, naming the
+// closest known unit to the first of its units that is not one
+static void reportInvalidUnit(const char *text, size_t len) {
+    printf("Invalid units provided. Please provide valid units.\n");
+    const char *end = text + len;
+    bool power = false;
+    for (const char *p = text; p < end; p++) {
+        const char *stop = p;
+        while (stop < end && *stop != '*' && *stop != '/' && *stop != '^') {
+            stop++;
+        }
+        char name[UNICON_EXPRESSION_MAX];
+        UniconExpression expr;
+        const char *suggestion;
+        if (!power && (size_t)(stop - p) < sizeof(name) &&
+            unicon_registry_parse_expression(registry, p, stop - p, &expr) == UNICON_EUNIT) {
+            memcpy(name, p, stop - p);
+            name[stop - p] = '\0';
+            if (unicon_registry_suggest(registry, name, &suggestion) == UNICON_OK) {
+                printf("Unknown unit '%s', did you mean '%s'?\n", name, suggestion);
+            }
+            break;
+        }
+        power = stop < end && *stop == '^';
+        p = stop;
+    }
+    displayHelp();
+}
+
+// Function to report a target unit that measures something else than the
+// source unit, saying what each of them measures
+static void reportMismatch(const Batch *state, size_t target, const UniconCheckError *error) {
+    if (error->status != UNICON_ETYPE) {
+        printf("%s.\n", unicon_strerror(error->status));
+        return;
+    }
+    const UniconExpression *to = &state->targets[target].unit;
+    char from_text[256], to_text[256];
+    unicon_expression_describe(registry, &state->from, from_text, sizeof(from_text));
+    unicon_expression_describe(registry, to, to_text, sizeof(to_text));
+    printf("Cannot convert between different unit types: %s measures %s, %s measures %s.\n",
+           state->from.name, from_text, to->name, to_text);
+}
+
+// Function to display every unit of the registry, grouped by type
 void displayUnits() {
     printf("Supported units:\n");
-    printf("TEMPERATURE:\n");
-    printf("\t- Celsius\n");
-    printf("\t- Fahrenheit\n");
-    printf("\t- Kelvin\n");
-    printf("LENGTH:\n");
-    printf("\t- Millimeters\n");
-    printf("\t- Centimeters\n");
-    printf("\t- Decimeters\n");
-    printf("\t- Meters\n");
-    printf("\t- Decameters\n");
-    printf("\t- Hectometers\n");
-    printf("\t- Kilometers\n");
-    printf("\t- Miles\n");
-    printf("\t- Inches\n");
-    printf("\t- Feet\n");
-    printf("TIME:\n");
-    printf("\t- Milliseconds\n");
-    printf("\t- Seconds\n");
-    printf("\t- Minutes\n");
-    printf("\t- Hours\n");
-    printf("\t- Days\n");
-    printf("\t- Months\n");
-    printf("\t- Years\n");
-    printf("MASS:\n");
-    printf("\t- Milligrams\n");
-    printf("\t- Centigrams\n");
-    printf("\t- Decigrams\n");
-    printf("\t- Grams\n");
-    printf("\t- Decagrams\n");
-    printf("\t- Hectograms\n");
-    printf("\t- Kilograms\n");
-    printf("\t- Pounds\n");
-    printf("\t- Ounces\n");
-    printf("DIGITAL STORAGE:\n");
-    printf("\t- Bytes\n");
-    printf("\t- Kilobytes\n");
-    printf("\t- Megabytes\n");
-    printf("\t- Gigabytes\n");
-    printf("\t- Terabytes\n");
-    printf("\t- Petabytes\n");
-    printf("\t- Exabytes\n");
+    for (size_t type = 0; type < unicon_registry_types(registry); type++) {
+        // Type names are written like "digital_storage"
+        for (const char *p = unicon_registry_type_name(registry, type); *p; p++) {
+            putchar(*p == '_' ? ' ' : toupper((unsigned char)*p));
+        }
+        printf(":\n");
+        for (size_t unit = 0; unit < unicon_registry_units(registry); unit++) {
+            if (unicon_registry_unit_type(registry, unit) == (int)type) {
+                const char *name = unicon_registry_unit_name(registry, unit);
+                printf("\t- %c%s", toupper((unsigned char)name[0]), name + 1);
+                // Followed by its aliases, which come after all units
+                const char *separator = " (";
+                for (size_t key = unicon_registry_units(registry); key < unicon_registry_keys(registry); key++) {
+                    Unit target;
+                    const char *alias = unicon_registry_key_name(registry, key, &target);
+                    if (target == unit) {
+                        printf("%s%s", separator, alias);
+                        separator = ", ";
+                    }
+                }
+                printf("%s\n", separator[0] == ',' ? ")" : "");
+            }
+        }
+    }
 }
 
 // Function to display the version information
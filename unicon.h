@@ -0,0 +1,318 @@
+/* 
+ * unicon.h
+ *
+ * Copyright 2024 Clay Gomera
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-only
+ */
+
+// Public interface of libunicon, the conversion engine behind unicon.
+//
+// The library keeps no mutable global state, never prints and never exits,
+// so every function is safe to call from any thread. Errors come back as
+// negative UniconStatus codes.
+
+#ifndef UNICON_H
+#define UNICON_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Enumeration for each unit type
+typedef enum {
+#define UNIT_TYPE(id, name) id,
+#include "units.def"
+    // Number of built-in unit types
+    NUNIT_TYPES
+} UnitType;
+
+// Enumeration for each built-in unit. Units loaded from definitions files
+// are numbered on from NUNITS.
+typedef enum {
+#define UNIT(id, type, name, num, den, offset_num, offset_den) id,
+#include "units.def"
+    // Number of built-in units
+    NUNITS
+} Unit;
+
+// Struct for a conversion between two units, resolved once per unit pair
+typedef struct _Conversion {
+    double scale;
+    double offset;
+} Conversion;
+
+// Struct for a conversion in extended precision, for --exact
+typedef struct _ExactConversion {
+    long double scale;
+    long double offset;
+} ExactConversion;
+
+// Struct for a conversion of whole counts, such as bytes to kibibytes: x
+// of one unit is x * num / den of the other, and the kind says whether
+// that is a shift, a multiply or a divide by a reciprocal. Compiled by
+// unicon_compile_integer(), the fields are only read by the library.
+typedef struct _IntegerConversion {
+    uint64_t num;
+    uint64_t den;
+    int kind;
+    int shift;
+    uint64_t magic;
+    uint64_t limit;
+} IntegerConversion;
+
+// Status codes returned by the library
+typedef enum {
+    UNICON_OK = 0,
+    UNICON_EUNIT = -1,  // Not a known unit
+    UNICON_ETYPE = -2,  // The units measure different things
+    UNICON_EVALUE = -3, // Not a valid number
+    UNICON_EIO = -4,    // A file could not be read or written
+    UNICON_EDEFS = -5,  // Unit definitions that do not parse or clash
+    UNICON_ENOMEM = -6, // Out of memory
+    UNICON_EEXPR = -7,     // A unit expression that does not parse
+    UNICON_EINEXACT = -8,  // No exact conversion between whole counts of two units
+    UNICON_ERANGE = -9     // A result too large for its type
+} UniconStatus;
+
+// A set of units: their names and aliases, types, factors and offsets.
+// Registries never change once loaded, so they can be shared by threads.
+typedef struct _UniconRegistry UniconRegistry;
+
+// Longest unit expression, such as "kilometers/hours", with its terminator
+#define UNICON_EXPRESSION_MAX 64
+
+// Most unit types one expression can combine
+#define UNICON_MAX_DIMENSIONS 32
+
+// Struct for a unit expression such as "megabytes/second" or "meters^2",
+// reduced to the power of each unit type it measures and one scale from
+// the base units of those types: a value in base units times scale is the
+// value in the expression. Only a single plain unit keeps an offset, in
+// products and quotients units just scale, so "celsius/hours" is a rate.
+typedef struct _UniconExpression {
+    long double scale;
+    long double offset;
+    // The unit a single plain unit names, or -1
+    int unit;
+    // The type of an expression measuring one type to the first power,
+    // such as "kilobits", or -1
+    int type;
+    int8_t dimensions[UNICON_MAX_DIMENSIONS];
+    // The unit's own name for a single plain unit, else the expression
+    // lower cased and without spaces
+    char name[UNICON_EXPRESSION_MAX];
+} UniconExpression;
+
+// Struct for why two expressions cannot be converted into each other: the
+// status and, for UNICON_ETYPE, the first unit type the two measure to
+// different powers, with both powers. Kilometers/hour to kilograms gives
+// length, 1 and 0.
+typedef struct _UniconCheckError {
+    int status;
+    int type;
+    int from_power;
+    int to_power;
+} UniconCheckError;
+
+// A cache of parsed expressions that keeps the most recently used ones
+typedef struct _UniconExpressionCache UniconExpressionCache;
+
+// Size of a buffer that holds any number formatted with places decimals
+#define UNICON_FORMAT_MAX(places) (320 + (size_t)((places) > 0 ? (places) : 0))
+
+// Function to describe a status code
+const char *unicon_strerror(int status);
+
+// Functions to describe a unit, NULL and -1 for units that do not exist
+const char *unicon_unit_name(Unit unit);
+int unicon_unit_type(Unit unit);
+
+// Function to find a unit by name, ignoring case
+int unicon_lookup(const char *name, Unit *unit);
+
+// Function to resolve the conversion between two units once, so each value
+// then costs a single multiply-add
+int unicon_compile(Unit from, Unit to, Conversion *conv);
+
+// Function to resolve a conversion in long double precision. Between
+// built-in units both the scale and the offset are their exact values
+// rounded once.
+int unicon_compile_exact(Unit from, Unit to, ExactConversion *conv);
+
+// Function to get the registry of the built-in units, which the functions
+// above work on
+const UniconRegistry *unicon_registry_builtin(void);
+
+// Function to get the built-in units with kilobytes to exabytes as powers
+// of ten, "kb" being 1000 bytes. The default registry keeps them powers of
+// 1024 like the kibibytes to exbibytes both registries have.
+const UniconRegistry *unicon_registry_builtin_si(void);
+
+// Function to load a registry from a file. A compiled registry written by
+// unicon_registry_save() is mapped as is, anything else is read as unit
+// definitions added to the built-in units. On UNICON_EDEFS the number of
+// the offending line is stored in error_line when it is not NULL.
+int unicon_registry_load(const char *path, UniconRegistry **registry, unsigned long *error_line);
+
+// Function to write a registry in the compiled form, which
+// unicon_registry_load() maps with no parsing or hashing
+int unicon_registry_save(const UniconRegistry *registry, const char *path);
+
+// Function to release a registry from unicon_registry_load()
+void unicon_registry_free(UniconRegistry *registry);
+
+// Functions to list the units and types of a registry, and to describe
+// them. Out of range units and types give NULL and -1.
+size_t unicon_registry_units(const UniconRegistry *registry);
+size_t unicon_registry_types(const UniconRegistry *registry);
+const char *unicon_registry_unit_name(const UniconRegistry *registry, Unit unit);
+int unicon_registry_unit_type(const UniconRegistry *registry, Unit unit);
+const char *unicon_registry_type_name(const UniconRegistry *registry, int type);
+
+// Functions to list every name a registry knows, the unit names followed
+// by the aliases such as "km" or "kilometer". key_name() stores the unit
+// a name stands for in unit when it is not NULL.
+size_t unicon_registry_keys(const UniconRegistry *registry);
+const char *unicon_registry_key_name(const UniconRegistry *registry, size_t key, Unit *unit);
+
+// Functions to find a unit by name or alias and to compile a conversion,
+// like unicon_lookup() and unicon_compile() on another registry
+int unicon_registry_lookup(const UniconRegistry *registry, const char *name, Unit *unit);
+int unicon_registry_compile(const UniconRegistry *registry, Unit from, Unit to, Conversion *conv);
+int unicon_registry_compile_exact(const UniconRegistry *registry, Unit from, Unit to, ExactConversion *conv);
+
+// Functions to compile a conversion of whole counts, which needs both units
+// to be exact fractions of their base unit with no offset, as the storage
+// units are. UNICON_EINEXACT means the conversion has no such form.
+int unicon_compile_integer(Unit from, Unit to, IntegerConversion *conv);
+int unicon_registry_compile_integer(const UniconRegistry *registry, Unit from, Unit to, IntegerConversion *conv);
+
+// Function to find the name or alias closest to one that is not in the
+// registry, such as "kilometers" for "kilometrs", to suggest in its place.
+// Only names a few edits away count, UNICON_EUNIT means there is none.
+// Meant for after a lookup failed, the first call indexes the names.
+int unicon_registry_suggest(const UniconRegistry *registry, const char *name, const char **suggestion);
+
+// Function to parse a unit expression of len bytes. Units are combined
+// with '*' and '/', each '/' dividing by the one unit after it, and raised
+// to integer powers with '^', as in "meters^2/seconds". A unit name
+// missing from the registry may be an SI prefix, from "pico" to "exa",
+// before one that is, like "gigabits", or lack the plural 's'.
+int unicon_registry_parse_expression(const UniconRegistry *registry, const char *text, size_t len,
+                                     UniconExpression *expr);
+
+// Function to check that two expressions measure the same powers of the
+// same types, the one check converting between them needs. Callers that
+// check once before a run can then compile and apply without failing.
+// error, when not NULL, says what differs.
+int unicon_expression_check(const UniconExpression *from, const UniconExpression *to, UniconCheckError *error);
+
+// Function to write what an expression measures, such as "length/time^2",
+// or "dimensionless". Returns the length like snprintf().
+size_t unicon_expression_describe(const UniconRegistry *registry, const UniconExpression *expr, char *buf,
+                                  size_t size);
+
+// Functions to compile the conversion between two expressions, which
+// must pass unicon_expression_check(). Between two plain units these are
+// unicon_registry_compile() and _compile_exact().
+int unicon_expression_compile(const UniconRegistry *registry, const UniconExpression *from,
+                              const UniconExpression *to, Conversion *conv);
+int unicon_expression_compile_exact(const UniconRegistry *registry, const UniconExpression *from,
+                                    const UniconExpression *to, ExactConversion *conv);
+
+// Functions to create and release a cache of up to capacity expressions.
+// A cache is not thread safe, give each thread its own.
+UniconExpressionCache *unicon_expression_cache_new(const UniconRegistry *registry, size_t capacity);
+void unicon_expression_cache_free(UniconExpressionCache *cache);
+
+// Function to get the parsed form of an expression, keyed by its lower
+// cased text without spaces, so a repeated expression costs one hash
+// lookup. On a miss it is parsed and replaces the least recently used
+// one. expr stays valid until the next lookup.
+int unicon_expression_cache_lookup(UniconExpressionCache *cache, const char *text, size_t len,
+                                   const UniconExpression **expr);
+
+// Function to apply a compiled conversion, a single multiply-add
+static inline double unicon_apply(const Conversion *conv, double value) {
+    return value * conv->scale + conv->offset;
+}
+
+// Function to round a value to round_places decimals, the rounding every
+// function below applies. The value is multiplied by 10^round_places,
+// exact up to 22 places, rounded to an integer with halfway cases away
+// from zero and divided back, so 0.125 rounds to 0.13 and -0.125 to -0.13.
+// Ties are those of the scaled binary value: 2.675 is stored just below
+// 2.675, yet 2.675 * 100 rounds up to exactly 267.5 and 2.68 comes out,
+// while 1.005 * 100 stays below 100.5 and gives 1.
+// A negative round_places leaves the value unrounded.
+double unicon_round(double value, int round_places);
+
+// Function to apply a compiled conversion and round the result to
+// round_places decimals like unicon_round()
+double unicon_apply_rounded(const Conversion *conv, double value, int round_places);
+
+// Function to apply a compiled conversion to an array with the widest SIMD
+// kernel the CPU supports, bit for bit equal to unicon_apply_rounded()
+void unicon_apply_array(const Conversion *conv, const double *in, double *out, size_t n, int round_places);
+
+// Function to apply a compiled conversion to an array of floats, computing
+// in single precision throughout. in and out may be the same array, which
+// holds for unicon_apply_array() too.
+void unicon_apply_array_f32(const Conversion *conv, const float *in, float *out, size_t n, int round_places);
+
+// Functions to apply a conversion in long double precision and round the
+// result like unicon_apply_rounded(), so each value is rounded to double
+// only once, at the end. There are no SIMD kernels for these.
+double unicon_apply_exact(const ExactConversion *conv, double value, int round_places);
+void unicon_apply_array_exact(const ExactConversion *conv, const double *in, double *out, size_t n, int round_places);
+
+// Function to convert an array of values from one unit to another
+int unicon_convert_array(const double *in, double *out, size_t n, Unit from, Unit to);
+
+// Functions to convert whole counts exactly, rounding down. remainder, which
+// may be NULL, gets what is left over in 1/den of the target unit, so
+// 1500 bytes are 1 kibibyte and 476 of 1024. A result past UINT64_MAX is
+// UINT64_MAX with no remainder: the single form returns UNICON_ERANGE and
+// the array form the number of such values. The array form has SIMD
+// kernels for the conversions that are shifts.
+int unicon_apply_integer(const IntegerConversion *conv, uint64_t value, uint64_t *quotient, uint64_t *remainder);
+size_t unicon_apply_integer_array(const IntegerConversion *conv, const uint64_t *in, uint64_t *quotient,
+                                  uint64_t *remainder, size_t n);
+
+// Function to convert a single value by the unit formulas, the reference
+// the compiled conversions are checked against
+int unicon_convert(double value, Unit from, Unit to, double *result);
+
+// Function to validate and parse a number in [str, end) in a single pass.
+// Returns the end of the number, or NULL when there are no digits.
+const char *unicon_parse_number(const char *str, const char *end, double *value);
+
+// Functions to format a number into a caller owned buffer, returning the
+// length like snprintf(). unicon_format_fixed() prints exactly what
+// printf("%.*f") does, unicon_format_shortest() the shortest text that
+// reads back as the same value.
+size_t unicon_format_fixed(char *buf, size_t size, double value, int places);
+size_t unicon_format_shortest(char *buf, size_t size, double value);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,52 @@
+/* 
+ * unicon_private.h
+ *
+ * Copyright 2024 Clay Gomera
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-only
+ */
+
+// Internals of libunicon shared with the benchmarks, not part of the API
+
+#ifndef UNICON_PRIVATE_H
+#define UNICON_PRIVATE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "unicon.h"
+
+// Struct for a perfect hash over unit names, keys are compared ignoring case
+//
+// A name hashes to a bucket, and the bucket's displacement places each of
+// its names in a slot of its own, so a lookup is one hash and one compare.
+typedef struct _UnitIndex {
+    const char *const *keys;
+    size_t count;
+    uint32_t bucket_mask;
+    uint32_t slot_mask;
+    uint32_t *displacement;
+    int32_t *slots;
+} UnitIndex;
+
+// Sizes of the index over the built-in unit names, powers of two
+#define UNIT_INDEX_BUCKETS 64
+#define UNIT_INDEX_SLOTS 512
+
+bool buildUnitIndex(UnitIndex *index, const char *const *keys, size_t count, uint32_t *displacement, size_t buckets, int32_t *slots, size_t nslots);
+int lookupUnitIndex(const UnitIndex *index, const char *name);
+
+#endif
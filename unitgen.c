@@ -0,0 +1,249 @@
+/* 
+ * unitgen.c
+ *
+ * Copyright 2024 Clay Gomera
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-only
+ */
+
+// Generator of unicon_pairs.h, the conversions between every pair of
+// built-in units of the same type folded into constants at build time.
+//
+// units.def defines every unit by exact rationals, so the scale and offset
+// of each pair are worked out exactly here and only then rounded, once, to
+// the nearest double and long double. They are written as hex float
+// literals, which the compiler reads back without any further rounding.
+
+#include <float.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "unicon.h"
+
+// Struct for a built-in unit, straight from units.def
+typedef struct _GenUnit {
+    const char *name;
+    int type;
+    unsigned long long num;
+    unsigned long long den;
+    long long offset_num;
+    unsigned long long offset_den;
+} GenUnit;
+
+static const GenUnit units[] = {
+#define UNIT(id, type, name, num, den, offset_num, offset_den) \
+    {name, type, num, den, offset_num, offset_den},
+#include "units.def"
+};
+
+// Struct for an exact rational, always in lowest terms with den > 0
+typedef struct _Rational {
+    __int128 num;
+    __int128 den;
+} Rational;
+
+// Function to give up on a rational that outgrows 128 bits, which only a
+// new unit with huge terms can cause
+static void overflow(void) {
+    fprintf(stderr, "unitgen: a conversion in units.def overflows 128 bits\n");
+    exit(1);
+}
+
+static __int128 gcd(__int128 a, __int128 b) {
+    if (a < 0) {
+        a = -a;
+    }
+    while (b != 0) {
+        __int128 t = a % b;
+        a = b;
+        b = t;
+    }
+    return a;
+}
+
+static Rational makeRational(__int128 num, __int128 den) {
+    if (den < 0) {
+        num = -num;
+        den = -den;
+    }
+    __int128 g = gcd(num, den);
+    Rational r = {num / g, den / g};
+    return r;
+}
+
+static Rational multiply(Rational a, Rational b) {
+    // Cross-reduce first so the products stay as small as they can
+    __int128 g1 = gcd(a.num, b.den), g2 = gcd(b.num, a.den);
+    __int128 num, den;
+    if (__builtin_mul_overflow(a.num / g1, b.num / g2, &num) ||
+        __builtin_mul_overflow(a.den / g2, b.den / g1, &den)) {
+        overflow();
+    }
+    return makeRational(num, den);
+}
+
+static Rational invert(Rational a) {
+    return makeRational(a.den, a.num);
+}
+
+static Rational subtract(Rational a, Rational b) {
+    __int128 g = gcd(a.den, b.den);
+    __int128 x, y, num, den;
+    if (__builtin_mul_overflow(a.num, b.den / g, &x) || __builtin_mul_overflow(b.num, a.den / g, &y) ||
+        __builtin_sub_overflow(x, y, &num) || __builtin_mul_overflow(a.den, b.den / g, &den)) {
+        overflow();
+    }
+    return makeRational(num, den);
+}
+
+// Function to round a rational to the nearest number with bits significant
+// bits, halfway cases to even, by long division one bit at a time. The
+// result is mantissa * 2^exponent, and it fits every floating point type
+// with at least bits bits exactly.
+static void roundRational(Rational r, int bits, unsigned __int128 *mantissa, int *exponent, int *negative) {
+    unsigned __int128 num = (unsigned __int128)(r.num < 0 ? -r.num : r.num);
+    unsigned __int128 den = (unsigned __int128)r.den;
+    *negative = r.num < 0;
+    *mantissa = 0;
+    *exponent = 0;
+    if (num == 0) {
+        return;
+    }
+
+    // The integer part gives the leading bits, the remainder the rest
+    unsigned __int128 q = num / den, rem = num % den;
+    int exp = 0, sticky = 0;
+    while (q >> (bits + 1)) {
+        // More integer bits than needed: shift them off into the sticky bit
+        sticky |= (int)(q & 1);
+        q >>= 1;
+        exp++;
+    }
+    // Take fraction bits until there is one guard bit beyond bits
+    while ((q >> bits) == 0) {
+        rem <<= 1;
+        q <<= 1;
+        if (rem >= den) {
+            q |= 1;
+            rem -= den;
+        }
+        exp--;
+    }
+    sticky |= rem != 0;
+
+    // q holds bits + 1 bits: round off the guard bit
+    unsigned __int128 guard = q & 1;
+    q >>= 1;
+    exp++;
+    if (guard && (sticky || (q & 1))) {
+        q++;
+        if (q >> bits) {
+            q >>= 1;
+            exp++;
+        }
+    }
+    *mantissa = q;
+    *exponent = exp;
+}
+
+static double toDouble(Rational r) {
+    unsigned __int128 mantissa;
+    int exponent, negative;
+    roundRational(r, DBL_MANT_DIG, &mantissa, &exponent, &negative);
+    double d = ldexp((double)mantissa, exponent);
+    return negative ? -d : d;
+}
+
+static long double toLongDouble(Rational r) {
+    unsigned __int128 mantissa;
+    int exponent, negative;
+    roundRational(r, LDBL_MANT_DIG, &mantissa, &exponent, &negative);
+    long double d = ldexpl((long double)mantissa, exponent);
+    return negative ? -d : d;
+}
+
+// Function to fold the conversion between two units exactly. A value v in
+// from is v * from_num/from_den - from_offset * from_num/from_den in the
+// base unit, so the scale is from_num/from_den * to_den/to_num and the
+// offset to_offset - from_offset * scale.
+static void foldPair(const GenUnit *from, const GenUnit *to, Rational *scale, Rational *offset) {
+    Rational from_size = makeRational(from->num, from->den);
+    Rational to_size = makeRational(to->num, to->den);
+    *scale = multiply(from_size, invert(to_size));
+    *offset = subtract(makeRational(to->offset_num, to->offset_den),
+                       multiply(makeRational(from->offset_num, from->offset_den), *scale));
+}
+
+int main(void) {
+    printf("// Generated by unitgen from units.def, do not edit.\n");
+    printf("//\n");
+    printf("// unicon_<from>_to_<to>() converts between two built-in units of the\n");
+    printf("// same type with constant scale and offset, each the exact value\n");
+    printf("// rounded to the nearest double, the same as unicon_apply() on the\n");
+    printf("// conversion unicon_compile() gives. Built with contraction enabled\n");
+    printf("// each one is a single FMA, which rounds once and can then differ in\n");
+    printf("// the last bit.\n");
+    printf("//\n");
+    printf("// unicon_pairs[from * NUNITS + to] holds the same conversions for any\n");
+    printf("// pair, with NaN scale and offset for units of different types, and\n");
+    printf("// unicon_pairs_exact[] the scales and offsets rounded to long double.\n\n");
+    printf("#ifndef UNICON_PAIRS_H\n#define UNICON_PAIRS_H\n\n");
+    printf("#include <math.h>\n\n#include \"unicon.h\"\n\n");
+
+    for (int from = 0; from < NUNITS; from++) {
+        for (int to = 0; to < NUNITS; to++) {
+            if (units[from].type != units[to].type) {
+                continue;
+            }
+            Rational scale, offset;
+            foldPair(&units[from], &units[to], &scale, &offset);
+            printf("static inline double unicon_%s_to_%s(double value) {\n", units[from].name, units[to].name);
+            printf("    return value * %a + %a;\n}\n\n", toDouble(scale), toDouble(offset));
+        }
+    }
+
+    printf("static const Conversion unicon_pairs[NUNITS * NUNITS] = {\n");
+    for (int from = 0; from < NUNITS; from++) {
+        for (int to = 0; to < NUNITS; to++) {
+            if (units[from].type != units[to].type) {
+                printf("    {NAN, NAN},\n");
+                continue;
+            }
+            Rational scale, offset;
+            foldPair(&units[from], &units[to], &scale, &offset);
+            printf("    {%a, %a}, // %s to %s\n", toDouble(scale), toDouble(offset), units[from].name,
+                   units[to].name);
+        }
+    }
+    printf("};\n\n");
+
+    printf("static const ExactConversion unicon_pairs_exact[NUNITS * NUNITS] = {\n");
+    for (int from = 0; from < NUNITS; from++) {
+        for (int to = 0; to < NUNITS; to++) {
+            if (units[from].type != units[to].type) {
+                printf("    {NAN, NAN},\n");
+                continue;
+            }
+            Rational scale, offset;
+            foldPair(&units[from], &units[to], &scale, &offset);
+            printf("    {%LaL, %LaL}, // %s to %s\n", toLongDouble(scale), toLongDouble(offset), units[from].name,
+                   units[to].name);
+        }
+    }
+    printf("};\n\n#endif\n");
+    return ferror(stdout) ? 1 : 0;
+}
@@ -0,0 +1,185 @@
+/* 
+ * uring.c
+ *
+ * Copyright 2024 Clay Gomera
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-only
+ */
+
+#include <errno.h>
+#include <string.h>
+
+#include "uring.h"
+
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// The kernel and this process share the ring indexes, so they are read
+// with acquire and written with release ordering
+#define loadAcquire(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define storeRelease(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+
+static int uringEnter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+// Function to set up a ring and map its shared memory
+bool uringInit(Uring *ring, unsigned entries) {
+    memset(ring, 0, sizeof(*ring));
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    ring->fd = (int)syscall(__NR_io_uring_setup, entries, &params);
+    if (ring->fd < 0) {
+        return false;
+    }
+    ring->entries = params.sq_entries;
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd,
+                         IORING_OFF_SQ_RING);
+    ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd,
+                         IORING_OFF_CQ_RING);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd,
+                      IORING_OFF_SQES);
+    if (ring->sq_ring == MAP_FAILED || ring->cq_ring == MAP_FAILED || ring->sqes == MAP_FAILED) {
+        uringFree(ring);
+        return false;
+    }
+    char *sq = ring->sq_ring, *cq = ring->cq_ring;
+    ring->sq_head = (unsigned *)(sq + params.sq_off.head);
+    ring->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)(sq + params.sq_off.array);
+    ring->cq_head = (unsigned *)(cq + params.cq_off.head);
+    ring->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+    ring->cqes = cq + params.cq_off.cqes;
+    return true;
+}
+
+// Function to unmap and close a ring
+void uringFree(Uring *ring) {
+    if (ring->sqes != NULL && ring->sqes != MAP_FAILED) {
+        munmap(ring->sqes, ring->sqes_size);
+    }
+    if (ring->cq_ring != NULL && ring->cq_ring != MAP_FAILED) {
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    }
+    if (ring->sq_ring != NULL && ring->sq_ring != MAP_FAILED) {
+        munmap(ring->sq_ring, ring->sq_ring_size);
+    }
+    if (ring->fd >= 0) {
+        close(ring->fd);
+    }
+    memset(ring, 0, sizeof(*ring));
+    ring->fd = -1;
+}
+
+// Function to queue one request and hand it to the kernel
+static bool uringSubmit(Uring *ring, int op, int fd, const void *buf, size_t len, uint64_t user_data) {
+    if (ring->inflight == ring->entries) {
+        return false;
+    }
+    unsigned tail = *ring->sq_tail;
+    unsigned index = tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = (struct io_uring_sqe *)ring->sqes + index;
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = (uint8_t)op;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)buf;
+    sqe->len = (uint32_t)(len < 0x7ffff000 ? len : 0x7ffff000);
+    // An offset of -1 reads or writes at the file position and moves it,
+    // like read(2) and write(2), and works for pipes too
+    sqe->off = (uint64_t)-1;
+    sqe->user_data = user_data;
+    ring->sq_array[index] = index;
+    storeRelease(ring->sq_tail, tail + 1);
+
+    int submitted;
+    do {
+        submitted = uringEnter(ring->fd, 1, 0, 0);
+    } while (submitted < 0 && errno == EINTR);
+    if (submitted < 1) {
+        storeRelease(ring->sq_tail, tail);
+        return false;
+    }
+    ring->inflight++;
+    return true;
+}
+
+bool uringRead(Uring *ring, int fd, void *buf, size_t len, uint64_t user_data) {
+    return uringSubmit(ring, IORING_OP_READ, fd, buf, len, user_data);
+}
+
+bool uringWrite(Uring *ring, int fd, const void *buf, size_t len, uint64_t user_data) {
+    return uringSubmit(ring, IORING_OP_WRITE, fd, buf, len, user_data);
+}
+
+// Function to wait for the next completion and take it off the ring
+bool uringWait(Uring *ring, uint64_t *user_data, int *result) {
+    if (ring->inflight == 0) {
+        return false;
+    }
+    unsigned head = *ring->cq_head;
+    while (head == loadAcquire(ring->cq_tail)) {
+        if (uringEnter(ring->fd, 0, 1, IORING_ENTER_GETEVENTS) < 0 && errno != EINTR) {
+            return false;
+        }
+    }
+    struct io_uring_cqe *cqe = (struct io_uring_cqe *)ring->cqes + (head & *ring->cq_mask);
+    *user_data = cqe->user_data;
+    *result = cqe->res;
+    storeRelease(ring->cq_head, head + 1);
+    ring->inflight--;
+    return true;
+}
+
+#else
+
+// Without io_uring every ring fails to set up and callers fall back
+
+bool uringInit(Uring *ring, unsigned entries) {
+    (void)entries;
+    memset(ring, 0, sizeof(*ring));
+    ring->fd = -1;
+    return false;
+}
+
+void uringFree(Uring *ring) {
+    (void)ring;
+}
+
+bool uringRead(Uring *ring, int fd, void *buf, size_t len, uint64_t user_data) {
+    (void)ring, (void)fd, (void)buf, (void)len, (void)user_data;
+    return false;
+}
+
+bool uringWrite(Uring *ring, int fd, const void *buf, size_t len, uint64_t user_data) {
+    (void)ring, (void)fd, (void)buf, (void)len, (void)user_data;
+    return false;
+}
+
+bool uringWait(Uring *ring, uint64_t *user_data, int *result) {
+    (void)ring, (void)user_data, (void)result;
+    return false;
+}
+
+#endif
@@ -0,0 +1,69 @@
+/* 
+ * uring.h
+ *
+ * Copyright 2024 Clay Gomera
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-only
+ */
+
+// A minimal io_uring client on the raw system calls, for the batch I/O
+
+#ifndef URING_H
+#define URING_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Struct for an io_uring instance: the submission and completion rings
+// shared with the kernel
+typedef struct _Uring {
+    int fd;
+    unsigned entries;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    void *sqes;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    void *cqes;
+    void *sq_ring;
+    size_t sq_ring_size;
+    void *cq_ring;
+    size_t cq_ring_size;
+    size_t sqes_size;
+    // Requests submitted and not yet completed
+    unsigned inflight;
+} Uring;
+
+// Function to set up a ring of entries requests. Returns false where
+// io_uring is missing or disabled, so callers can fall back to read(2)
+// and write(2).
+bool uringInit(Uring *ring, unsigned entries);
+void uringFree(Uring *ring);
+
+// Functions to submit a read or write of len bytes at the file position of
+// fd, tagged with user_data. Returns false when the ring is full.
+bool uringRead(Uring *ring, int fd, void *buf, size_t len, uint64_t user_data);
+bool uringWrite(Uring *ring, int fd, const void *buf, size_t len, uint64_t user_data);
+
+// Function to wait for the next completion, giving its tag and result, the
+// byte count or a negative errno
+bool uringWait(Uring *ring, uint64_t *user_data, int *result);
+
+#endif